@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uap/rule_dfa.h"
+
+// A ruleset converted from regexes.yaml into C tables at build time by
+// util/uapgen.c, so it can be loaded without libyaml. All strings live in a
+// single pool in the packed format used by unique_strings, and are referred
+// to by their offset in it.
+
+
+enum builtin_rule_group {
+	BUILTIN_GROUP_USER_AGENT = 0,
+	BUILTIN_GROUP_OS,
+	BUILTIN_GROUP_DEVICE,
+};
+
+
+struct builtin_replacement {
+	uint32_t value;  // offset of the replacement value in `strings`
+	uint8_t field;   // field within the group, in uap_useragent_info order
+};
+
+
+struct builtin_rule {
+	uint32_t regex;             // offset of the expression in `strings`
+	uint32_t first_replacement; // index into `replacements`
+	uint8_t num_replacements;
+	uint8_t group;              // enum builtin_rule_group
+	char regex_flag;            // 'i' or '\0'
+};
+
+
+struct builtin_ruleset {
+	const char *strings;        // packed, null terminated strings
+	size_t strings_size;
+	uint32_t string_other;      // offset of "Other"
+	const struct builtin_rule *rules; // in file order, grouped by `group`
+	uint32_t num_rules;
+	const struct builtin_replacement *replacements;
+	uint32_t num_replacements;
+};
+
+
+// Defined by the generated sources, see the Makefile.
+extern const struct builtin_ruleset builtin_ruleset;
+
+// Precomputed DFA states for each group, in enum builtin_rule_group order.
+extern const struct rule_dfa_table *const builtin_matchers[];
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct prefilter_t;
+
+
+// Allocate and initialize a new prefilter_t instance.
+struct prefilter_t *prefilter_create();
+
+
+// Destroy and free a prefilter_t instance.
+void prefilter_destroy(struct prefilter_t *);
+
+
+// Analyze `regex` for literal substrings which must be present in any string
+// it can match, and associate them with `rule_id`. If no usable literals are
+// found, the rule is considered a candidate for every input string.
+// Returns true if the rule will be filtered by literals.
+bool prefilter_add_regex(struct prefilter_t *, uint32_t rule_id, const char *regex, bool caseless);
+
+
+// Build the scanning automaton from the added rules. After compiling, no more
+// rules may be added.
+void prefilter_compile(struct prefilter_t *);
+
+
+// The number of uint64_t words required to hold a candidate set.
+size_t prefilter_candidates_size(const struct prefilter_t *);
+
+
+// Scan `len` bytes of `str` once, setting the bit for every rule_id which may
+// match the string in `candidates` (prefilter_candidates_size() words).
+void prefilter_scan(const struct prefilter_t *, const char *str, size_t len, uint64_t *candidates);
+
+
+// The number of bytes required by prefilter_serialize().
+size_t prefilter_serialized_size(const struct prefilter_t *);
+
+
+// Write the compiled automaton to `out`, which must be 8 byte aligned and at
+// least prefilter_serialized_size() bytes long.
+void prefilter_serialize(const struct prefilter_t *, void *out);
+
+
+// Create a compiled prefilter from data written by prefilter_serialize(). The
+// data is used in place, so it must be 8 byte aligned and outlive the
+// prefilter. Returns NULL if the data is malformed.
+struct prefilter_t *prefilter_deserialize(const void *data, size_t size);
+
+
+// Test whether `rule_id` was marked as a candidate by prefilter_scan().
+static inline bool prefilter_is_candidate(const uint64_t *candidates, uint32_t rule_id) {
+	return (candidates[rule_id >> 6] >> (rule_id & 63)) & 1;
+}
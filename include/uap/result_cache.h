@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct result_cache_t;
+struct uap_cache_stats;
+
+
+// Allocate and initialize a new result_cache_t which will hold at most
+// `max_memory` bytes of entries and bookkeeping.
+struct result_cache_t *result_cache_create(size_t max_memory);
+
+
+// Destroy and free a result_cache_t instance.
+void result_cache_destroy(struct result_cache_t *);
+
+
+// Look up the value stored for `key` and `tag`, which is an extra piece of
+// the key identifying the kind of result. If found, `found_cb` is called with
+// the value while the entry is still locked, so it must copy whatever it
+// needs. Returns true on a hit.
+bool result_cache_lookup(
+		struct result_cache_t *,
+		const char *key,
+		size_t key_len,
+		uint32_t tag,
+		void (*found_cb)(void *ctx, const void *value, size_t value_len),
+		void *ctx);
+
+
+// Store the concatenation of `header` and `body` as the value for `key` and
+// `tag`, evicting the least recently used entries as required. Values which
+// would take up too much of the cache are silently dropped.
+void result_cache_insert(
+		struct result_cache_t *,
+		const char *key,
+		size_t key_len,
+		uint32_t tag,
+		const void *header,
+		size_t header_len,
+		const void *body,
+		size_t body_len);
+
+
+// Drop every entry, counting them as evictions.
+void result_cache_clear(struct result_cache_t *);
+
+
+// Sum up the counters of all shards.
+void result_cache_stats(struct result_cache_t *, struct uap_cache_stats *stats);
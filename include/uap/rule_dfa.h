@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Combines the expressions of a parser group into a single automaton which
+// finds the first rule that can match a string in one pass over it. The DFA
+// is built lazily while scanning, into a cache owned by the scanning thread.
+//
+// Constructs which a DFA can't represent exactly (lookarounds, word
+// boundaries, back references, ...) are widened, so a reported rule may
+// still fail to match under PCRE, but a rule which would match is never
+// skipped.
+
+#define RULE_DFA_NO_MATCH UINT32_MAX
+#define RULE_DFA_TABLE_MISS UINT16_MAX
+#define RULE_DFA_TABLE_MAX_STATES RULE_DFA_TABLE_MISS
+
+struct rule_dfa_t;
+struct rule_dfa_cache_t;
+
+
+// DFA states computed ahead of time by rule_dfa_write_table(), so they can be
+// compiled in rather than discovered while scanning. Only the states reached
+// by some sample strings are included, leaving the cache to handle the rest.
+struct rule_dfa_table_state {
+	uint32_t base; // offset of the state's transitions in `check` and `next`
+	uint32_t best; // index of the first rule matched if the string ends here
+	bool done;     // nothing that follows can change `best`
+};
+
+struct rule_dfa_table {
+	// Of the rule_dfa the table was written from, to tell if it still fits
+	uint32_t num_rules;
+	uint32_t num_nfa_states;
+	uint32_t num_classes;
+	const unsigned char *class_map;
+
+	uint32_t num_states; // state 0 is the start state
+	const struct rule_dfa_table_state *states;
+
+	// The transition on byte class `c` from state `s` is next[base + c] if
+	// check[base + c] == s, and wasn't included otherwise. Rows overlap
+	// wherever their included transitions don't collide.
+	const uint16_t *check;
+	const uint16_t *next;
+};
+
+
+// Allocate and initialize a new rule_dfa_t instance.
+struct rule_dfa_t *rule_dfa_create();
+
+
+// Destroy and free a rule_dfa_t instance.
+void rule_dfa_destroy(struct rule_dfa_t *);
+
+
+// Add `regex` as the next rule in priority order. Rule ids must increase from
+// one call to the next. Returns false if the expression uses syntax the DFA
+// doesn't understand, in which case the rule isn't covered and must always be
+// tried separately.
+bool rule_dfa_add_regex(struct rule_dfa_t *, uint32_t rule_id, const char *regex, bool caseless);
+
+
+// Finish adding rules. After compiling, no more rules may be added.
+void rule_dfa_compile(struct rule_dfa_t *);
+
+
+// Allocate a cache of DFA states for scanning with `dfa` from one thread.
+struct rule_dfa_cache_t *rule_dfa_cache_create(const struct rule_dfa_t *dfa);
+
+
+// Destroy and free a rule_dfa_cache_t instance.
+void rule_dfa_cache_destroy(struct rule_dfa_cache_t *);
+
+
+// Scan `len` bytes of `str` and return the id of the first covered rule which
+// may match it, or RULE_DFA_NO_MATCH. Covered rules added before the returned
+// one are guaranteed not to match. If the cache thrashes the scan is
+// abandoned and 0 is returned, which rules nothing out.
+uint32_t rule_dfa_first(const struct rule_dfa_t *, struct rule_dfa_cache_t *, const char *str, size_t len);
+
+
+// Scan strings with `table` before falling back to a cache. Returns false if
+// the table wasn't written from an identical rule_dfa, which is left as is.
+bool rule_dfa_attach_table(struct rule_dfa_t *, const struct rule_dfa_table *);
+
+
+// Find the DFA states reached while scanning each of `samples`, and write
+// them to `out` as C source for a `static const struct rule_dfa_table` named
+// `name`, along with its arrays.
+bool rule_dfa_write_table(const struct rule_dfa_t *, FILE *out, const char *name, const char *const *samples, size_t num_samples);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct string_interner_t;
+struct uap_intern_stats;
+
+
+// Allocate and initialize a new string_interner_t which will hold at most
+// `max_memory` bytes of strings and bookkeeping.
+struct string_interner_t *string_interner_create(size_t max_memory);
+
+
+// Destroy and free a string_interner_t instance, along with all the strings
+// it handed out.
+void string_interner_destroy(struct string_interner_t *);
+
+
+// Get the interned copy of `length` bytes of `str`, adding it if it hasn't
+// been seen before. Interned strings are null terminated and never move, and
+// equal strings always get the same pointer. Each string is also given the
+// next ID, counting up from 0, which is stored to `id` unless it's NULL.
+// Strings which were interned already are found without taking a lock, so
+// any number of threads can intern at once. Returns NULL if adding the string
+// would exceed the memory limit.
+const char *string_interner_intern(struct string_interner_t *, const char *str, size_t length, uint32_t *id);
+
+
+// Get the number of strings interned so far, whose IDs are all below it.
+uint32_t string_interner_count(struct string_interner_t *);
+
+
+// Look up the string with the given ID and its length, unless `length` is
+// NULL. Returns NULL if there's no such ID.
+const char *string_interner_lookup(struct string_interner_t *, uint32_t id, size_t *length);
+
+
+// Fetch the number of interned strings and the memory they take up.
+void string_interner_stats(struct string_interner_t *, struct uap_intern_stats *stats);
@@ -1,4 +1,17 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+// Index of the rule which matched within each group, or -1 if none did or the
+// group wasn't evaluated. The same rule always has the same index for a given
+// ruleset, see uap_parser_rule_regex().
+struct uap_matched_rules {
+    int user_agent;
+    int os;
+    int device;
+};
 
 
 struct uap_useragent_info {
@@ -24,6 +37,88 @@ struct uap_useragent_info {
     } device;
 
     const char *strings;
+
+    struct uap_matched_rules rules;
+};
+
+
+// A string which isn't necessarily null terminated.
+struct uap_span {
+    const char *ptr;
+    size_t len;
+};
+
+
+// Parse results from uap_parser_parse_spans(). Each span points into either
+// the user agent string, the parser's own strings or the caller's scratch
+// buffer. Fields which weren't matched have a NULL ptr.
+struct uap_useragent_spans {
+    struct {
+        struct uap_span family;
+        struct uap_span major;
+        struct uap_span minor;
+        struct uap_span patch;
+    } user_agent;
+
+    struct {
+        struct uap_span family;
+        struct uap_span major;
+        struct uap_span minor;
+        struct uap_span patch;
+        struct uap_span patchMinor;
+    } os;
+
+    struct {
+        struct uap_span family;
+        struct uap_span brand;
+        struct uap_span model;
+    } device;
+
+    struct uap_matched_rules rules;
+};
+
+#define UAP_SPAN_FIELD_COUNT (offsetof(struct uap_useragent_spans, rules) / sizeof(struct uap_span))
+
+
+// Position of each field within uap_useragent_spans, uap_useragent_ids and
+// the columns of uap_parser_parse_columns()
+enum uap_field {
+    UAP_FIELD_USER_AGENT_FAMILY = 0,
+    UAP_FIELD_USER_AGENT_MAJOR,
+    UAP_FIELD_USER_AGENT_MINOR,
+    UAP_FIELD_USER_AGENT_PATCH,
+    UAP_FIELD_OS_FAMILY,
+    UAP_FIELD_OS_MAJOR,
+    UAP_FIELD_OS_MINOR,
+    UAP_FIELD_OS_PATCH,
+    UAP_FIELD_OS_PATCH_MINOR,
+    UAP_FIELD_DEVICE_FAMILY,
+    UAP_FIELD_DEVICE_BRAND,
+    UAP_FIELD_DEVICE_MODEL,
+    UAP_FIELD_COUNT,
+};
+
+
+// Groups of fields which can be selected with uap_parser_parse_groups()
+enum uap_parse_groups {
+    UAP_GROUP_USER_AGENT = (1 << 0), // user_agent.*
+    UAP_GROUP_OS         = (1 << 1), // os.*
+    UAP_GROUP_DEVICE     = (1 << 2), // device.*
+    UAP_GROUP_ALL        = UAP_GROUP_USER_AGENT | UAP_GROUP_OS | UAP_GROUP_DEVICE,
+};
+
+
+// Negative results returned by the parse functions. With MATCH_LIMIT,
+// TIME_BUDGET and PCRE the parse was cut short and its results are partial:
+// groups which matched before then are filled in as usual, the rest are left
+// empty with a rule index of -1.
+enum uap_status {
+    UAP_ERROR_SCRATCH_TOO_SMALL = -1, // the scratch buffer was too small, or a larger one couldn't be allocated
+    UAP_ERROR_INPUT_TOO_LONG    = -2, // longer than INT_MAX bytes or the max_input_length limit
+    UAP_ERROR_MATCH_LIMIT       = -3, // an expression hit the match_limit or match_limit_recursion
+    UAP_ERROR_TIME_BUDGET       = -4, // the parse_budget_ns ran out
+    UAP_ERROR_PCRE              = -5, // any other failure from pcre_exec()
+    UAP_ERROR_NO_DICTIONARY     = -6, // uap_parser_parse_ids() without uap_parser_set_interning()
 };
 
 
@@ -34,6 +129,43 @@ struct uap_parser;
 struct uap_parser * uap_parser_create();
 
 
+// Flags for uap_parser_create_with_flags()
+enum uap_parser_flags {
+	// Compile expressions with the PCRE JIT where possible. Each thread
+	// which parses gets its own JIT stack, the parser itself remains shared.
+	UAP_PARSER_JIT = (1 << 0),
+
+	// Count attempts, matches and the time spent in pcre_exec for every
+	// rule, see uap_parser_rule_stats(). Each thread keeps its own counters,
+	// which are only added up when read.
+	UAP_PARSER_STATS = (1 << 1),
+};
+
+
+// Allocate and initialize a new user_agent_parser with `flags` (UAP_PARSER_*).
+struct uap_parser * uap_parser_create_with_flags(unsigned int flags);
+
+
+// Set how many threads compile the expressions when rules are loaded, the
+// calling thread included. 0, the default, uses one per CPU, though small
+// rulesets use fewer. Must be called before the rules are loaded.
+void uap_parser_set_compile_threads(struct uap_parser *ua_parser, unsigned int num_threads);
+
+
+// Where the time went while loading rules, see uap_parser_load_stats()
+struct uap_load_stats {
+    uint64_t read_ns;             // reading rule records from YAML or the built-in tables
+    uint64_t compile_ns;          // compiling and studying the expressions
+    uint64_t index_ns;            // building the prefilter and DFAs
+    unsigned int compile_threads; // threads which took part in compiling
+    unsigned int failed_rules;    // expressions which didn't compile and were dropped
+};
+
+
+// Fetch the timings of the last load from YAML or the built-in ruleset.
+void uap_parser_load_stats(const struct uap_parser *ua_parser, struct uap_load_stats *stats);
+
+
 // Ingest a "regexes.yaml" from the uap-parser/uap-core project.
 int uap_parser_read_file(struct uap_parser *ua_parser, FILE *fd);
 
@@ -42,19 +174,381 @@ int uap_parser_read_file(struct uap_parser *ua_parser, FILE *fd);
 int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *buffer, const size_t bufsize);
 
 
-// Destroy and free a user_agent_parser instance.
+// Ingest the ruleset which was converted to C tables from "regexes.yaml" when
+// the library was built. No YAML is parsed, so this is the quickest way to
+// load a complete set of rules from scratch.
+int uap_parser_read_builtin(struct uap_parser *ua_parser);
+
+
+// Allocate a new user_agent_parser and load the built-in ruleset into it.
+// Returns NULL on failure.
+struct uap_parser * uap_parser_create_builtin();
+
+
+// Write one line per expression to `out` (which may be NULL) noting whether
+// it was JIT compiled or left to the interpreter, followed by a summary line.
+// Returns the number of JIT compiled expressions.
+int uap_parser_jit_report(const struct uap_parser *ua_parser, FILE *out);
+
+
+// Write the loaded and compiled rules to `fd` as a snapshot which can later
+// be loaded without parsing YAML or compiling any expressions. Snapshots are
+// specific to the PCRE version and machine architecture which created them.
+// Returns 1 on success, 0 on failure.
+int uap_parser_save_snapshot(const struct uap_parser *ua_parser, FILE *fd);
+
+
+// Load a snapshot written by uap_parser_save_snapshot() into a freshly
+// created parser. The file is mapped into memory and used in place.
+// Returns 1 on success, 0 on failure (including snapshots from a different
+// PCRE version, which should be regenerated from regexes.yaml).
+int uap_parser_load_snapshot(struct uap_parser *ua_parser, const char *path);
+
+
+// As uap_parser_load_snapshot(), but from a buffer which must be 8 byte
+// aligned and must outlive the parser.
+int uap_parser_load_snapshot_buffer(struct uap_parser *ua_parser, const void *buffer, size_t size);
+
+
+// Destroy and free a user_agent_parser instance. No thread may still be
+// parsing with it, but threads which have parsed with it may exit at any time.
 void uap_parser_destroy(struct uap_parser *ua_parser);
 
 
 // Parse a user agent string into the provided user_agent_info structure.
 // The user_agent_info instance can be reused for different user agent strings.
-// Returns the number of matched groups (user agent, os, device)
+// The strings are only replaced if something matched, but `rules` is always
+// updated to tell which rule matched in each group.
+// Returns the number of matched groups (user agent, os, device), or one of
+// UAP_ERROR_* if the parse was cut short by uap_parser_set_limits().
 int uap_parser_parse_string(
         const struct uap_parser *ua_parser,
         struct uap_useragent_info *ua_info,
         const char *user_agent_string);
 
 
+// As uap_parser_parse_string(), but for `user_agent_length` bytes of
+// `user_agent_string` which doesn't need to be null terminated.
+int uap_parser_parse_string_len(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const char *user_agent_string,
+        size_t user_agent_length);
+
+
+// As uap_parser_parse_string_len(), but only the expressions for the groups
+// in `groups` (UAP_GROUP_*) are evaluated. Fields of the other groups are
+// left empty. Skipping groups that aren't needed, especially the device
+// group, saves most of their cost.
+int uap_parser_parse_groups(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_info *ua_info,
+        const char *user_agent_string,
+        size_t user_agent_length,
+        unsigned int groups);
+
+
+// Parse a user agent string into `spans` without allocating any memory.
+// Replacements built from "$1" style templates are written to `scratch`,
+// `scratch_size` holds its size on input and the number of bytes used on
+// return. If the buffer is too small, UAP_ERROR_SCRATCH_TOO_SMALL is returned
+// and `scratch_size` holds the required size.
+// Returns the number of matched groups (user agent, os, device)
+int uap_parser_parse_spans(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_spans *spans,
+        const char *user_agent_string,
+        char *scratch,
+        size_t *scratch_size);
+
+
+// As uap_parser_parse_spans(), but for `user_agent_length` bytes of
+// `user_agent_string` which doesn't need to be null terminated. Nothing
+// beyond `user_agent_length` is ever read.
+int uap_parser_parse_spans_len(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_spans *spans,
+        const char *user_agent_string,
+        size_t user_agent_length,
+        char *scratch,
+        size_t *scratch_size);
+
+
+// As uap_parser_parse_spans_len(), but only evaluating the groups in `groups`
+// (UAP_GROUP_*). Fields of the other groups are left with a NULL ptr.
+int uap_parser_parse_spans_groups(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_spans *spans,
+        const char *user_agent_string,
+        size_t user_agent_length,
+        unsigned int groups,
+        char *scratch,
+        size_t *scratch_size);
+
+
+// Parse `count` user agents spread across `num_threads` threads (0 for one
+// per CPU), the calling thread included. Results are written to the
+// corresponding entries of `ua_infos`, which must be initialized, and the
+// return value of each parse to `results` unless it's NULL. Work is divided
+// up dynamically, so uneven user agents don't leave threads idle.
+// Returns the number of user agents for which at least one group matched.
+size_t uap_parser_parse_batch(
+        const struct uap_parser *ua_parser,
+        const struct uap_span *user_agents,
+        size_t count,
+        struct uap_useragent_info *ua_infos,
+        int *results,
+        unsigned int num_threads);
+
+
+// Look up the source expression of rule `index` in `group` (one of
+// UAP_GROUP_*), as reported in uap_matched_rules. The string is owned by the
+// parser. Returns NULL if there's no such rule.
+const char *uap_parser_rule_regex(const struct uap_parser *ua_parser, unsigned int group, int index);
+
+
+// Bounds on the work done by a single parse, see uap_parser_set_limits().
+// Zero leaves a limit at its default, which is unbounded apart from PCRE's
+// own match limits.
+struct uap_parser_limits {
+    unsigned long match_limit;           // per expression, as PCRE's match_limit
+    unsigned long match_limit_recursion; // per expression, as PCRE's match_limit_recursion
+    uint64_t parse_budget_ns;            // for all of the expressions run by a parse
+    size_t max_input_length;             // longer user agents aren't parsed at all
+};
+
+
+// Apply `limits` to every parse from now on, or remove them if NULL. When an
+// expression hits a match limit its group is left unmatched and the other
+// groups are still parsed. The budget is checked before running each
+// expression, after which no more are run. Either way the parse returns the
+// matching UAP_ERROR_* status along with the partial results. This must not
+// be called while other threads are using the parser.
+void uap_parser_set_limits(struct uap_parser *ua_parser, const struct uap_parser_limits *limits);
+
+
+// Counters reported by uap_parser_cache_stats()
+struct uap_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    size_t entries;
+    size_t memory_used; // bytes
+};
+
+
+// Attach a cache of parse results to the parser, keyed by the full user agent
+// string and limited to roughly `max_memory` bytes. The cache is consulted by
+// uap_parser_parse_string() and uap_parser_parse_string_len(), and is safe to
+// use from multiple threads. Passing 0 removes the cache. This must not be
+// called while other threads are using the parser.
+// Returns 1 on success, 0 on failure.
+int uap_parser_set_cache(struct uap_parser *ua_parser, size_t max_memory);
+
+
+// Fetch the result cache counters. All zeros if no cache is attached.
+void uap_parser_cache_stats(const struct uap_parser *ua_parser, struct uap_cache_stats *stats);
+
+
+// Counters reported by uap_parser_intern_stats()
+struct uap_intern_stats {
+    size_t strings;     // distinct strings interned
+    size_t memory_used; // bytes
+    uint64_t rejected;  // strings which didn't fit and were copied instead
+};
+
+
+// Have uap_parser_parse_string() and its variants point the fields of their
+// results at strings shared by every parse, rather than copying them into
+// the result. Only values the parser hasn't returned before are copied into
+// the shared strings, which are limited to roughly `max_memory` bytes, so
+// parses of familiar user agents allocate nothing. Shared strings stay valid
+// for as long as the parser, and equal fields get the same pointer, so they
+// can be compared by pointer. Once the shared strings are full, new values
+// are copied into the result as before, and only pointers which differ from
+// those of other results say nothing. Passing 0 turns interning off. Calling
+// this again starts over with new shared strings and a new dictionary, so
+// pointers and IDs can only be compared with those of results since, but the
+// strings of earlier results stay valid. This must not be called while other
+// threads are using the parser.
+// Returns 1 on success, 0 on failure.
+int uap_parser_set_interning(struct uap_parser *ua_parser, size_t max_memory);
+
+
+// Fetch the interning counters. All zeros if interning is off.
+void uap_parser_intern_stats(const struct uap_parser *ua_parser, struct uap_intern_stats *stats);
+
+
+// The ID of a field whose string didn't fit in the dictionary
+#define UAP_ID_NONE UINT32_MAX
+
+
+// Parse results from uap_parser_parse_ids(), each field as the ID of its
+// string in the parser's dictionary. Fields which weren't matched are 0, the
+// ID of the empty string.
+struct uap_useragent_ids {
+    struct {
+        uint32_t family;
+        uint32_t major;
+        uint32_t minor;
+        uint32_t patch;
+    } user_agent;
+
+    struct {
+        uint32_t family;
+        uint32_t major;
+        uint32_t minor;
+        uint32_t patch;
+        uint32_t patchMinor;
+    } os;
+
+    struct {
+        uint32_t family;
+        uint32_t brand;
+        uint32_t model;
+    } device;
+
+    struct uap_matched_rules rules;
+};
+
+
+// Parse `user_agent_length` bytes of `user_agent_string` into IDs, evaluating
+// only the groups in `groups` (UAP_GROUP_*). The dictionary is made of the
+// interned strings, so uap_parser_set_interning() must have been called, and
+// a string gets the same ID for as long as the parser lives. When set up
+// after the rules were loaded, the literal values of the rules come first,
+// and get the same IDs for every parser with the same rules. Values captured
+// from user agents are added as they're first seen. Nothing is allocated
+// unless a value is new.
+// Returns the number of matched groups, or one of UAP_ERROR_*.
+int uap_parser_parse_ids(
+        const struct uap_parser *ua_parser,
+        struct uap_useragent_ids *ids,
+        const char *user_agent_string,
+        size_t user_agent_length,
+        unsigned int groups);
+
+
+// Get the number of strings in the dictionary. Their IDs are 0 up to one
+// less than that, so they can be enumerated with uap_parser_dictionary_string().
+uint32_t uap_parser_dictionary_size(const struct uap_parser *ua_parser);
+
+
+// Look up the string with the given ID, and its length unless `length` is
+// NULL. The string is owned by the parser. Returns NULL for unknown IDs.
+const char *uap_parser_dictionary_string(const struct uap_parser *ua_parser, uint32_t id, size_t *length);
+
+
+// A string written to the heap of uap_columns
+struct uap_heap_string {
+    uint32_t offset;
+    uint32_t length;
+};
+
+
+// Caller supplied arrays for uap_parser_parse_columns() to write each field
+// of the results to, one entry per user agent. Any of them may be NULL to
+// leave that field out, in one form or both.
+struct uap_columns {
+    uint32_t *ids[UAP_FIELD_COUNT];                  // dictionary IDs, as uap_parser_parse_ids()
+    struct uap_heap_string *strings[UAP_FIELD_COUNT]; // strings copied to `heap`
+    struct uap_matched_rules *rules;
+
+    // Shared by all the string columns. `heap_size` holds its size on input
+    // and the number of bytes used on return, or needed if it was too small.
+    char *heap;
+    size_t heap_size;
+};
+
+
+// Parse `count` user agents across `num_threads` threads like
+// uap_parser_parse_batch(), evaluating the groups in `groups` (UAP_GROUP_*),
+// and write the results column by column. ID columns need
+// uap_parser_set_interning(), otherwise their rows fail with
+// UAP_ERROR_NO_DICTIONARY. Strings are written to the heap in whatever order
+// the rows happen to be parsed. Rows whose strings don't fit in the heap
+// fail with UAP_ERROR_SCRATCH_TOO_SMALL and get empty strings, and the heap
+// size needed for the whole batch is returned in `heap_size`. The return
+// value of each parse goes to `results` unless it's NULL, and unmatched
+// fields are empty.
+// Returns the number of user agents for which at least one group matched.
+size_t uap_parser_parse_columns(
+        const struct uap_parser *ua_parser,
+        const struct uap_span *user_agents,
+        size_t count,
+        unsigned int groups,
+        struct uap_columns *columns,
+        int *results,
+        unsigned int num_threads);
+
+
+// Counters of a single rule reported by uap_parser_rule_stats()
+struct uap_rule_stats {
+    unsigned int group;   // UAP_GROUP_* the rule belongs to
+    unsigned int index;   // position of the rule within its group
+    const char *regex;    // source expression, owned by the parser
+    uint64_t attempts;    // times the expression was run, rather than skipped
+    uint64_t matches;
+    uint64_t nanoseconds; // total time spent running the expression
+};
+
+
+// Fill in up to `max_stats` entries of `stats`, one per rule in group order,
+// with the counters of a parser created with UAP_PARSER_STATS (otherwise they
+// are all zero). Counters of every thread are added up, including threads
+// which have exited. Returns the total number of rules, which may be larger
+// than `max_stats`.
+size_t uap_parser_rule_stats(const struct uap_parser *ua_parser, struct uap_rule_stats *stats, size_t max_stats);
+
+
+// Write one tab separated line per rule to `out` with its group, index,
+// attempts, matches, nanoseconds and expression, followed by a summary line.
+// Returns 1 on success, 0 on failure.
+int uap_parser_rule_stats_report(const struct uap_parser *ua_parser, FILE *out);
+
+
+// A handle to a parser which can be replaced while other threads are parsing
+// with it. Readers never block: each parse is bracketed by acquire/release,
+// and a replaced parser is only destroyed once every reader which could still
+// be using it has released it.
+struct uap_reloadable;
+
+
+// Wrap `ua_parser`, which the handle takes ownership of. Returns NULL on
+// failure, in which case the parser is left to the caller.
+struct uap_reloadable * uap_reloadable_create(struct uap_parser *ua_parser);
+
+
+// Destroy the handle along with its current parser. This must not be called
+// while other threads are using it.
+void uap_reloadable_destroy(struct uap_reloadable *reloadable);
+
+
+// Get the current parser for the calling thread to parse with, until it calls
+// uap_reloadable_release(). Calls mustn't be nested. Returns NULL if the
+// thread couldn't be registered.
+const struct uap_parser * uap_reloadable_acquire(struct uap_reloadable *reloadable);
+
+
+// Finish with the parser returned by uap_reloadable_acquire().
+void uap_reloadable_release(struct uap_reloadable *reloadable);
+
+
+// Replace the current parser with `ua_parser`, which the handle takes
+// ownership of. Returns once the previous parser has been destroyed, after
+// waiting for the readers which acquired it to release it. Loading and
+// configuring the new parser beforehand, e.g. from a background thread, is
+// up to the caller.
+void uap_reloadable_publish(struct uap_reloadable *reloadable, struct uap_parser *ua_parser);
+
+
+// Load a new parser created with `flags` from a "regexes.yaml" and publish it.
+// The current parser is kept if no rules could be loaded.
+// Returns 1 on success, 0 on failure.
+int uap_reloadable_reload_file(struct uap_reloadable *reloadable, FILE *fd, unsigned int flags);
+
+
 // Create a new structure for holding parsed user-agent results.
 struct uap_useragent_info * uap_useragent_info_create();
 
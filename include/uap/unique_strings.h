@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 struct unique_strings_t;
 
 struct buffer_t;
@@ -25,6 +29,11 @@ void unique_strings_destroy(struct unique_strings_t *);
 struct unique_string_handle_t unique_strings_add(struct unique_strings_t *, const char *str);
 
 
+// As unique_strings_add(), but for `length` bytes of `str` which needn't be
+// null terminated, though they mustn't contain a null byte either.
+struct unique_string_handle_t unique_strings_add_len(struct unique_strings_t *, const char *str, size_t length);
+
+
 // Free internal structures and buffers. Memory footprint will be reduced to
 // little more than the space required to hold all the added strings.  After
 // freezing, no more strings may be added.
@@ -36,6 +45,26 @@ void unique_strings_freeze(struct unique_strings_t *);
 const char* unique_strings_get(const struct unique_string_handle_t *);
 
 
+// Create an already frozen instance around `size` bytes of string data
+// previously obtained from unique_strings_data(). The data is not copied and
+// must outlive the instance.
+struct unique_strings_t *unique_strings_create_static(const char *data, size_t size);
+
+
+// Get the packed string data of a frozen instance, and its size in bytes.
+const char *unique_strings_data(const struct unique_strings_t *, size_t *size);
+
+
+// Rebuild a handle from the `addr` of a handle previously returned by
+// unique_strings_add(), relative to the same string data.
+struct unique_string_handle_t unique_strings_handle(struct unique_strings_t *, size_t addr);
+
+
 // Check if the given string is owned by the unique strings instance.  If it is
 // owned, then it's managed and you shouldn't attempt to free it.
 bool unique_strings_owns(struct unique_strings_t *, const char *str);
+
+
+// MurmurHash2 of `len` bytes of `data`, also used for hashing outside of the
+// unique strings collection.
+uint32_t hash_murmur2(const char *data, int len, uint32_t seed);
@@ -1,10 +1,13 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <yaml.h>
 
+#include "uap/prefilter.h"
 #include "uap/uap.h"
+#include "uap/unique_strings.h"
 
 #define MAKE_FOURCC(a,b,c,d) ((a)|((b)<<8)|((c)<<16)|((d)<<24))
 
@@ -194,18 +197,146 @@ static void run_test_file(
 }
 
 
-int main(int argc, char** argv) {
-	(void)argc;
-	(void)argv;
-
-
-	struct uap_parser *ua_parser = uap_parser_create();
+static struct uap_parser *create_parser(unsigned int flags) {
+	struct uap_parser *ua_parser = uap_parser_create_with_flags(flags);
 	FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
 	if (fd != NULL) {
 		uap_parser_read_file(ua_parser, fd);
 		fclose(fd);
 	} else {
 		uap_parser_destroy(ua_parser);
+		return NULL;
+	}
+	return ua_parser;
+}
+
+
+// Collect the user agent strings of a test file, up to `max_count` of them.
+static size_t read_user_agents(const char *filepath, char **user_agents, size_t max_count) {
+	yaml_parser_t yaml_parser;
+	FILE *fd = fopen(filepath, "rb");
+	if (fd == NULL || !yaml_parser_initialize(&yaml_parser)) {
+		return 0;
+	}
+	yaml_parser_set_input_file(&yaml_parser, fd);
+
+	yaml_token_t token;
+	memset(&token, 0, sizeof(yaml_token_t));
+	bool is_key = false;
+	bool is_user_agent = false;
+	size_t count = 0;
+
+	do {
+		yaml_token_delete(&token);
+		yaml_parser_scan(&yaml_parser, &token);
+
+		if (token.type == YAML_KEY_TOKEN || token.type == YAML_VALUE_TOKEN) {
+			is_key = token.type == YAML_KEY_TOKEN;
+		} else if (token.type == YAML_SCALAR_TOKEN) {
+			const char *value = (const char*)token.data.scalar.value;
+			if (is_key) {
+				is_user_agent = strcmp(value, "user_agent_string") == 0;
+			} else if (is_user_agent && count < max_count) {
+				user_agents[count] = malloc(strlen(value) + 1);
+				memcpy(user_agents[count++], value, strlen(value) + 1);
+				is_user_agent = false;
+			}
+		}
+	} while (token.type && token.type != YAML_STREAM_END_TOKEN);
+
+	yaml_token_delete(&token);
+	yaml_parser_delete(&yaml_parser);
+	fclose(fd);
+	return count;
+}
+
+
+// Parse `count` user agents as a batch across `num_threads` threads and
+// compare every result with parsing them one at a time. Returns the number
+// of differences.
+static int check_batch(struct uap_parser *ua_parser, char **user_agents, size_t count, unsigned int num_threads) {
+	struct uap_span *spans = malloc(count * sizeof(struct uap_span));
+	struct uap_useragent_info *infos = malloc(count * sizeof(struct uap_useragent_info));
+	int *results = malloc(count * sizeof(int));
+	struct uap_useragent_info *expected = uap_useragent_info_create();
+	size_t expected_matched = 0;
+	int failures = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		spans[i] = (struct uap_span){ user_agents[i], strlen(user_agents[i]) };
+		uap_useragent_info_init(&infos[i]);
+	}
+
+	const size_t matched = uap_parser_parse_batch(ua_parser, spans, count, infos, results, num_threads);
+
+	for (size_t i = 0; i < count; i++) {
+		const int result = uap_parser_parse_string_len(ua_parser, expected, spans[i].ptr, spans[i].len);
+		expected_matched += result > 0;
+
+		const char **expected_fields = (const char**)expected;
+		const char **fields = (const char**)&infos[i];
+		bool same = result == results[i] && memcmp(&expected->rules, &infos[i].rules, sizeof(expected->rules)) == 0;
+		for (int f = 0; f < UAP_FIELD_COUNT && same && result > 0; f++) {
+			same = strcmp(expected_fields[f], fields[f]) == 0;
+		}
+		if (!same) {
+			fprintf(stderr, "batch result for \"%s\" differs\n", user_agents[i]);
+			failures++;
+		}
+		uap_useragent_info_cleanup(&infos[i]);
+	}
+
+	if (matched != expected_matched) {
+		fprintf(stderr, "batch matched %lu, expected %lu\n", (unsigned long)matched, (unsigned long)expected_matched);
+		failures++;
+	}
+
+	uap_useragent_info_destroy(expected);
+	free(results);
+	free(infos);
+	free(spans);
+	return failures;
+}
+
+
+// Keep parsing through a reloadable parser until told to stop, counting any
+// wrong results.
+struct reload_reader {
+	struct uap_reloadable *reloadable;
+	int stop;
+	int parses;
+	int failures;
+};
+
+
+static void *reload_reader_run(void *ptr) {
+	struct reload_reader *reader = ptr;
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	const char *ua = "Mozilla/5.0 (Linux; Android 11; Pixel 5) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.120 Mobile Safari/537.36";
+
+	while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+		const struct uap_parser *ua_parser = uap_reloadable_acquire(reader->reloadable);
+		if (ua_parser == NULL
+				|| uap_parser_parse_string(ua_parser, ua_info, ua) != 3
+				|| strcmp(ua_info->user_agent.family, "Chrome Mobile") != 0) {
+			reader->failures++;
+		}
+		uap_reloadable_release(reader->reloadable);
+		reader->parses++;
+	}
+
+	uap_useragent_info_destroy(ua_info);
+	return NULL;
+}
+
+
+int main(int argc, char** argv) {
+	(void)argc;
+	(void)argv;
+
+
+	struct uap_parser *ua_parser = create_parser(0);
+	if (ua_parser == NULL) {
 		return -1;
 	}
 
@@ -222,6 +353,679 @@ int main(int argc, char** argv) {
 	run_test_file("../uap-core/test_resources/pgts_browser_list.yaml", 0, ua_parser, &get_field_index_for_ua_test);
 	// ^ this thing is 2MB of user agent strings, and so it takes forever to run.
 
+	// Batches across threads give the same results as parsing one by one,
+	// also with fewer user agents than threads
+	char *batch_uas[4096];
+	const size_t num_batch_uas = read_user_agents("../uap-core/tests/test_ua.yaml", batch_uas, 4096);
+	if (num_batch_uas < 100
+			|| check_batch(ua_parser, batch_uas, num_batch_uas, 4) != 0
+			|| check_batch(ua_parser, batch_uas, 3, 8) != 0
+			|| check_batch(ua_parser, batch_uas, 0, 2) != 0) {
+		fprintf(stderr, "batch parsing failed\n");
+		return 1;
+	}
+	printf("batch: %lu user agents\n", (unsigned long)num_batch_uas);
+	for (size_t i = 0; i < num_batch_uas; i++) {
+		free(batch_uas[i]);
+	}
+
+	uap_parser_destroy(ua_parser);
+
+	// Base tests again with JIT compiled expressions
+	ua_parser = create_parser(UAP_PARSER_JIT);
+	if (ua_parser == NULL) {
+		return -1;
+	}
+	printf("%d expressions JIT compiled\n", uap_parser_jit_report(ua_parser, NULL));
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+
+	uap_parser_destroy(ua_parser);
+
+	// Base tests again with the expressions compiled across several threads
+	ua_parser = uap_parser_create();
+	uap_parser_set_compile_threads(ua_parser, 4);
+	FILE *regexes = fopen("../uap-core/regexes.yaml", "rb");
+	if (regexes == NULL || !uap_parser_read_file(ua_parser, regexes)) {
+		return -1;
+	}
+	fclose(regexes);
+
+	struct uap_load_stats load_stats;
+	uap_parser_load_stats(ua_parser, &load_stats);
+	printf("load: %.2f ms reading, %.2f ms compiling on %u threads, %.2f ms indexing\n",
+			load_stats.read_ns / 1e6, load_stats.compile_ns / 1e6, load_stats.compile_threads, load_stats.index_ns / 1e6);
+	if (load_stats.compile_threads != 4 || load_stats.failed_rules != 0) {
+		fprintf(stderr, "expected every rule to compile on 4 threads\n");
+		return 1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+
+	uap_parser_destroy(ua_parser);
+
+	// Count what every rule does while running the user agent tests
+	ua_parser = create_parser(UAP_PARSER_STATS);
+	if (ua_parser == NULL) {
+		return -1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+
+	const size_t num_rules = uap_parser_rule_stats(ua_parser, NULL, 0);
+	struct uap_rule_stats *rule_stats = calloc(num_rules, sizeof(struct uap_rule_stats));
+	if (rule_stats == NULL || uap_parser_rule_stats(ua_parser, rule_stats, num_rules) != num_rules) {
+		return -1;
+	}
+
+	uint64_t user_agent_matches = 0;
+	for (size_t i = 0; i < num_rules; i++) {
+		if (rule_stats[i].matches > rule_stats[i].attempts || rule_stats[i].regex == NULL) {
+			fprintf(stderr, "bad counters for rule %u\n", rule_stats[i].index);
+			return 1;
+		}
+		if (rule_stats[i].group == UAP_GROUP_USER_AGENT) {
+			user_agent_matches += rule_stats[i].matches;
+		}
+	}
+	printf("rule stats: %lu user agent matches\n", (unsigned long)user_agent_matches);
+	if (user_agent_matches == 0) {
+		fprintf(stderr, "expected the user agent rules to be counted\n");
+		return 1;
+	}
+
+	free(rule_stats);
+	uap_parser_destroy(ua_parser);
+
+	// Run the user agent tests twice through the result cache, the second
+	// pass should be answered from the cache.
+	ua_parser = create_parser(0);
+	if (ua_parser == NULL || !uap_parser_set_cache(ua_parser, 16 * 1024 * 1024)) {
+		return -1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+
+	struct uap_cache_stats cache_stats;
+	uap_parser_cache_stats(ua_parser, &cache_stats);
+	printf("cache: %lu hits, %lu misses\n", (unsigned long)cache_stats.hits, (unsigned long)cache_stats.misses);
+	if (cache_stats.hits < cache_stats.misses) {
+		fprintf(stderr, "expected the second pass to hit the cache\n");
+		return 1;
+	}
+
+	// Results name the rule which matched in each group, whether they were
+	// parsed or came from the cache
+	const char *provenance_ua = "Mozilla/5.0 (Linux; Android 11; Pixel 5) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.120 Mobile Safari/537.36";
+	struct uap_useragent_info *provenance_info = uap_useragent_info_create();
+	struct uap_matched_rules parsed_rules;
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (uap_parser_parse_string(ua_parser, provenance_info, provenance_ua) != 3
+				|| uap_parser_rule_regex(ua_parser, UAP_GROUP_USER_AGENT, provenance_info->rules.user_agent) == NULL
+				|| uap_parser_rule_regex(ua_parser, UAP_GROUP_OS, provenance_info->rules.os) == NULL
+				|| uap_parser_rule_regex(ua_parser, UAP_GROUP_DEVICE, provenance_info->rules.device) == NULL
+				|| (pass > 0 && memcmp(&parsed_rules, &provenance_info->rules, sizeof(parsed_rules)) != 0)) {
+			fprintf(stderr, "missing matched rules for \"%s\"\n", provenance_ua);
+			return 1;
+		}
+		parsed_rules = provenance_info->rules;
+	}
+
+	if (uap_parser_parse_string(ua_parser, provenance_info, "") != 0
+			|| provenance_info->rules.user_agent != -1
+			|| provenance_info->rules.os != -1
+			|| provenance_info->rules.device != -1
+			|| uap_parser_rule_regex(ua_parser, UAP_GROUP_OS, -1) != NULL) {
+		fprintf(stderr, "expected no matched rules for an empty user agent\n");
+		return 1;
+	}
+
+	// Spans hold the same strings without allocating, with the replacements
+	// built from templates written to the scratch buffer, which must be large
+	// enough for them
+	uap_parser_parse_string(ua_parser, provenance_info, provenance_ua);
+	struct uap_useragent_spans spans;
+	char spans_scratch[256];
+	size_t spans_scratch_size = 0;
+
+	if (uap_parser_parse_spans(ua_parser, &spans, provenance_ua, spans_scratch, &spans_scratch_size) != UAP_ERROR_SCRATCH_TOO_SMALL
+			|| spans_scratch_size == 0
+			|| spans_scratch_size > sizeof(spans_scratch)) {
+		fprintf(stderr, "expected \"%s\" to need scratch space\n", provenance_ua);
+		return 1;
+	}
+
+	const size_t spans_scratch_needed = spans_scratch_size;
+	if (uap_parser_parse_spans(ua_parser, &spans, provenance_ua, spans_scratch, &spans_scratch_size) != 3
+			|| spans_scratch_size != spans_scratch_needed
+			|| memcmp(&spans.rules, &provenance_info->rules, sizeof(spans.rules)) != 0) {
+		fprintf(stderr, "failed to parse \"%s\" into spans\n", provenance_ua);
+		return 1;
+	}
+	for (int f = 0; f < UAP_FIELD_COUNT; f++) {
+		const struct uap_span *span = &((const struct uap_span*)&spans)[f];
+		const char *expected = ((const char**)provenance_info)[f];
+		if (span->ptr == NULL ? *expected != '\0' : span->len != strlen(expected) || memcmp(span->ptr, expected, span->len) != 0) {
+			fprintf(stderr, "span %d of \"%s\" differs from \"%s\"\n", f, provenance_ua, expected);
+			return 1;
+		}
+	}
+
+	// Length delimited user agents are parsed without reading past their end,
+	// neither the rest of a longer string nor anything after an unterminated one
+	const size_t provenance_length = strlen(provenance_ua);
+	char *prefixed_ua = malloc(provenance_length + 64);
+	char *unterminated_ua = malloc(provenance_length);
+	struct uap_useragent_info *length_info = uap_useragent_info_create();
+	snprintf(prefixed_ua, provenance_length + 64, "%s Firefox/99.0 (iPhone; CPU iPhone OS 14_6)", provenance_ua);
+	memcpy(unterminated_ua, provenance_ua, provenance_length);
+
+	for (int i = 0; i < 2; i++) {
+		const char *ua = i == 0 ? prefixed_ua : unterminated_ua;
+		spans_scratch_size = sizeof(spans_scratch);
+		if (uap_parser_parse_string_len(ua_parser, length_info, ua, provenance_length) != 3
+				|| uap_parser_parse_spans_len(ua_parser, &spans, ua, provenance_length, spans_scratch, &spans_scratch_size) != 3
+				|| strcmp(length_info->user_agent.family, provenance_info->user_agent.family) != 0
+				|| strcmp(length_info->os.major, provenance_info->os.major) != 0
+				|| strcmp(length_info->device.model, provenance_info->device.model) != 0
+				|| memcmp(&length_info->rules, &provenance_info->rules, sizeof(length_info->rules)) != 0
+				|| memcmp(&spans.rules, &provenance_info->rules, sizeof(spans.rules)) != 0) {
+			fprintf(stderr, "expected only the first %lu bytes to be parsed\n", (unsigned long)provenance_length);
+			return 1;
+		}
+	}
+
+	uap_useragent_info_destroy(length_info);
+	free(unterminated_ua);
+	free(prefixed_ua);
+
+	// Groups which aren't selected are left empty rather than defaulting to
+	// "Other", and the cache never answers one selection with another's
+	// results: the full results cached above aren't served for the user agent
+	// group alone, nor are the user agent group's results for all of them.
+	const char *groups_ua = "Mozilla/5.0 (Linux; Android 10; SM-G973F) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/91.0.4472.120 Mobile Safari/537.36";
+	struct uap_useragent_info *groups_info = uap_useragent_info_create();
+
+	for (int i = 0; i < 4; i++) {
+		const char *ua = i < 2 ? provenance_ua : groups_ua;
+		const unsigned int groups = i == 1 || i == 2 ? UAP_GROUP_USER_AGENT : UAP_GROUP_ALL;
+		const int expected_groups = groups == UAP_GROUP_ALL ? 3 : 1;
+
+		if (uap_parser_parse_groups(ua_parser, groups_info, ua, strlen(ua), groups) != expected_groups
+				|| strcmp(groups_info->user_agent.family, "Chrome Mobile") != 0
+				|| groups_info->rules.user_agent == -1
+				|| (groups == UAP_GROUP_ALL
+					? groups_info->rules.os == -1 || groups_info->rules.device == -1 || *groups_info->os.family == '\0' || *groups_info->device.family == '\0'
+					: groups_info->rules.os != -1 || groups_info->rules.device != -1 || *groups_info->os.family != '\0' || *groups_info->device.family != '\0')) {
+			fprintf(stderr, "unexpected results for groups %u of \"%s\"\n", groups, ua);
+			return 1;
+		}
+		for (int f = UAP_FIELD_OS_FAMILY; f < UAP_FIELD_COUNT && groups != UAP_GROUP_ALL; f++) {
+			if (*((const char**)groups_info)[f] != '\0') {
+				fprintf(stderr, "field %d of \"%s\" set for the user agent group alone\n", f, ua);
+				return 1;
+			}
+		}
+
+		spans_scratch_size = sizeof(spans_scratch);
+		if (uap_parser_parse_spans_groups(ua_parser, &spans, ua, strlen(ua), groups, spans_scratch, &spans_scratch_size) != expected_groups
+				|| memcmp(&spans.rules, &groups_info->rules, sizeof(spans.rules)) != 0) {
+			fprintf(stderr, "unexpected spans for groups %u of \"%s\"\n", groups, ua);
+			return 1;
+		}
+		for (int f = UAP_FIELD_OS_FAMILY; f < UAP_FIELD_COUNT && groups != UAP_GROUP_ALL; f++) {
+			if (((const struct uap_span*)&spans)[f].ptr != NULL) {
+				fprintf(stderr, "span %d of \"%s\" set for the user agent group alone\n", f, ua);
+				return 1;
+			}
+		}
+	}
+
+	uap_useragent_info_destroy(groups_info);
+
+	uap_useragent_info_destroy(provenance_info);
+	uap_parser_destroy(ua_parser);
+
+	// With interning, repeated results share their strings, through the
+	// cache as well, and copies are only made once the strings are full
+	ua_parser = create_parser(0);
+	if (ua_parser == NULL || !uap_parser_set_interning(ua_parser, 1024 * 1024)) {
+		return -1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+
+	struct uap_useragent_info *interned_info[2] = { uap_useragent_info_create(), uap_useragent_info_create() };
+	for (int pass = 0; pass < 3; pass++) {
+		if (pass == 2 && !uap_parser_set_cache(ua_parser, 16 * 1024 * 1024)) {
+			return -1;
+		}
+		for (int i = 0; i < 2; i++) {
+			uap_parser_parse_string(ua_parser, interned_info[i], provenance_ua);
+		}
+		if (interned_info[0]->user_agent.family != interned_info[1]->user_agent.family
+				|| interned_info[0]->device.model != interned_info[1]->device.model
+				|| interned_info[0]->strings != NULL
+				|| strcmp(interned_info[0]->user_agent.family, "Chrome Mobile") != 0) {
+			fprintf(stderr, "expected shared strings for \"%s\"\n", provenance_ua);
+			return 1;
+		}
+	}
+
+	struct uap_intern_stats intern_stats;
+	uap_parser_intern_stats(ua_parser, &intern_stats);
+	printf("interning: %lu strings in %lu bytes\n", (unsigned long)intern_stats.strings, (unsigned long)intern_stats.memory_used);
+
+	// The same strings have the same IDs, which resolve back to them
+	struct uap_useragent_ids ids[2];
+	for (int i = 0; i < 2; i++) {
+		if (uap_parser_parse_ids(ua_parser, &ids[i], provenance_ua, strlen(provenance_ua), UAP_GROUP_ALL) != 3) {
+			fprintf(stderr, "failed to parse \"%s\" into IDs\n", provenance_ua);
+			return 1;
+		}
+	}
+	const char *id_family = uap_parser_dictionary_string(ua_parser, ids[0].user_agent.family, NULL);
+	if (memcmp(&ids[0], &ids[1], sizeof(ids[0])) != 0
+			|| id_family == NULL
+			|| strcmp(id_family, "Chrome Mobile") != 0
+			|| ids[0].rules.user_agent != interned_info[0]->rules.user_agent
+			|| uap_parser_dictionary_string(ua_parser, 0, NULL)[0] != '\0'
+			|| uap_parser_dictionary_string(ua_parser, uap_parser_dictionary_size(ua_parser), NULL) != NULL) {
+		fprintf(stderr, "expected IDs to resolve to the parsed strings\n");
+		return 1;
+	}
+	printf("dictionary: %u strings\n", uap_parser_dictionary_size(ua_parser));
+
+	// The literal values of the rules get the same IDs in every parser
+	struct uap_parser *other_parser = create_parser(0);
+	if (other_parser == NULL || !uap_parser_set_interning(other_parser, 1024 * 1024)
+			|| uap_parser_parse_ids(other_parser, &ids[1], "", 0, UAP_GROUP_ALL) != 0
+			|| uap_parser_dictionary_size(other_parser) < 2
+			|| strcmp(uap_parser_dictionary_string(other_parser, 1, NULL), "Other") != 0) {
+		fprintf(stderr, "expected the rules' literal values in the dictionary\n");
+		return 1;
+	}
+	for (uint32_t id = 0; id < uap_parser_dictionary_size(other_parser); id++) {
+		if (strcmp(uap_parser_dictionary_string(ua_parser, id, NULL), uap_parser_dictionary_string(other_parser, id, NULL)) != 0) {
+			fprintf(stderr, "literal value %u differs between parsers\n", id);
+			return 1;
+		}
+	}
+	uap_parser_destroy(other_parser);
+
+	// Columns of IDs and of strings in a shared heap match parsing one by one
+	const char *column_uas[] = {
+		provenance_ua,
+		"",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:89.0) Gecko/20100101 Firefox/89.0",
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 14_6 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/14.1.1 Mobile/15E148 Safari/604.1",
+	};
+	enum { NUM_COLUMN_UAS = sizeof(column_uas) / sizeof(column_uas[0]) };
+	struct uap_span column_spans[NUM_COLUMN_UAS];
+	uint32_t column_ids[UAP_FIELD_COUNT][NUM_COLUMN_UAS];
+	struct uap_heap_string column_strings[UAP_FIELD_COUNT][NUM_COLUMN_UAS];
+	struct uap_matched_rules column_rules[NUM_COLUMN_UAS];
+	int column_results[NUM_COLUMN_UAS];
+	char column_heap[1024];
+	struct uap_columns columns = {
+		.rules = column_rules,
+		.heap = column_heap,
+		.heap_size = 8,
+	};
+	for (int f = 0; f < UAP_FIELD_COUNT; f++) {
+		columns.ids[f] = column_ids[f];
+		columns.strings[f] = column_strings[f];
+	}
+	for (int i = 0; i < NUM_COLUMN_UAS; i++) {
+		column_spans[i] = (struct uap_span){ column_uas[i], strlen(column_uas[i]) };
+	}
+
+	uap_parser_parse_columns(ua_parser, column_spans, NUM_COLUMN_UAS, UAP_GROUP_ALL, &columns, column_results, 1);
+	if (column_results[0] != UAP_ERROR_SCRATCH_TOO_SMALL || columns.heap_size <= 8) {
+		fprintf(stderr, "expected a small heap to report the size needed\n");
+		return 1;
+	}
+
+	columns.heap_size = sizeof(column_heap);
+	if (uap_parser_parse_columns(ua_parser, column_spans, NUM_COLUMN_UAS, UAP_GROUP_ALL, &columns, column_results, 0) != NUM_COLUMN_UAS - 1) {
+		fprintf(stderr, "expected all but the empty user agent to match in columns\n");
+		return 1;
+	}
+	for (int i = 0; i < NUM_COLUMN_UAS; i++) {
+		if (uap_parser_parse_string(ua_parser, interned_info[0], column_uas[i]) == 0) {
+			if (column_results[i] != 0 || column_rules[i].user_agent != -1) {
+				fprintf(stderr, "expected no matches in columns for \"%s\"\n", column_uas[i]);
+				return 1;
+			}
+			continue;
+		}
+		const char **fields = (const char**)interned_info[0];
+		for (int f = 0; f < UAP_FIELD_COUNT; f++) {
+			const struct uap_heap_string *string = &column_strings[f][i];
+			const char *expected = fields[f] ? fields[f] : "";
+			if (string->length != strlen(expected)
+					|| memcmp(&column_heap[string->offset], expected, string->length) != 0
+					|| strcmp(uap_parser_dictionary_string(ua_parser, column_ids[f][i], NULL), expected) != 0) {
+				fprintf(stderr, "column %d of \"%s\" differs from \"%s\"\n", f, column_uas[i], expected);
+				return 1;
+			}
+		}
+		if (column_rules[i].user_agent != interned_info[0]->rules.user_agent) {
+			fprintf(stderr, "expected the same rules in columns for \"%s\"\n", column_uas[i]);
+			return 1;
+		}
+	}
+	printf("columns: %lu bytes of strings for %d user agents\n", (unsigned long)columns.heap_size, NUM_COLUMN_UAS);
+
+	uap_parser_set_interning(ua_parser, 1);
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	uap_parser_intern_stats(ua_parser, &intern_stats);
+	if (intern_stats.strings != 0 || intern_stats.rejected == 0) {
+		fprintf(stderr, "expected a full interner to copy strings instead\n");
+		return 1;
+	}
+
+	uap_parser_set_interning(ua_parser, 0);
+	if (uap_parser_parse_ids(ua_parser, &ids[0], provenance_ua, strlen(provenance_ua), UAP_GROUP_ALL) != UAP_ERROR_NO_DICTIONARY) {
+		fprintf(stderr, "expected IDs to need a dictionary\n");
+		return 1;
+	}
+
+	// Results from before interning was changed keep their shared strings
+	if (interned_info[1]->strings != NULL || strcmp(interned_info[1]->user_agent.family, "Chrome Mobile") != 0) {
+		fprintf(stderr, "expected earlier shared strings to outlive the interner\n");
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		uap_useragent_info_destroy(interned_info[i]);
+	}
+	uap_parser_destroy(ua_parser);
+
+	// Parses which run into one of the limits give up with a distinct status
+	ua_parser = create_parser(0);
+	if (ua_parser == NULL) {
+		return -1;
+	}
+
+	struct uap_useragent_info *limited_info = uap_useragent_info_create();
+	const struct {
+		struct uap_parser_limits limits;
+		int expected;
+	} limit_tests[] = {
+		{ { .match_limit = 1 },       UAP_ERROR_MATCH_LIMIT },
+		{ { .parse_budget_ns = 1 },   UAP_ERROR_TIME_BUDGET },
+		{ { .max_input_length = 16 }, UAP_ERROR_INPUT_TOO_LONG },
+	};
+
+	for (size_t i = 0; i < sizeof(limit_tests) / sizeof(limit_tests[0]); i++) {
+		uap_parser_set_limits(ua_parser, &limit_tests[i].limits);
+		const int result = uap_parser_parse_string(ua_parser, limited_info, provenance_ua);
+		if (result != limit_tests[i].expected) {
+			fprintf(stderr, "expected status %d from limit %lu, got %d\n", limit_tests[i].expected, (unsigned long)i, result);
+			return 1;
+		}
+	}
+
+	uap_parser_set_limits(ua_parser, NULL);
+	if (uap_parser_parse_string(ua_parser, limited_info, provenance_ua) != 3) {
+		fprintf(stderr, "expected removing the limits to restore the full result\n");
+		return 1;
+	}
+
+	// Strings which aren't valid UTF-8 can't match any expression
+	const char invalid_utf8_ua[] = "Mozilla/5.0 (Linux; Android 11; Pixel 5) Chrome/91.0.4472.120 \xed\xa0\x80";
+	if (uap_parser_parse_string(ua_parser, limited_info, invalid_utf8_ua) != 0
+			|| limited_info->rules.user_agent != -1) {
+		fprintf(stderr, "expected no matches for invalid UTF-8\n");
+		return 1;
+	}
+
+	uap_useragent_info_destroy(limited_info);
+	uap_parser_destroy(ua_parser);
+
+	// Rules rewritten or skipped at load time still match as written
+	const char rewritten_rules[] =
+		"user_agent_parsers:\n"
+		"  - regex: '.*?(Foo)/(\\d+)'\n"
+		"  - regex: '.*?(Bar)/(\\d+)|(Baz)'\n"
+		"  - regex: '(LongerThanTheUserAgent)'\n";
+	const struct {
+		const char *ua;
+		const char *family;
+		const char *major;
+	} rewritten_tests[] = {
+		{ "x Foo/1 Foo/2",  "Foo", "1" },
+		{ "Baz Bar/3",      "Bar", "3" },
+		{ "Longer",         NULL,  NULL },
+	};
+
+	ua_parser = uap_parser_create();
+	struct uap_useragent_info *rewritten_info = uap_useragent_info_create();
+	if (ua_parser == NULL || rewritten_info == NULL
+			|| !uap_parser_read_buffer(ua_parser, (const unsigned char*)rewritten_rules, sizeof(rewritten_rules) - 1)) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(rewritten_tests) / sizeof(rewritten_tests[0]); i++) {
+		const int matched = uap_parser_parse_string(ua_parser, rewritten_info, rewritten_tests[i].ua);
+		if (rewritten_tests[i].family == NULL ? matched != 0 || rewritten_info->rules.user_agent != -1 :
+				strcmp(rewritten_info->user_agent.family, rewritten_tests[i].family) != 0
+				|| strcmp(rewritten_info->user_agent.major, rewritten_tests[i].major) != 0) {
+			fprintf(stderr, "\"%s\" parsed as %s %s\n", rewritten_tests[i].ua, rewritten_info->user_agent.family, rewritten_info->user_agent.major);
+			return 1;
+		}
+	}
+
+	// Inline options which change what a literal matches keep the rule from
+	// being ruled out by the prefilter
+	const char option_rules[] =
+		"user_agent_parsers:\n"
+		"  - regex: '(?x)(Foo) Bar'\n";
+	const struct {
+		const char *ua;
+		const char *family;
+	} option_tests[] = {
+		{ "FooBar", "Foo" },
+	};
+
+	uap_parser_destroy(ua_parser);
+	ua_parser = uap_parser_create();
+	if (ua_parser == NULL || !uap_parser_read_buffer(ua_parser, (const unsigned char*)option_rules, sizeof(option_rules) - 1)) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(option_tests) / sizeof(option_tests[0]); i++) {
+		if (uap_parser_parse_string(ua_parser, rewritten_info, option_tests[i].ua) != 1
+				|| strcmp(rewritten_info->user_agent.family, option_tests[i].family) != 0) {
+			fprintf(stderr, "\"%s\" parsed as %s\n", option_tests[i].ua, rewritten_info->user_agent.family);
+			return 1;
+		}
+	}
+
+	// Caseless 'k' and 's' also match their non-ASCII cases, KELVIN SIGN and
+	// LONG S, and the other way around
+	const char folding_rules[] =
+		"user_agent_parsers:\n"
+		"  - regex: 'kindle'\n"
+		"    regex_flag: 'i'\n"
+		"    family_replacement: 'A'\n"
+		"  - regex: '(?i)\\x{212A}ndroid'\n"
+		"    family_replacement: 'C'\n"
+		"  - regex: '(?si)(kobo)'\n"
+		"    family_replacement: 'E'\n"
+		"  - regex: 'indle'\n"
+		"    family_replacement: 'B'\n"
+		"  - regex: 'ndroid|obo'\n"
+		"    family_replacement: 'D'\n";
+	const struct {
+		const char *ua;
+		const char *family;
+	} folding_tests[] = {
+		{ "\xE2\x84\xAAindle",  "A" },
+		{ "Kndroid",             "C" },
+		{ "x\xE2\x84\xAAobo/1", "E" },
+	};
+
+	uap_parser_destroy(ua_parser);
+	ua_parser = uap_parser_create();
+	if (ua_parser == NULL || !uap_parser_read_buffer(ua_parser, (const unsigned char*)folding_rules, sizeof(folding_rules) - 1)) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(folding_tests) / sizeof(folding_tests[0]); i++) {
+		if (uap_parser_parse_string(ua_parser, rewritten_info, folding_tests[i].ua) != 1
+				|| strcmp(rewritten_info->user_agent.family, folding_tests[i].family) != 0) {
+			fprintf(stderr, "\"%s\" parsed as %s\n", folding_tests[i].ua, rewritten_info->user_agent.family);
+			return 1;
+		}
+	}
+
+	uap_useragent_info_destroy(rewritten_info);
+	uap_parser_destroy(ua_parser);
+
+	// Base tests against a parser restored from a compiled snapshot
+	ua_parser = create_parser(0);
+	FILE *snapshot = tmpfile();
+	if (ua_parser == NULL || snapshot == NULL || !uap_parser_save_snapshot(ua_parser, snapshot)) {
+		return -1;
+	}
+	uap_parser_destroy(ua_parser);
+
+	size_t snapshot_size = (size_t)ftell(snapshot);
+	void *snapshot_data = malloc(snapshot_size);
+	rewind(snapshot);
+	if (snapshot_data == NULL || fread(snapshot_data, 1, snapshot_size, snapshot) != snapshot_size) {
+		return -1;
+	}
+	fclose(snapshot);
+
+	// Damage anywhere in the snapshot gets it rejected
+	const size_t damaged_offsets[] = { snapshot_size / 3, snapshot_size / 2, snapshot_size - 1 };
+	for (size_t i = 0; i < sizeof(damaged_offsets) / sizeof(damaged_offsets[0]); i++) {
+		char *damaged = (char*)snapshot_data + damaged_offsets[i];
+		*damaged ^= 0x10;
+		ua_parser = uap_parser_create();
+		if (uap_parser_load_snapshot_buffer(ua_parser, snapshot_data, snapshot_size)) {
+			fprintf(stderr, "loaded a snapshot damaged at %lu\n", (unsigned long)damaged_offsets[i]);
+			return 1;
+		}
+		uap_parser_destroy(ua_parser);
+		*damaged ^= 0x10;
+	}
+
+	ua_parser = uap_parser_create();
+	if (!uap_parser_load_snapshot_buffer(ua_parser, snapshot_data, snapshot_size)) {
+		fprintf(stderr, "failed to load snapshot\n");
+		return 1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+
 	uap_parser_destroy(ua_parser);
+	free(snapshot_data);
+
+	// Base tests against the ruleset built into the library
+	ua_parser = uap_parser_create_builtin();
+	if (ua_parser == NULL) {
+		return -1;
+	}
+
+	run_test_file("../uap-core/tests/test_ua.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/tests/test_os.yaml", 4, ua_parser, &get_field_index_for_os_test);
+	run_test_file("../uap-core/tests/test_device.yaml", 9, ua_parser, &get_field_index_for_devices_test);
+
+	// The compiled in matcher only has states for the base tests, so these
+	// also need the DFA state cache
+	run_test_file("../uap-core/test_resources/firefox_user_agent_strings.yaml", 0, ua_parser, &get_field_index_for_ua_test);
+	run_test_file("../uap-core/test_resources/additional_os_tests.yaml", 4, ua_parser, &get_field_index_for_os_test);
+
+	// Swap in rules loaded from regexes.yaml while other threads keep parsing
+	struct uap_reloadable *reloadable = uap_reloadable_create(ua_parser);
+	if (reloadable == NULL) {
+		return -1;
+	}
+
+	struct reload_reader readers[4];
+	pthread_t reader_threads[4];
+	for (int i = 0; i < 4; i++) {
+		readers[i] = (struct reload_reader){ .reloadable = reloadable };
+		if (pthread_create(&reader_threads[i], NULL, &reload_reader_run, &readers[i]) != 0) {
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < 3; i++) {
+		FILE *fd = fopen("../uap-core/regexes.yaml", "rb");
+		if (fd == NULL || !uap_reloadable_reload_file(reloadable, fd, 0)) {
+			fprintf(stderr, "failed to reload regexes.yaml\n");
+			return 1;
+		}
+		fclose(fd);
+	}
+
+	int reload_parses = 0;
+	for (int i = 0; i < 4; i++) {
+		__atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+		pthread_join(reader_threads[i], NULL);
+		reload_parses += readers[i].parses;
+		if (readers[i].failures > 0) {
+			fprintf(stderr, "%d wrong results while reloading\n", readers[i].failures);
+			return 1;
+		}
+	}
+	printf("reload: %d parses across 3 reloads\n", reload_parses);
+
+	uap_reloadable_destroy(reloadable);
+
+	// Interning enough strings to grow the table many times over must still
+	// hand back the first handle of each, also when added by length
+	struct unique_strings_t *us = unique_strings_create();
+	size_t *addrs = malloc(100000 * sizeof(size_t));
+	for (int i = 0; i < 100000; i++) {
+		char str[32];
+		snprintf(str, sizeof(str), "string %d", i);
+		addrs[i] = unique_strings_add(us, str).addr;
+	}
+	for (int i = 0; i < 100000; i++) {
+		char str[32];
+		const int len = snprintf(str, sizeof(str), "string %d!", i);
+		const struct unique_string_handle_t handle = unique_strings_add_len(us, str, len - 1);
+		if (handle.addr != addrs[i] || strncmp(unique_strings_get(&handle), str, len - 1) != 0) {
+			fprintf(stderr, "string %d was interned twice\n", i);
+			return 1;
+		}
+	}
+	unique_strings_freeze(us);
+	size_t strings_size;
+	unique_strings_data(us, &strings_size);
+	printf("unique strings: %lu bytes for 100000 strings\n", (unsigned long)strings_size);
+	free(addrs);
+	unique_strings_destroy(us);
+
+	// Caseless options anywhere in an expression keep the literals which
+	// fold to non-ASCII characters out of the prefilter
+	struct prefilter_t *pf = prefilter_create();
+	prefilter_add_regex(pf, 0, "(?si)(kindle)", false);
+	prefilter_add_regex(pf, 1, "(?-s:i)(?i)(kindle)", false);
+	prefilter_compile(pf);
+	uint64_t candidates[1] = { 0 };
+	const char kelvin_ua[] = "x\xE2\x84\xAAindle";
+	prefilter_scan(pf, kelvin_ua, sizeof(kelvin_ua) - 1, candidates);
+	if (!prefilter_is_candidate(candidates, 0) || !prefilter_is_candidate(candidates, 1)) {
+		fprintf(stderr, "expected caseless options to be seen by the prefilter\n");
+		return 1;
+	}
+	prefilter_destroy(pf);
+
 	return 0;
 }
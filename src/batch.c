@@ -0,0 +1,397 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uap/uap.h"
+
+#define BATCH_CHUNK_SIZE 16      // user agents claimed at a time
+#define BATCH_MAX_THREADS 256
+#define BATCH_MAX_RANGE UINT32_MAX
+#define BATCH_SCRATCH_SIZE 1024  // for replacements, larger ones go to the heap
+
+
+// Each worker owns a range of the batch, packed as (next << 32 | end) so that
+// both ends can be updated with a single compare-and-swap. The owner claims
+// chunks from the front, idle workers steal half of what remains from the
+// back.
+struct batch_worker {
+	uint64_t range;
+	struct batch_job *job;
+	size_t index;
+	size_t matched;
+	pthread_t thread;
+	bool started;
+} __attribute__((aligned(64)));
+
+
+struct batch_job {
+	const struct uap_parser *ua_parser;
+	const struct uap_span *user_agents;
+	int (*parse_row)(const struct batch_job *job, size_t index);
+	struct uap_useragent_info *ua_infos;
+	int *results;
+	struct batch_worker *workers;
+	size_t num_workers;
+
+	// uap_parser_parse_columns(), whose rows are numbered from the start of
+	// the whole batch rather than of this round
+	struct uap_columns *columns;
+	unsigned int groups;
+	size_t offset;
+	bool want_ids;
+	bool want_strings;
+	size_t *heap_used; // reserved by rows as they go, may exceed heap_size
+};
+
+
+static inline uint64_t _range_pack(uint32_t next, uint32_t end) {
+	return ((uint64_t)next << 32) | end;
+}
+
+
+static inline uint32_t _range_next(uint64_t range) {
+	return range >> 32;
+}
+
+
+static inline uint32_t _range_end(uint64_t range) {
+	return (uint32_t)range;
+}
+
+
+// Claim up to BATCH_CHUNK_SIZE items from the front of the worker's own range.
+static bool _claim_chunk(struct batch_worker *worker, uint32_t *begin, uint32_t *end) {
+	uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		const uint32_t next = _range_next(range);
+		const uint32_t last = _range_end(range);
+
+		if (next >= last) {
+			return false;
+		}
+
+		const uint32_t take = (last - next) < BATCH_CHUNK_SIZE ? (last - next) : BATCH_CHUNK_SIZE;
+
+		if (__atomic_compare_exchange_n(&worker->range, &range, _range_pack(next + take, last),
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			*begin = next;
+			*end = next + take;
+			return true;
+		}
+	}
+}
+
+
+// Take the back half of another worker's remaining range and make it our own.
+static bool _steal(struct batch_worker *thief) {
+	struct batch_job *job = thief->job;
+
+	for (size_t i = 1; i < job->num_workers; i++) {
+		struct batch_worker *victim = &job->workers[(thief->index + i) % job->num_workers];
+		uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+		for (;;) {
+			const uint32_t next = _range_next(range);
+			const uint32_t last = _range_end(range);
+
+			// Not worth stealing, the victim will be done shortly
+			if (next >= last || last - next < 2 * BATCH_CHUNK_SIZE) {
+				break;
+			}
+
+			const uint32_t middle = next + (last - next) / 2;
+
+			if (__atomic_compare_exchange_n(&victim->range, &range, _range_pack(next, middle),
+						false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&thief->range, _range_pack(middle, last), __ATOMIC_RELEASE);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+static int _parse_info_row(const struct batch_job *job, size_t index) {
+	return uap_parser_parse_string_len(
+			job->ua_parser,
+			&job->ua_infos[index],
+			job->user_agents[index].ptr,
+			job->user_agents[index].len);
+}
+
+
+// Whether a parse filled in its results, if only partially
+static inline bool _result_has_fields(int result) {
+	return result >= 0
+		|| result == UAP_ERROR_MATCH_LIMIT
+		|| result == UAP_ERROR_TIME_BUDGET
+		|| result == UAP_ERROR_PCRE;
+}
+
+
+// Copy the string columns of one row to the shared heap, which the row
+// reserves its share of in one go. Returns false if it didn't fit.
+static bool _write_heap_strings(const struct batch_job *job, size_t row, const struct uap_span *fields) {
+	struct uap_columns *columns = job->columns;
+
+	size_t size = 0;
+	for (size_t f = 0; f < UAP_FIELD_COUNT; f++) {
+		if (columns->strings[f]) {
+			size += fields[f].len;
+		}
+	}
+
+	const size_t offset = __atomic_fetch_add(job->heap_used, size, __ATOMIC_RELAXED);
+	const bool fits = offset + size <= columns->heap_size && offset + size <= UINT32_MAX;
+	size_t write_offset = offset;
+
+	for (size_t f = 0; f < UAP_FIELD_COUNT; f++) {
+		if (columns->strings[f] == NULL) {
+			continue;
+		}
+
+		struct uap_heap_string *string = &columns->strings[f][row];
+		if (fits) {
+			if (fields[f].len) {
+				memcpy(&columns->heap[write_offset], fields[f].ptr, fields[f].len);
+			}
+			string->offset = (uint32_t)write_offset;
+			string->length = (uint32_t)fields[f].len;
+			write_offset += fields[f].len;
+		} else {
+			string->offset = 0;
+			string->length = 0;
+		}
+	}
+
+	return fits;
+}
+
+
+// Parse into the columns, through the dictionary when IDs are wanted, in
+// which case the strings are looked up from the IDs rather than parsed again.
+static int _parse_columns_row(const struct batch_job *job, size_t index) {
+	const struct uap_span *ua = &job->user_agents[index];
+	struct uap_columns *columns = job->columns;
+	const size_t row = job->offset + index;
+
+	struct uap_useragent_ids ids;
+	struct uap_useragent_spans spans;
+	struct uap_span *fields = (struct uap_span*)&spans;
+	uint32_t *field_ids = (uint32_t*)&ids;
+	char scratch[BATCH_SCRATCH_SIZE];
+	char *heap_scratch = NULL;
+	int result = 0;
+
+	memset(&spans, 0, sizeof(spans));
+
+	bool have_spans = !job->want_ids;
+	if (job->want_ids) {
+		result = uap_parser_parse_ids(job->ua_parser, &ids, ua->ptr, ua->len, job->groups);
+		spans.rules = ids.rules;
+
+		for (size_t f = 0; f < UAP_FIELD_COUNT && job->want_strings && _result_has_fields(result); f++) {
+			fields[f].ptr = uap_parser_dictionary_string(job->ua_parser, field_ids[f], &fields[f].len);
+			// A string which didn't fit in the dictionary needs parsing after all
+			if (fields[f].ptr == NULL) {
+				have_spans = true;
+				break;
+			}
+		}
+	}
+
+	if (have_spans) {
+		size_t scratch_size = sizeof(scratch);
+		result = uap_parser_parse_spans_groups(job->ua_parser, &spans, ua->ptr, ua->len, job->groups, scratch, &scratch_size);
+
+		if (result == UAP_ERROR_SCRATCH_TOO_SMALL) {
+			heap_scratch = malloc(scratch_size);
+			if (heap_scratch != NULL) {
+				result = uap_parser_parse_spans_groups(job->ua_parser, &spans, ua->ptr, ua->len, job->groups, heap_scratch, &scratch_size);
+			}
+		}
+	}
+
+	const bool has_fields = _result_has_fields(result);
+
+	for (size_t f = 0; f < UAP_FIELD_COUNT; f++) {
+		if (columns->ids[f]) {
+			columns->ids[f][row] = has_fields ? field_ids[f] : 0;
+		}
+		if (!has_fields || fields[f].ptr == NULL) {
+			fields[f].ptr = "";
+			fields[f].len = 0;
+		}
+	}
+
+	if (columns->rules) {
+		if (has_fields) {
+			columns->rules[row] = spans.rules;
+		} else {
+			columns->rules[row].user_agent = columns->rules[row].os = columns->rules[row].device = -1;
+		}
+	}
+
+	if (job->want_strings && !_write_heap_strings(job, row, fields) && has_fields) {
+		result = UAP_ERROR_SCRATCH_TOO_SMALL;
+	}
+
+	free(heap_scratch);
+	return result;
+}
+
+
+static void *_batch_worker_run(void *ptr) {
+	struct batch_worker *worker = ptr;
+	struct batch_job *job = worker->job;
+	uint32_t begin, end;
+
+	do {
+		while (_claim_chunk(worker, &begin, &end)) {
+			for (uint32_t i = begin; i < end; i++) {
+				const int result = job->parse_row(job, i);
+
+				if (job->results) {
+					job->results[i] = result;
+				}
+				worker->matched += result > 0;
+			}
+		}
+	} while (_steal(worker));
+
+	return NULL;
+}
+
+
+// Parse up to BATCH_MAX_RANGE user agents, initially split evenly between
+// the workers. The calling thread acts as worker 0.
+static size_t _parse_batch_range(struct batch_job *job, size_t count) {
+	struct batch_worker *workers = job->workers;
+	const size_t num_workers = job->num_workers;
+
+	for (size_t i = 0; i < num_workers; i++) {
+		workers[i].job = job;
+		workers[i].index = i;
+		workers[i].matched = 0;
+		workers[i].range = _range_pack(count * i / num_workers, count * (i + 1) / num_workers);
+	}
+
+	for (size_t i = 1; i < num_workers; i++) {
+		workers[i].started = pthread_create(&workers[i].thread, NULL, &_batch_worker_run, &workers[i]) == 0;
+	}
+
+	_batch_worker_run(&workers[0]);
+
+	// Whatever is left of the ranges of workers which failed to start is
+	// handled by the calling thread.
+	for (size_t i = 1; i < num_workers; i++) {
+		if (!workers[i].started) {
+			_batch_worker_run(&workers[i]);
+		}
+	}
+
+	size_t matched = 0;
+	for (size_t i = 0; i < num_workers; i++) {
+		if (i > 0 && workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		matched += workers[i].matched;
+	}
+
+	return matched;
+}
+
+
+// Parse the batch described by `prototype` in rounds of up to
+// BATCH_MAX_RANGE user agents.
+static size_t _parse_batch(const struct batch_job *prototype, size_t count, unsigned int num_threads) {
+	if (num_threads == 0) {
+		const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = num_cpus > 0 ? num_cpus : 1;
+	}
+	if (num_threads > BATCH_MAX_THREADS) {
+		num_threads = BATCH_MAX_THREADS;
+	}
+	if (num_threads > count / BATCH_CHUNK_SIZE) {
+		num_threads = count / BATCH_CHUNK_SIZE > 0 ? count / BATCH_CHUNK_SIZE : 1;
+	}
+
+	struct batch_worker workers[num_threads];
+	size_t matched = 0;
+
+	// Ranges are packed into 32 bits, so very large batches go in rounds
+	for (size_t offset = 0; offset < count; offset += BATCH_MAX_RANGE) {
+		const size_t round = (count - offset) < BATCH_MAX_RANGE ? (count - offset) : BATCH_MAX_RANGE;
+
+		struct batch_job job = *prototype;
+		job.user_agents = &prototype->user_agents[offset];
+		job.ua_infos    = prototype->ua_infos ? &prototype->ua_infos[offset] : NULL;
+		job.results     = prototype->results ? &prototype->results[offset] : NULL;
+		job.workers     = workers;
+		job.num_workers = num_threads;
+		job.offset      = offset;
+
+		matched += _parse_batch_range(&job, round);
+	}
+
+	return matched;
+}
+
+
+size_t uap_parser_parse_batch(
+		const struct uap_parser *ua_parser,
+		const struct uap_span *user_agents,
+		size_t count,
+		struct uap_useragent_info *ua_infos,
+		int *results,
+		unsigned int num_threads)
+{
+	const struct batch_job job = {
+		.ua_parser   = ua_parser,
+		.user_agents = user_agents,
+		.parse_row   = &_parse_info_row,
+		.ua_infos    = ua_infos,
+		.results     = results,
+	};
+
+	return _parse_batch(&job, count, num_threads);
+}
+
+
+size_t uap_parser_parse_columns(
+		const struct uap_parser *ua_parser,
+		const struct uap_span *user_agents,
+		size_t count,
+		unsigned int groups,
+		struct uap_columns *columns,
+		int *results,
+		unsigned int num_threads)
+{
+	size_t heap_used = 0;
+	struct batch_job job = {
+		.ua_parser   = ua_parser,
+		.user_agents = user_agents,
+		.parse_row   = &_parse_columns_row,
+		.results     = results,
+		.columns     = columns,
+		.groups      = groups,
+		.heap_used   = &heap_used,
+	};
+
+	for (size_t f = 0; f < UAP_FIELD_COUNT; f++) {
+		job.want_ids     |= columns->ids[f] != NULL;
+		job.want_strings |= columns->strings[f] != NULL;
+	}
+
+	const size_t matched = _parse_batch(&job, count, num_threads);
+	columns->heap_size = heap_used;
+
+	return matched;
+}
@@ -0,0 +1,866 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/prefilter.h"
+
+#define MIN_LITERAL_LENGTH 2
+#define MAX_LITERAL_LENGTH 64
+#define MAX_ALTERNATIVES 32
+#define MAX_GROUP_DEPTH 32
+#define NO_NODE (-1)
+
+
+struct trie_node {
+	int32_t first_child;
+	int32_t next_sibling;
+	int32_t first_output;  // index into prefilter_t.links
+	unsigned char byte;
+};
+
+
+struct output_link {
+	uint32_t rule_id;
+	int32_t next;
+};
+
+
+struct prefilter_t {
+	// Build-time trie of all literals, discarded by prefilter_compile()
+	struct trie_node *nodes;
+	size_t num_nodes;
+	size_t nodes_capacity;
+	struct output_link *links;
+	size_t num_links;
+	size_t links_capacity;
+
+	// Rules which have no literals and are always candidates
+	uint64_t *always;
+	size_t num_words;
+
+	// Compiled automaton, one row of `num_classes` transitions per state
+	unsigned char class_map[256];
+	uint32_t num_classes;
+	uint32_t num_states;
+	uint32_t *transitions;
+	uint32_t *output_offsets; // num_states + 1
+	uint32_t *outputs;        // rule_ids
+
+	// Compiled arrays point into someone else's memory, see prefilter_deserialize()
+	bool borrowed;
+};
+
+
+// Layout of a serialized prefilter, followed by the `always`, `transitions`,
+// `output_offsets` and `outputs` arrays.
+struct prefilter_serialized_header {
+	uint32_t num_words;
+	uint32_t num_classes;
+	uint32_t num_states;
+	uint32_t num_outputs;
+	unsigned char class_map[256];
+};
+
+
+// A set of literals, any one of which must be present in a matching string.
+struct literal_set {
+	size_t count;
+	char *items[MAX_ALTERNATIVES];
+	size_t lengths[MAX_ALTERNATIVES];
+};
+
+
+// `caseless` is only ever turned on while extracting, which is conservative
+// for options turned off again or scoped to a group.
+struct extract_ctx {
+	const char *re;
+	bool caseless;
+	bool failed;
+};
+
+
+///###############################
+//# Literal sets
+///###############################
+
+// The shortest literal determines how selective the set is.
+static size_t _literal_set_quality(const struct literal_set *set) {
+	size_t quality = set->count ? SIZE_MAX : 0;
+	for (size_t i = 0; i < set->count; i++) {
+		if (set->lengths[i] < quality) {
+			quality = set->lengths[i];
+		}
+	}
+	return quality;
+}
+
+
+static void _literal_set_clear(struct literal_set *set) {
+	for (size_t i = 0; i < set->count; i++) {
+		free(set->items[i]);
+	}
+	set->count = 0;
+}
+
+
+static void _literal_set_add(struct literal_set *set, const char *str, size_t len) {
+	char *item = malloc(len + 1);
+	memcpy(item, str, len);
+	item[len] = '\0';
+	set->items[set->count] = item;
+	set->lengths[set->count] = len;
+	set->count++;
+}
+
+
+// Replace `best` with `candidate` if it is more selective. `candidate` is
+// always left empty.
+static void _literal_set_offer(struct literal_set *best, struct literal_set *candidate) {
+	const size_t quality = _literal_set_quality(candidate);
+	const size_t best_quality = _literal_set_quality(best);
+
+	if (quality >= MIN_LITERAL_LENGTH &&
+		(quality > best_quality || (quality == best_quality && candidate->count < best->count)))
+	{
+		_literal_set_clear(best);
+		*best = *candidate;
+		candidate->count = 0;
+	} else {
+		_literal_set_clear(candidate);
+	}
+}
+
+
+///###############################
+//# Regular expression scanning
+///###############################
+
+// Returns the index just past the character class beginning at re[pos].
+static size_t _regex_skip_class(struct extract_ctx *ctx, size_t pos, size_t end) {
+	const char *re = ctx->re;
+	size_t i = pos + 1;
+
+	if (i < end && re[i] == '^') i++;
+	if (i < end && re[i] == ']') i++;
+
+	while (i < end && re[i] != ']') {
+		if (re[i] == '\\') {
+			i += 2;
+		} else if (re[i] == '[' && i + 1 < end && re[i + 1] == ':') {
+			// POSIX class such as [:alpha:]
+			i += 2;
+			while (i + 1 < end && !(re[i] == ':' && re[i + 1] == ']')) i++;
+			i += 2;
+		} else {
+			i++;
+		}
+	}
+
+	if (i >= end) {
+		ctx->failed = true;
+		return end;
+	}
+
+	return i + 1;
+}
+
+
+// Returns the index of the ')' closing the group opened at re[pos]. Also
+// reports whether the group contains a top-level alternation.
+static size_t _regex_find_group_end(struct extract_ctx *ctx, size_t pos, size_t end, bool *has_alternation) {
+	const char *re = ctx->re;
+	size_t i = pos + 1;
+	int depth = 1;
+	*has_alternation = false;
+
+	while (i < end) {
+		switch (re[i]) {
+			case '\\': i += 2; continue;
+			case '[': i = _regex_skip_class(ctx, i, end); continue;
+			case '(': depth++; break;
+			case ')':
+				if (--depth == 0) {
+					return i;
+				}
+				break;
+			case '|':
+				if (depth == 1) {
+					*has_alternation = true;
+				}
+				break;
+			default: break;
+		}
+		i++;
+	}
+
+	ctx->failed = true;
+	return end;
+}
+
+
+// Parses a quantifier at re[pos], returning the number of characters it
+// occupies (0 if there is none) and its minimum repeat count in `min`.
+static size_t _regex_quantifier(const char *re, size_t pos, size_t end, unsigned int *min) {
+	size_t i = pos;
+	*min = 1;
+
+	if (i >= end) {
+		return 0;
+	}
+
+	switch (re[i]) {
+		case '*': *min = 0; i++; break;
+		case '?': *min = 0; i++; break;
+		case '+': *min = 1; i++; break;
+		case '{': {
+			// Only {n}, {n,} and {n,m} are quantifiers, anything else is literal
+			size_t j = i + 1;
+			unsigned int n = 0;
+			if (j >= end || re[j] < '0' || re[j] > '9') return 0;
+			while (j < end && re[j] >= '0' && re[j] <= '9') {
+				n = n * 10 + (re[j] - '0');
+				j++;
+			}
+			if (j < end && re[j] == ',') {
+				j++;
+				while (j < end && re[j] >= '0' && re[j] <= '9') j++;
+			}
+			if (j >= end || re[j] != '}') return 0;
+			*min = n;
+			i = j + 1;
+		} break;
+		default:
+			return 0;
+	}
+
+	// Lazy or possessive modifier
+	if (i < end && (re[i] == '?' || re[i] == '+')) {
+		i++;
+	}
+
+	return i - pos;
+}
+
+
+static bool _is_alnum(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+
+static void _extract_alternation(struct extract_ctx *ctx, size_t begin, size_t end, struct literal_set *out);
+
+
+// Commit the current run of literal characters as a candidate.
+static void _extract_commit_run(struct literal_set *best, const char *run, size_t *run_len) {
+	if (*run_len > 0) {
+		struct literal_set candidate = { .count = 0 };
+		_literal_set_add(&candidate, run, *run_len);
+		_literal_set_offer(best, &candidate);
+		*run_len = 0;
+	}
+}
+
+
+// Scan a sequence without top-level alternation, collecting runs of literal
+// characters that every match must contain. Groups which must match exactly
+// once are transparent, so runs may continue through them.
+static void _extract_sequence(struct extract_ctx *ctx, size_t begin, size_t end, struct literal_set *best) {
+	const char *re = ctx->re;
+	enum { GROUP_TRANSPARENT, GROUP_REPEATED } stack[MAX_GROUP_DEPTH];
+	int depth = 0;
+	char run[MAX_LITERAL_LENGTH];
+	size_t run_len = 0;
+	size_t i = begin;
+
+	while (i < end && !ctx->failed) {
+		const char c = re[i];
+		bool is_literal = false;
+		size_t consumed = 1;
+
+		switch (c) {
+			case '\\': {
+				const char n = (i + 1 < end) ? re[i + 1] : '\0';
+				consumed = 2;
+				if (n == '\0') {
+					ctx->failed = true;
+				} else if (!_is_alnum(n)) {
+					is_literal = true; // escaped punctuation
+				} else if (strchr("dDwWsShHvVRNX", n)) {
+					// character type
+				} else if (strchr("bBAzZG", n)) {
+					// zero-width assertion
+					_extract_commit_run(best, run, &run_len);
+					i += 2;
+					continue;
+				} else {
+					// backreferences, \Q...\E, \x{..}, \p{..} and friends
+					ctx->failed = true;
+				}
+			} break;
+
+			case '[':
+				consumed = _regex_skip_class(ctx, i, end) - i;
+				break;
+
+			case '.':
+				break;
+
+			case '^':
+			case '$':
+				_extract_commit_run(best, run, &run_len);
+				i++;
+				continue;
+
+			case ')': {
+				unsigned int min;
+				if (depth == 0) {
+					ctx->failed = true;
+					continue;
+				}
+				i++;
+				if (stack[--depth] == GROUP_REPEATED) {
+					_extract_commit_run(best, run, &run_len);
+					i += _regex_quantifier(re, i, end, &min);
+				}
+			} continue;
+
+			case '(': {
+				bool has_alternation;
+				bool skip = false;
+				size_t content = i + 1;
+				const size_t close = _regex_find_group_end(ctx, i, end, &has_alternation);
+
+				if (ctx->failed) {
+					continue;
+				}
+
+				if (re[i + 1] == '*') {
+					ctx->failed = true; // backtracking control verbs
+					continue;
+				} else if (re[i + 1] == '?') {
+					const char k = re[i + 2];
+					if (k == ':' || k == '|' || k == '>') {
+						content = i + 3;
+					} else if ((k == 'P' && re[i + 3] == '<') || (k == '<' && re[i + 3] != '=' && re[i + 3] != '!')) {
+						const char *name_end = memchr(&re[i], '>', close - i);
+						content = name_end ? (size_t)(name_end - re) + 1 : close;
+					} else if (k == '\'') {
+						const char *name_end = memchr(&re[i + 3], '\'', close - i - 3);
+						content = name_end ? (size_t)(name_end - re) + 1 : close;
+					} else if (k == '=' || k == '!' || k == '<' || k == '#') {
+						skip = true; // lookaround and comments
+					} else {
+						// Option settings, eg: (?i) or (?i:...). Any option other
+						// than these, such as extended mode, changes what the
+						// literals mean.
+						size_t j = i + 2;
+						bool enable = true;
+						for (; j < close && (_is_alnum(re[j]) || re[j] == '-'); j++) {
+							if (re[j] == '-') {
+								enable = false;
+							} else if (re[j] == 'i') {
+								ctx->caseless |= enable;
+							} else if (re[j] != 's' && re[j] != 'm') {
+								ctx->failed = true;
+							}
+						}
+						if (ctx->failed) {
+							continue;
+						} else if (j == close) {
+							skip = true;
+						} else if (re[j] == ':') {
+							content = j + 1;
+						} else {
+							ctx->failed = true; // recursion, conditionals
+							continue;
+						}
+					}
+				}
+
+				unsigned int min;
+				const size_t quantifier = _regex_quantifier(re, close + 1, end, &min);
+
+				if (skip || min == 0 || has_alternation || quantifier) {
+					_extract_commit_run(best, run, &run_len);
+				}
+
+				if (skip || min == 0) {
+					// Optional or zero-width, contributes nothing
+					i = close + 1 + quantifier;
+				} else if (has_alternation) {
+					struct literal_set alternatives = { .count = 0 };
+					_extract_alternation(ctx, content, close, &alternatives);
+					_literal_set_offer(best, &alternatives);
+					i = close + 1 + quantifier;
+				} else if (depth < MAX_GROUP_DEPTH) {
+					stack[depth++] = quantifier ? GROUP_REPEATED : GROUP_TRANSPARENT;
+					i = content;
+				} else {
+					ctx->failed = true;
+				}
+			} continue;
+
+			case '|':
+			case '*':
+			case '+':
+			case '?':
+				ctx->failed = true;
+				continue;
+
+			case '{': {
+				unsigned int min;
+				if (_regex_quantifier(re, i, end, &min)) {
+					ctx->failed = true;
+					continue;
+				}
+				is_literal = true;
+			} break;
+
+			default:
+				is_literal = true;
+				break;
+		}
+
+		if (ctx->failed) {
+			continue;
+		}
+
+		const char literal = is_literal ? re[i + consumed - 1] : '\0';
+
+		// Only ASCII is folded and matched. In UTF-8 caseless mode 'k' and
+		// 's' also match non-ASCII characters (KELVIN SIGN, LONG S).
+		if (is_literal && ((unsigned char)literal >= 0x80 ||
+			(ctx->caseless && strchr("kKsS", literal))))
+		{
+			is_literal = false;
+		}
+
+		unsigned int min;
+		const size_t quantifier = _regex_quantifier(re, i + consumed, end, &min);
+
+		if (is_literal && min > 0) {
+			if (run_len == MAX_LITERAL_LENGTH) {
+				_extract_commit_run(best, run, &run_len);
+			}
+			run[run_len++] = (literal >= 'A' && literal <= 'Z') ? literal + ('a' - 'A') : literal;
+		}
+
+		if (!is_literal || quantifier) {
+			_extract_commit_run(best, run, &run_len);
+		}
+
+		i += consumed + quantifier;
+	}
+
+	_extract_commit_run(best, run, &run_len);
+
+	if (depth != 0) {
+		ctx->failed = true;
+	}
+}
+
+
+// Every branch of an alternation must contribute literals, otherwise the
+// alternation as a whole can't be used.
+static void _extract_alternation(struct extract_ctx *ctx, size_t begin, size_t end, struct literal_set *out) {
+	const char *re = ctx->re;
+	size_t branch_begin = begin;
+	size_t i = begin;
+	int depth = 0;
+
+	out->count = 0;
+
+	while (i <= end && !ctx->failed) {
+		if (i == end || (re[i] == '|' && depth == 0)) {
+			struct literal_set branch = { .count = 0 };
+			_extract_sequence(ctx, branch_begin, i, &branch);
+
+			if (_literal_set_quality(&branch) < MIN_LITERAL_LENGTH ||
+				out->count + branch.count > MAX_ALTERNATIVES)
+			{
+				_literal_set_clear(&branch);
+				_literal_set_clear(out);
+				return;
+			}
+
+			for (size_t j = 0; j < branch.count; j++) {
+				out->items[out->count] = branch.items[j];
+				out->lengths[out->count] = branch.lengths[j];
+				out->count++;
+			}
+
+			branch_begin = i + 1;
+			i++;
+			continue;
+		}
+
+		switch (re[i]) {
+			case '\\': i += 2; continue;
+			case '[': i = _regex_skip_class(ctx, i, end); continue;
+			case '(': depth++; break;
+			case ')': depth--; break;
+			default: break;
+		}
+		i++;
+	}
+
+	if (ctx->failed) {
+		_literal_set_clear(out);
+	}
+}
+
+
+///###############################
+//# Trie construction
+///###############################
+
+static int32_t _prefilter_new_node(struct prefilter_t *pf, unsigned char byte) {
+	if (pf->num_nodes == pf->nodes_capacity) {
+		pf->nodes_capacity = pf->nodes_capacity ? pf->nodes_capacity * 2 : 256;
+		pf->nodes = realloc(pf->nodes, pf->nodes_capacity * sizeof(struct trie_node));
+	}
+
+	struct trie_node *node = &pf->nodes[pf->num_nodes];
+	node->first_child = NO_NODE;
+	node->next_sibling = NO_NODE;
+	node->first_output = NO_NODE;
+	node->byte = byte;
+
+	return (int32_t)pf->num_nodes++;
+}
+
+
+static int32_t _prefilter_find_child(const struct prefilter_t *pf, int32_t node, unsigned char byte) {
+	int32_t child = pf->nodes[node].first_child;
+	while (child != NO_NODE && pf->nodes[child].byte != byte) {
+		child = pf->nodes[child].next_sibling;
+	}
+	return child;
+}
+
+
+static void _prefilter_insert(struct prefilter_t *pf, const char *literal, size_t len, uint32_t rule_id) {
+	int32_t node = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		const unsigned char byte = (unsigned char)literal[i];
+		int32_t child = _prefilter_find_child(pf, node, byte);
+
+		if (child == NO_NODE) {
+			child = _prefilter_new_node(pf, byte);
+			pf->nodes[child].next_sibling = pf->nodes[node].first_child;
+			pf->nodes[node].first_child = child;
+		}
+
+		node = child;
+	}
+
+	if (pf->num_links == pf->links_capacity) {
+		pf->links_capacity = pf->links_capacity ? pf->links_capacity * 2 : 256;
+		pf->links = realloc(pf->links, pf->links_capacity * sizeof(struct output_link));
+	}
+
+	struct output_link *link = &pf->links[pf->num_links];
+	link->rule_id = rule_id;
+	link->next = pf->nodes[node].first_output;
+	pf->nodes[node].first_output = (int32_t)pf->num_links++;
+}
+
+
+static void _prefilter_reserve_rule(struct prefilter_t *pf, uint32_t rule_id) {
+	const size_t words = (rule_id >> 6) + 1;
+
+	if (words > pf->num_words) {
+		pf->always = realloc(pf->always, words * sizeof(uint64_t));
+		memset(&pf->always[pf->num_words], 0, (words - pf->num_words) * sizeof(uint64_t));
+		pf->num_words = words;
+	}
+}
+
+
+struct prefilter_t *prefilter_create() {
+	struct prefilter_t *pf = calloc(1, sizeof(struct prefilter_t));
+	_prefilter_new_node(pf, '\0'); // root
+	return pf;
+}
+
+
+void prefilter_destroy(struct prefilter_t *pf) {
+	if (pf) {
+		free(pf->nodes);
+		free(pf->links);
+		if (!pf->borrowed) {
+			free(pf->always);
+			free(pf->transitions);
+			free(pf->output_offsets);
+			free(pf->outputs);
+		}
+		free(pf);
+	}
+}
+
+
+bool prefilter_add_regex(struct prefilter_t *pf, uint32_t rule_id, const char *regex, bool caseless) {
+	struct extract_ctx ctx = {
+		.re       = regex,
+		.caseless = caseless,
+		.failed   = false,
+	};
+	struct literal_set literals = { .count = 0 };
+
+	_prefilter_reserve_rule(pf, rule_id);
+	_extract_alternation(&ctx, 0, strlen(regex), &literals);
+
+	if (ctx.failed || _literal_set_quality(&literals) < MIN_LITERAL_LENGTH) {
+		_literal_set_clear(&literals);
+		pf->always[rule_id >> 6] |= UINT64_C(1) << (rule_id & 63);
+		return false;
+	}
+
+	for (size_t i = 0; i < literals.count; i++) {
+		_prefilter_insert(pf, literals.items[i], literals.lengths[i], rule_id);
+	}
+
+	_literal_set_clear(&literals);
+	return true;
+}
+
+
+///###############################
+//# Automaton
+///###############################
+
+// Converts the trie into a DFA (Aho-Corasick with failure transitions
+// resolved) over a compressed, case-folded alphabet.
+void prefilter_compile(struct prefilter_t *pf) {
+	const size_t num_states = pf->num_nodes;
+
+	// Bytes which appear in any literal each get their own class, everything
+	// else shares class 0. Upper case letters fold into the lower case class.
+	memset(pf->class_map, 0, sizeof(pf->class_map));
+	pf->num_classes = 1;
+	for (size_t i = 1; i < num_states; i++) {
+		const unsigned char byte = pf->nodes[i].byte;
+		if (pf->class_map[byte] == 0) {
+			pf->class_map[byte] = pf->num_classes++;
+		}
+	}
+	for (int c = 'A'; c <= 'Z'; c++) {
+		pf->class_map[c] = pf->class_map[c + ('a' - 'A')];
+	}
+
+	const uint32_t nc = pf->num_classes;
+	uint32_t *trans = calloc(num_states * nc, sizeof(uint32_t));
+	uint32_t *fail = calloc(num_states, sizeof(uint32_t));
+	uint32_t *queue = malloc(num_states * sizeof(uint32_t));
+	size_t head = 0, tail = 0;
+
+	// Depth-1 states fail back to the root
+	for (int32_t child = pf->nodes[0].first_child; child != NO_NODE; child = pf->nodes[child].next_sibling) {
+		trans[pf->class_map[pf->nodes[child].byte]] = child;
+		fail[child] = 0;
+		queue[tail++] = child;
+	}
+
+	// Breadth first, so failure states are always resolved before use
+	while (head < tail) {
+		const uint32_t state = queue[head++];
+		uint32_t *row = &trans[state * nc];
+
+		memcpy(row, &trans[fail[state] * nc], nc * sizeof(uint32_t));
+
+		for (int32_t child = pf->nodes[state].first_child; child != NO_NODE; child = pf->nodes[child].next_sibling) {
+			const uint32_t cls = pf->class_map[pf->nodes[child].byte];
+			fail[child] = trans[fail[state] * nc + cls];
+			row[cls] = child;
+			queue[tail++] = child;
+		}
+	}
+
+	// Flatten outputs; each state reports its own rules plus those of its
+	// failure chain. Processing in BFS order means the chain is complete.
+	uint32_t *counts = calloc(num_states, sizeof(uint32_t));
+	size_t total = 0;
+	for (size_t q = 0; q < tail; q++) {
+		const uint32_t state = queue[q];
+		uint32_t n = counts[fail[state]];
+		for (int32_t l = pf->nodes[state].first_output; l != NO_NODE; l = pf->links[l].next) n++;
+		counts[state] = n;
+		total += n;
+	}
+
+	pf->output_offsets = malloc((num_states + 1) * sizeof(uint32_t));
+	pf->outputs = malloc((total ? total : 1) * sizeof(uint32_t));
+	pf->output_offsets[0] = 0;
+	for (size_t s = 0; s < num_states; s++) {
+		pf->output_offsets[s + 1] = pf->output_offsets[s] + counts[s];
+	}
+	for (size_t q = 0; q < tail; q++) {
+		const uint32_t state = queue[q];
+		uint32_t *out = &pf->outputs[pf->output_offsets[state]];
+		for (int32_t l = pf->nodes[state].first_output; l != NO_NODE; l = pf->links[l].next) {
+			*out++ = pf->links[l].rule_id;
+		}
+		const uint32_t f = fail[state];
+		memcpy(out, &pf->outputs[pf->output_offsets[f]], counts[f] * sizeof(uint32_t));
+	}
+
+	pf->transitions = trans;
+	pf->num_states = (uint32_t)num_states;
+
+	free(counts);
+	free(queue);
+	free(fail);
+
+	// Free build-time structures
+	free(pf->nodes);
+	free(pf->links);
+	pf->nodes = NULL;
+	pf->links = NULL;
+	pf->num_nodes = pf->nodes_capacity = 0;
+	pf->num_links = pf->links_capacity = 0;
+}
+
+
+size_t prefilter_candidates_size(const struct prefilter_t *pf) {
+	return pf->num_words ? pf->num_words : 1;
+}
+
+
+void prefilter_scan(const struct prefilter_t *pf, const char *str, size_t len, uint64_t *candidates) {
+	if (pf->num_words == 0) {
+		candidates[0] = 0;
+		return;
+	}
+
+	memcpy(candidates, pf->always, pf->num_words * sizeof(uint64_t));
+
+	if (pf->transitions == NULL) {
+		return;
+	}
+
+	const uint32_t *trans = pf->transitions;
+	const uint32_t *offsets = pf->output_offsets;
+	const uint32_t nc = pf->num_classes;
+	uint32_t state = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		state = trans[state * nc + pf->class_map[(unsigned char)str[i]]];
+
+		for (uint32_t o = offsets[state]; o < offsets[state + 1]; o++) {
+			const uint32_t rule_id = pf->outputs[o];
+			candidates[rule_id >> 6] |= UINT64_C(1) << (rule_id & 63);
+		}
+	}
+}
+
+
+///##############
+//# Serialization
+///##############
+
+static size_t _prefilter_num_outputs(const struct prefilter_t *pf) {
+	return pf->transitions ? pf->output_offsets[pf->num_states] : 0;
+}
+
+
+size_t prefilter_serialized_size(const struct prefilter_t *pf) {
+	const size_t num_states = pf->transitions ? pf->num_states : 0;
+
+	return sizeof(struct prefilter_serialized_header)
+		+ pf->num_words * sizeof(uint64_t)
+		+ (num_states * pf->num_classes) * sizeof(uint32_t)
+		+ (num_states ? num_states + 1 : 0) * sizeof(uint32_t)
+		+ _prefilter_num_outputs(pf) * sizeof(uint32_t);
+}
+
+
+void prefilter_serialize(const struct prefilter_t *pf, void *out) {
+	struct prefilter_serialized_header header;
+	memset(&header, 0, sizeof(header));
+
+	const uint32_t num_states = pf->transitions ? pf->num_states : 0;
+	header.num_words   = pf->num_words;
+	header.num_classes = pf->num_classes;
+	header.num_states  = num_states;
+	header.num_outputs = _prefilter_num_outputs(pf);
+	memcpy(header.class_map, pf->class_map, sizeof(header.class_map));
+
+	char *write_ptr = out;
+#define WRITE(_ptr, _size) do { memcpy(write_ptr, (_ptr), (_size)); write_ptr += (_size); } while (0)
+	WRITE(&header, sizeof(header));
+	WRITE(pf->always, pf->num_words * sizeof(uint64_t));
+	if (num_states) {
+		WRITE(pf->transitions, (size_t)num_states * pf->num_classes * sizeof(uint32_t));
+		WRITE(pf->output_offsets, (num_states + 1) * sizeof(uint32_t));
+		WRITE(pf->outputs, header.num_outputs * sizeof(uint32_t));
+	}
+#undef WRITE
+}
+
+
+struct prefilter_t *prefilter_deserialize(const void *data, size_t size) {
+	struct prefilter_serialized_header header;
+
+	if (size < sizeof(header)) {
+		return NULL;
+	}
+	memcpy(&header, data, sizeof(header));
+
+	const size_t num_states = header.num_states;
+	const size_t expected = sizeof(header)
+		+ (size_t)header.num_words * sizeof(uint64_t)
+		+ (num_states * header.num_classes) * sizeof(uint32_t)
+		+ (num_states ? num_states + 1 : 0) * sizeof(uint32_t)
+		+ (size_t)header.num_outputs * sizeof(uint32_t);
+
+	if (size != expected || header.num_classes > 256) {
+		return NULL;
+	}
+
+	struct prefilter_t *pf = calloc(1, sizeof(struct prefilter_t));
+	if (pf == NULL) {
+		return NULL;
+	}
+
+	const char *read_ptr = (const char*)data + sizeof(header);
+	pf->borrowed    = true;
+	pf->num_words   = header.num_words;
+	pf->num_classes = header.num_classes;
+	pf->num_states  = header.num_states;
+	memcpy(pf->class_map, header.class_map, sizeof(pf->class_map));
+
+	pf->always = (uint64_t*)read_ptr;
+	read_ptr += pf->num_words * sizeof(uint64_t);
+
+	if (num_states) {
+		pf->transitions = (uint32_t*)read_ptr;
+		read_ptr += num_states * pf->num_classes * sizeof(uint32_t);
+		pf->output_offsets = (uint32_t*)read_ptr;
+		read_ptr += (num_states + 1) * sizeof(uint32_t);
+		pf->outputs = (uint32_t*)read_ptr;
+
+		// Make sure scanning can't wander outside of the arrays
+		bool valid = pf->output_offsets[0] == 0 && pf->output_offsets[num_states] == header.num_outputs;
+		for (size_t i = 0; valid && i < num_states * pf->num_classes; i++) {
+			valid = pf->transitions[i] < num_states;
+		}
+		for (size_t i = 0; valid && i < num_states; i++) {
+			valid = pf->output_offsets[i] <= pf->output_offsets[i + 1];
+		}
+		for (size_t i = 0; valid && i < header.num_outputs; i++) {
+			valid = pf->outputs[i] < (size_t)pf->num_words * 64;
+		}
+		for (size_t i = 0; valid && i < 256; i++) {
+			valid = pf->class_map[i] < pf->num_classes;
+		}
+
+		if (!valid) {
+			free(pf);
+			return NULL;
+		}
+	}
+
+	return pf;
+}
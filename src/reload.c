@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "uap/uap.h"
+
+// How long uap_reloadable_publish() sleeps between checks on the readers
+#define RELOAD_GRACE_POLL_NS (50 * 1000)
+
+
+// Each reading thread owns a slot, holding the epoch it saw when it last
+// acquired the parser, or 0 while it isn't using one. Slots are only ever
+// added to the list, and are reused once their thread exits.
+struct reload_slot {
+	uint64_t epoch;
+	bool in_use;
+	struct reload_slot *next;
+};
+
+
+struct uap_reloadable {
+	struct uap_parser *current;
+	uint64_t epoch;                // bumped every time a parser is published
+	struct reload_slot *slots;
+	pthread_key_t slot_key;        // -> struct reload_slot
+	pthread_mutex_t publish_lock;  // one publisher at a time
+};
+
+
+static void _reload_slot_release(void *ptr) {
+	struct reload_slot *slot = ptr;
+	__atomic_store_n(&slot->epoch, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&slot->in_use, false, __ATOMIC_RELEASE);
+}
+
+
+// Find the calling thread's slot, taking over an unused one or adding a new
+// one to the list the first time through. Returns NULL if out of memory.
+static struct reload_slot *_reload_slot_get(struct uap_reloadable *reloadable) {
+	struct reload_slot *slot = pthread_getspecific(reloadable->slot_key);
+	if (slot != NULL) {
+		return slot;
+	}
+
+	for (slot = __atomic_load_n(&reloadable->slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+		bool unused = false;
+		if (__atomic_compare_exchange_n(&slot->in_use, &unused, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		slot = calloc(1, sizeof(struct reload_slot));
+		if (slot == NULL) {
+			return NULL;
+		}
+		slot->in_use = true;
+		slot->next = __atomic_load_n(&reloadable->slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&reloadable->slots, &slot->next, slot, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	}
+
+	if (pthread_setspecific(reloadable->slot_key, slot) != 0) {
+		_reload_slot_release(slot);
+		return NULL;
+	}
+
+	return slot;
+}
+
+
+struct uap_reloadable *uap_reloadable_create(struct uap_parser *ua_parser) {
+	struct uap_reloadable *reloadable = malloc(sizeof(struct uap_reloadable));
+	if (reloadable == NULL) {
+		return NULL;
+	}
+
+	if (pthread_key_create(&reloadable->slot_key, &_reload_slot_release) != 0) {
+		free(reloadable);
+		return NULL;
+	}
+	pthread_mutex_init(&reloadable->publish_lock, NULL);
+
+	reloadable->current = ua_parser;
+	reloadable->epoch   = 1;
+	reloadable->slots   = NULL;
+
+	return reloadable;
+}
+
+
+void uap_reloadable_destroy(struct uap_reloadable *reloadable) {
+	// Deleting the key first keeps exiting threads from touching the slots
+	pthread_key_delete(reloadable->slot_key);
+	while (reloadable->slots) {
+		struct reload_slot *next = reloadable->slots->next;
+		free(reloadable->slots);
+		reloadable->slots = next;
+	}
+	pthread_mutex_destroy(&reloadable->publish_lock);
+
+	if (reloadable->current) {
+		uap_parser_destroy(reloadable->current);
+	}
+	free(reloadable);
+}
+
+
+const struct uap_parser *uap_reloadable_acquire(struct uap_reloadable *reloadable) {
+	struct reload_slot *slot = _reload_slot_get(reloadable);
+	if (slot == NULL) {
+		return NULL;
+	}
+
+	// Announce the epoch before looking at the parser. A publisher swaps the
+	// parser before looking at the slots, so either it sees this epoch and
+	// waits for us, or we see its parser.
+	__atomic_store_n(&slot->epoch, __atomic_load_n(&reloadable->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&reloadable->current, __ATOMIC_SEQ_CST);
+}
+
+
+void uap_reloadable_release(struct uap_reloadable *reloadable) {
+	struct reload_slot *slot = pthread_getspecific(reloadable->slot_key);
+	if (slot != NULL) {
+		__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+
+void uap_reloadable_publish(struct uap_reloadable *reloadable, struct uap_parser *ua_parser) {
+	pthread_mutex_lock(&reloadable->publish_lock);
+
+	struct uap_parser *previous = __atomic_exchange_n(&reloadable->current, ua_parser, __ATOMIC_SEQ_CST);
+	const uint64_t epoch = __atomic_add_fetch(&reloadable->epoch, 1, __ATOMIC_SEQ_CST);
+
+	// Wait out every reader which acquired a parser before the swap, readers
+	// which come later can only see the new one.
+	for (struct reload_slot *slot = __atomic_load_n(&reloadable->slots, __ATOMIC_SEQ_CST); slot; slot = slot->next) {
+		for (;;) {
+			const uint64_t seen = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+			if (seen == 0 || seen >= epoch) {
+				break;
+			}
+			const struct timespec poll = { 0, RELOAD_GRACE_POLL_NS };
+			nanosleep(&poll, NULL);
+		}
+	}
+
+	pthread_mutex_unlock(&reloadable->publish_lock);
+
+	if (previous) {
+		uap_parser_destroy(previous);
+	}
+}
+
+
+int uap_reloadable_reload_file(struct uap_reloadable *reloadable, FILE *fd, unsigned int flags) {
+	struct uap_parser *ua_parser = uap_parser_create_with_flags(flags);
+	if (ua_parser == NULL) {
+		return 0;
+	}
+
+	// Keep serving the old rules rather than publish an empty parser
+	if (!uap_parser_read_file(ua_parser, fd) || uap_parser_rule_stats(ua_parser, NULL, 0) == 0) {
+		uap_parser_destroy(ua_parser);
+		return 0;
+	}
+
+	uap_reloadable_publish(reloadable, ua_parser);
+	return 1;
+}
@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/result_cache.h"
+#include "uap/unique_strings.h"
+#include "uap/uap.h"
+
+#define CACHE_SHARD_BITS 5
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_EXPECTED_ENTRY_SIZE 256 // used to size the hash tables
+#define CACHE_MIN_BUCKETS 16
+#define CACHE_SEED 0x3c6ef372 // random
+
+
+struct cache_entry {
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev; // towards most recently used
+	struct cache_entry *lru_next; // towards least recently used
+	uint32_t hash;
+	uint32_t tag;
+	uint32_t key_len;
+	size_t value_len;
+	char data[]; // key followed by value
+};
+
+
+// Each shard is an independent LRU cache covering a slice of the hash space,
+// so threads only contend when they hit the same shard.
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	uint32_t bucket_mask;
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+	size_t memory_used;
+	size_t memory_limit;
+	size_t entries;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+};
+
+
+struct result_cache_t {
+	struct cache_shard shards[CACHE_SHARDS];
+};
+
+
+static inline size_t _entry_size(size_t key_len, size_t value_len) {
+	return sizeof(struct cache_entry) + key_len + value_len;
+}
+
+
+static inline struct cache_shard *_get_shard(struct result_cache_t *cache, uint32_t hash) {
+	return &cache->shards[hash >> (32 - CACHE_SHARD_BITS)];
+}
+
+
+///####################
+//# LRU list management
+///####################
+
+static void _lru_unlink(struct cache_shard *shard, struct cache_entry *entry) {
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		shard->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		shard->lru_tail = entry->lru_prev;
+	}
+}
+
+
+static void _lru_push_front(struct cache_shard *shard, struct cache_entry *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = shard->lru_head;
+
+	if (shard->lru_head) {
+		shard->lru_head->lru_prev = entry;
+	} else {
+		shard->lru_tail = entry;
+	}
+
+	shard->lru_head = entry;
+}
+
+
+static struct cache_entry **_find_link(
+		struct cache_shard *shard,
+		uint32_t hash,
+		uint32_t tag,
+		const char *key,
+		size_t key_len)
+{
+	struct cache_entry **link = &shard->buckets[hash & shard->bucket_mask];
+
+	while (*link) {
+		const struct cache_entry *entry = *link;
+		if (entry->hash == hash && entry->tag == tag && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0) {
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+
+	return link;
+}
+
+
+// Remove the least recently used entry of the shard.
+static void _evict_one(struct cache_shard *shard) {
+	struct cache_entry *victim = shard->lru_tail;
+	struct cache_entry **link = _find_link(shard, victim->hash, victim->tag, victim->data, victim->key_len);
+
+	*link = victim->hash_next;
+	_lru_unlink(shard, victim);
+
+	shard->memory_used -= _entry_size(victim->key_len, victim->value_len);
+	shard->entries--;
+	shard->evictions++;
+
+	free(victim);
+}
+
+
+struct result_cache_t *result_cache_create(size_t max_memory) {
+	struct result_cache_t *cache = calloc(1, sizeof(struct result_cache_t));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	const size_t shard_limit = max_memory / CACHE_SHARDS;
+
+	// Size each shard's table for the number of typical entries which fit
+	uint32_t num_buckets = CACHE_MIN_BUCKETS;
+	while ((size_t)num_buckets * CACHE_EXPECTED_ENTRY_SIZE < shard_limit && num_buckets < (1u << 24)) {
+		num_buckets <<= 1;
+	}
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+		shard->buckets = calloc(num_buckets, sizeof(struct cache_entry*));
+		if (shard->buckets == NULL) {
+			for (int j = 0; j < i; j++) {
+				free(cache->shards[j].buckets);
+				pthread_mutex_destroy(&cache->shards[j].lock);
+			}
+			free(cache);
+			return NULL;
+		}
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->bucket_mask = num_buckets - 1;
+		shard->memory_used = num_buckets * sizeof(struct cache_entry*);
+		shard->memory_limit = shard_limit;
+	}
+
+	return cache;
+}
+
+
+void result_cache_destroy(struct result_cache_t *cache) {
+	if (cache == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+		struct cache_entry *entry = shard->lru_head;
+
+		while (entry) {
+			struct cache_entry *next = entry->lru_next;
+			free(entry);
+			entry = next;
+		}
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+
+	free(cache);
+}
+
+
+bool result_cache_lookup(
+		struct result_cache_t *cache,
+		const char *key,
+		size_t key_len,
+		uint32_t tag,
+		void (*found_cb)(void *ctx, const void *value, size_t value_len),
+		void *ctx)
+{
+	const uint32_t hash = hash_murmur2(key, key_len, CACHE_SEED ^ tag);
+	struct cache_shard *shard = _get_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct cache_entry *entry = *_find_link(shard, hash, tag, key, key_len);
+
+	if (entry) {
+		shard->hits++;
+
+		if (entry != shard->lru_head) {
+			_lru_unlink(shard, entry);
+			_lru_push_front(shard, entry);
+		}
+
+		found_cb(ctx, &entry->data[entry->key_len], entry->value_len);
+	} else {
+		shard->misses++;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return entry != NULL;
+}
+
+
+void result_cache_insert(
+		struct result_cache_t *cache,
+		const char *key,
+		size_t key_len,
+		uint32_t tag,
+		const void *header,
+		size_t header_len,
+		const void *body,
+		size_t body_len)
+{
+	const uint32_t hash = hash_murmur2(key, key_len, CACHE_SEED ^ tag);
+	struct cache_shard *shard = _get_shard(cache, hash);
+	const size_t value_len = header_len + body_len;
+	const size_t size = _entry_size(key_len, value_len);
+
+	// Don't let a single entry flush out a large part of the shard
+	if (key_len > UINT32_MAX || size > shard->memory_limit / 4) {
+		return;
+	}
+
+	struct cache_entry *entry = malloc(size);
+
+	if (entry == NULL) {
+		return;
+	}
+
+	entry->hash = hash;
+	entry->tag = tag;
+	entry->key_len = key_len;
+	entry->value_len = value_len;
+	memcpy(entry->data, key, key_len);
+	memcpy(&entry->data[key_len], header, header_len);
+	if (body_len > 0) {
+		memcpy(&entry->data[key_len + header_len], body, body_len);
+	}
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct cache_entry **link = _find_link(shard, hash, tag, key, key_len);
+
+	// Another thread got here first
+	if (*link) {
+		pthread_mutex_unlock(&shard->lock);
+		free(entry);
+		return;
+	}
+
+	entry->hash_next = NULL;
+	*link = entry;
+	_lru_push_front(shard, entry);
+
+	shard->memory_used += size;
+	shard->entries++;
+	shard->insertions++;
+
+	while (shard->memory_used > shard->memory_limit && shard->lru_tail != entry) {
+		_evict_one(shard);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+void result_cache_clear(struct result_cache_t *cache) {
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		while (shard->lru_tail) {
+			_evict_one(shard);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+
+void result_cache_stats(struct result_cache_t *cache, struct uap_cache_stats *stats) {
+	memset(stats, 0, sizeof(struct uap_cache_stats));
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->hits        += shard->hits;
+		stats->misses      += shard->misses;
+		stats->insertions  += shard->insertions;
+		stats->evictions   += shard->evictions;
+		stats->entries     += shard->entries;
+		stats->memory_used += shard->memory_used;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
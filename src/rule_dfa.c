@@ -0,0 +1,1706 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/rule_dfa.h"
+
+#define MAX_GROUP_DEPTH 32
+#define MAX_REPEAT_COPIES 16          // larger counted repeats are widened to x*
+#define MAX_NFA_STATES (1 << 22)
+#define CACHE_MAX_MEMORY (1024 * 1024) // per cache, before it's flushed
+#define CACHE_MAX_FLUSHES 4            // per scan, before giving up
+#define UNBOUNDED UINT32_MAX
+#define NO_STATE UINT32_MAX
+#define NO_RULE UINT32_MAX
+#define UNKNOWN_RULE (UINT32_MAX - 1)
+
+
+enum nfa_type {
+	NFA_CHARSET,  // consume one byte which is in charsets[arg]
+	NFA_SPLIT,    // continue at both `out` and `out1`
+	NFA_EMPTY,    // continue at `out`
+	NFA_BEGIN,    // continue at `out`, at the start of the string only
+	NFA_END,      // continue at `out`, at the end of the string only
+	NFA_MATCH,    // rule `arg` matched
+};
+
+
+struct nfa_state {
+	uint32_t type;
+	uint32_t arg;
+	uint32_t out;
+	uint32_t out1;
+};
+
+
+struct charset {
+	uint64_t bits[4];
+};
+
+
+// A partially built automaton. Its dangling exits are patched once the
+// following fragment is known, and are listed by threading the list through
+// the unset `out`/`out1` fields themselves, as (state << 1 | is_out1).
+struct fragment {
+	uint32_t start;
+	uint32_t exits;
+};
+
+
+struct rule_dfa_t {
+	struct nfa_state *states;
+	size_t num_states;
+	size_t states_capacity;
+	struct charset *charsets;
+	size_t num_charsets;
+	size_t charsets_capacity;
+
+	// The states of each rule are contiguous and in rule order, so every
+	// state of the rules after rule `r` is at or above rule_first_state[r].
+	uint32_t *rule_ids;
+	uint32_t *rule_first_state;
+	uint32_t *rule_starts;
+	uint32_t num_rules;
+	uint32_t rules_capacity;
+
+	// Compiled
+	unsigned char class_map[256];   // byte -> equivalence class
+	unsigned char class_bytes[256]; // class -> representative byte
+	uint32_t num_classes;
+	uint32_t *inject;               // sorted closure of every rule start past the start of the string
+	uint32_t num_inject;
+	uint32_t inject_best;           // first rule matching an empty string there
+	bool compiled;
+
+	const struct rule_dfa_table *table; // precomputed states, tried before the cache
+};
+
+
+struct parse_ctx {
+	struct rule_dfa_t *dfa;
+	const char *re;
+	size_t pos;
+	int depth;
+	bool caseless;
+	bool dotall;
+	bool multiline;
+	bool failed;
+};
+
+
+// Scratch space for following empty transitions.
+struct closure {
+	uint32_t *set;   // consuming states reached
+	uint32_t size;
+	uint32_t best;   // first rule matched
+	uint32_t *marks; // per NFA state, == generation once visited
+	uint32_t generation;
+	uint32_t *stack;
+};
+
+
+struct dfa_state {
+	uint32_t set;      // offset of the sorted NFA state set in `sets`
+	uint32_t size;
+	uint32_t best;     // first rule matched so far, NO_RULE if none
+	uint32_t end_best; // best once the end of the string is reached, or UNKNOWN_RULE
+	uint32_t hash;
+	bool done;         // nothing that follows can improve on `best`
+};
+
+
+struct rule_dfa_cache_t {
+	const struct rule_dfa_t *dfa;
+	struct dfa_state *states;
+	uint32_t num_states;
+	uint32_t states_capacity;
+	uint32_t *transitions; // num_classes per state, NO_STATE until computed
+	uint32_t *sets;
+	size_t sets_used;
+	size_t sets_capacity;
+	uint32_t *table;       // open addressed, state index + 1
+	uint32_t table_size;
+	uint32_t start;
+	uint32_t flushes;
+	size_t max_memory;
+	struct closure closure;
+};
+
+
+///###############################
+//# Character sets
+///###############################
+
+static inline void _charset_add(struct charset *set, unsigned int byte) {
+	set->bits[byte >> 6] |= (uint64_t)1 << (byte & 63);
+}
+
+
+static inline bool _charset_has(const struct charset *set, unsigned int byte) {
+	return (set->bits[byte >> 6] >> (byte & 63)) & 1;
+}
+
+
+static void _charset_add_range(struct charset *set, unsigned int lo, unsigned int hi) {
+	for (unsigned int byte = lo; byte <= hi; byte++) {
+		_charset_add(set, byte);
+	}
+}
+
+
+static void _charset_fold_case(struct charset *set) {
+	for (unsigned int byte = 'a'; byte <= 'z'; byte++) {
+		if (_charset_has(set, byte) || _charset_has(set, byte - 32)) {
+			_charset_add(set, byte);
+			_charset_add(set, byte - 32);
+		}
+	}
+}
+
+
+// Complement within ASCII, non-ASCII characters are handled separately.
+static void _charset_invert_ascii(struct charset *set) {
+	set->bits[0] = ~set->bits[0];
+	set->bits[1] = ~set->bits[1];
+}
+
+
+// Add the members of the class escape \d, \w, \s or their negations. Every
+// non-ASCII character is outside of \d, \w and \s. Returns false for any
+// other escape.
+static bool _charset_add_escape_class(struct charset *set, char escape, bool *non_ascii) {
+	struct charset members = { { 0, 0, 0, 0 } };
+
+	switch (escape | 0x20) {
+		case 'd':
+			_charset_add_range(&members, '0', '9');
+			break;
+		case 'w':
+			_charset_add_range(&members, '0', '9');
+			_charset_add_range(&members, 'A', 'Z');
+			_charset_add_range(&members, 'a', 'z');
+			_charset_add(&members, '_');
+			break;
+		case 's':
+			_charset_add_range(&members, '\t', '\r');
+			_charset_add(&members, ' ');
+			break;
+		default:
+			return false;
+	}
+
+	if (escape >= 'A' && escape <= 'Z') {
+		_charset_invert_ascii(&members);
+		*non_ascii = true;
+	}
+
+	for (int i = 0; i < 4; i++) {
+		set->bits[i] |= members.bits[i];
+	}
+	return true;
+}
+
+
+///###############################
+//# NFA construction
+///###############################
+
+static uint32_t _nfa_state(struct parse_ctx *ctx, uint32_t type, uint32_t arg, uint32_t out, uint32_t out1) {
+	struct rule_dfa_t *dfa = ctx->dfa;
+
+	if (dfa->num_states >= MAX_NFA_STATES) {
+		ctx->failed = true;
+	}
+
+	if (dfa->num_states == dfa->states_capacity) {
+		dfa->states_capacity = dfa->states_capacity ? dfa->states_capacity * 2 : 1024;
+		dfa->states = realloc(dfa->states, dfa->states_capacity * sizeof(struct nfa_state));
+	}
+
+	dfa->states[dfa->num_states] = (struct nfa_state){ type, arg, out, out1 };
+	return dfa->num_states++;
+}
+
+
+static uint32_t *_exit_field(struct rule_dfa_t *dfa, uint32_t exit) {
+	struct nfa_state *state = &dfa->states[exit >> 1];
+	return (exit & 1) ? &state->out1 : &state->out;
+}
+
+
+static void _patch(struct rule_dfa_t *dfa, uint32_t exits, uint32_t target) {
+	while (exits != NO_STATE) {
+		uint32_t *field = _exit_field(dfa, exits);
+		exits = *field;
+		*field = target;
+	}
+}
+
+
+static uint32_t _append_exits(struct rule_dfa_t *dfa, uint32_t exits, uint32_t more) {
+	if (exits == NO_STATE) {
+		return more;
+	}
+
+	uint32_t last = exits;
+	while (*_exit_field(dfa, last) != NO_STATE) {
+		last = *_exit_field(dfa, last);
+	}
+	*_exit_field(dfa, last) = more;
+
+	return exits;
+}
+
+
+static struct fragment _frag_state(struct parse_ctx *ctx, uint32_t type, uint32_t arg) {
+	const uint32_t state = _nfa_state(ctx, type, arg, NO_STATE, NO_STATE);
+	return (struct fragment){ state, state << 1 };
+}
+
+
+static struct fragment _frag_empty(struct parse_ctx *ctx) {
+	return _frag_state(ctx, NFA_EMPTY, 0);
+}
+
+
+static struct fragment _frag_charset(struct parse_ctx *ctx, const struct charset *set) {
+	struct rule_dfa_t *dfa = ctx->dfa;
+
+	if (dfa->num_charsets == dfa->charsets_capacity) {
+		dfa->charsets_capacity = dfa->charsets_capacity ? dfa->charsets_capacity * 2 : 256;
+		dfa->charsets = realloc(dfa->charsets, dfa->charsets_capacity * sizeof(struct charset));
+	}
+	dfa->charsets[dfa->num_charsets] = *set;
+
+	return _frag_state(ctx, NFA_CHARSET, dfa->num_charsets++);
+}
+
+
+static struct fragment _frag_fold_non_ascii(struct parse_ctx *ctx, const struct charset *set, struct fragment frag);
+
+
+static struct fragment _frag_byte(struct parse_ctx *ctx, unsigned int byte, bool caseless) {
+	struct charset set = { { 0, 0, 0, 0 } };
+	_charset_add(&set, byte);
+	if (!caseless) {
+		return _frag_charset(ctx, &set);
+	}
+	_charset_fold_case(&set);
+	return _frag_fold_non_ascii(ctx, &set, _frag_charset(ctx, &set));
+}
+
+
+static struct fragment _frag_concat(struct parse_ctx *ctx, struct fragment a, struct fragment b) {
+	_patch(ctx->dfa, a.exits, b.start);
+	return (struct fragment){ a.start, b.exits };
+}
+
+
+static struct fragment _frag_alternate(struct parse_ctx *ctx, struct fragment a, struct fragment b) {
+	const uint32_t split = _nfa_state(ctx, NFA_SPLIT, 0, a.start, b.start);
+	return (struct fragment){ split, _append_exits(ctx->dfa, a.exits, b.exits) };
+}
+
+
+static struct fragment _frag_optional(struct parse_ctx *ctx, struct fragment a) {
+	const uint32_t split = _nfa_state(ctx, NFA_SPLIT, 0, a.start, NO_STATE);
+	return (struct fragment){ split, _append_exits(ctx->dfa, a.exits, split << 1 | 1) };
+}
+
+
+static struct fragment _frag_star(struct parse_ctx *ctx, struct fragment a) {
+	const uint32_t split = _nfa_state(ctx, NFA_SPLIT, 0, a.start, NO_STATE);
+	_patch(ctx->dfa, a.exits, split);
+	return (struct fragment){ split, split << 1 | 1 };
+}
+
+
+static struct fragment _frag_plus(struct parse_ctx *ctx, struct fragment a) {
+	const uint32_t split = _nfa_state(ctx, NFA_SPLIT, 0, a.start, NO_STATE);
+	_patch(ctx->dfa, a.exits, split);
+	return (struct fragment){ a.start, split << 1 | 1 };
+}
+
+
+// One multi-byte UTF-8 character. The subject is valid UTF-8 whenever PCRE
+// can match it at all, so this only needs to keep character boundaries.
+static struct fragment _frag_non_ascii(struct parse_ctx *ctx) {
+	struct charset continuation = { { 0, 0, 0, 0 } };
+	_charset_add_range(&continuation, 0x80, 0xbf);
+
+	struct fragment any = { NO_STATE, NO_STATE };
+	for (unsigned int length = 2; length <= 4; length++) {
+		struct charset lead = { { 0, 0, 0, 0 } };
+		_charset_add_range(&lead, 0x100 - (0x80 >> (length - 1)), 0xff - (0x80 >> length));
+
+		struct fragment sequence = _frag_charset(ctx, &lead);
+		for (unsigned int i = 1; i < length; i++) {
+			sequence = _frag_concat(ctx, sequence, _frag_charset(ctx, &continuation));
+		}
+		any = length == 2 ? sequence : _frag_alternate(ctx, any, sequence);
+	}
+
+	return any;
+}
+
+
+// In UTF-8 caseless mode PCRE also matches 'k' with KELVIN SIGN and 's' with
+// LATIN SMALL LETTER LONG S, the only non-ASCII characters which fold to ASCII.
+static const struct {
+	int32_t code_point;
+	char letter;
+	const char *utf8;
+} _ascii_folds[] = {
+	{ 0x212a, 'k', "\xe2\x84\xaa" },
+	{ 0x017f, 's', "\xc5\xbf" },
+};
+
+
+// Alternate `frag`, which matches the caseless `set`, with the non-ASCII
+// characters folding to its letters.
+static struct fragment _frag_fold_non_ascii(struct parse_ctx *ctx, const struct charset *set, struct fragment frag) {
+	for (size_t i = 0; i < sizeof(_ascii_folds) / sizeof(_ascii_folds[0]); i++) {
+		if (_charset_has(set, _ascii_folds[i].letter)) {
+			const char *utf8 = _ascii_folds[i].utf8;
+			struct fragment sequence = _frag_byte(ctx, (unsigned char)utf8[0], false);
+			for (size_t j = 1; utf8[j]; j++) {
+				sequence = _frag_concat(ctx, sequence, _frag_byte(ctx, (unsigned char)utf8[j], false));
+			}
+			frag = _frag_alternate(ctx, frag, sequence);
+		}
+	}
+	return frag;
+}
+
+
+// Add the ASCII letters which the non-ASCII characters `lo` to `hi` fold to.
+static void _charset_add_ascii_folds(struct charset *set, int32_t lo, int32_t hi) {
+	for (size_t i = 0; i < sizeof(_ascii_folds) / sizeof(_ascii_folds[0]); i++) {
+		if (_ascii_folds[i].code_point >= lo && _ascii_folds[i].code_point <= hi) {
+			_charset_add(set, _ascii_folds[i].letter);
+		}
+	}
+}
+
+
+// One non-ASCII character `value`, which in caseless mode may also be any
+// other case of it, including an ASCII letter.
+static struct fragment _frag_non_ascii_literal(struct parse_ctx *ctx, int32_t value) {
+	struct charset letters = { { 0, 0, 0, 0 } };
+	struct fragment frag = _frag_non_ascii(ctx);
+
+	if (ctx->caseless) {
+		_charset_add_ascii_folds(&letters, value, value);
+		_charset_fold_case(&letters);
+		if (letters.bits[0] | letters.bits[1]) {
+			frag = _frag_alternate(ctx, frag, _frag_charset(ctx, &letters));
+		}
+	}
+	return frag;
+}
+
+
+// One character from the ASCII members of `set`, or any non-ASCII character.
+static struct fragment _frag_class(struct parse_ctx *ctx, const struct charset *set, bool non_ascii) {
+	struct fragment frag = _frag_charset(ctx, set);
+	return non_ascii ? _frag_alternate(ctx, frag, _frag_non_ascii(ctx)) : frag;
+}
+
+
+// $ matches at the end of the string or before a final newline.
+static struct fragment _frag_end(struct parse_ctx *ctx) {
+	struct fragment newline = _frag_optional(ctx, _frag_byte(ctx, '\n', false));
+	return _frag_concat(ctx, newline, _frag_state(ctx, NFA_END, 0));
+}
+
+
+///###############################
+//# Regular expression parsing
+///###############################
+
+static struct fragment _parse_alternation(struct parse_ctx *ctx);
+
+
+static int _hex_value(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+
+// Decode the UTF-8 character at `str`. Returns the code point, or -1.
+static int32_t _utf8_decode(const char *str, size_t *len) {
+	const unsigned char lead = str[0];
+	const size_t length = lead < 0x80 ? 1 : lead < 0xc0 ? 0 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : lead < 0xf8 ? 4 : 0;
+
+	if (length == 0) {
+		return -1;
+	}
+
+	int32_t value = length == 1 ? lead : lead & (0x7f >> length);
+	for (size_t i = 1; i < length; i++) {
+		if (((unsigned char)str[i] & 0xc0) != 0x80) {
+			return -1;
+		}
+		value = (value << 6) | (str[i] & 0x3f);
+	}
+
+	*len = length;
+	return value;
+}
+
+
+// Decode a literal escape, `re` pointing just past the backslash. Returns the
+// code point, or -1 if this isn't a literal escape.
+static int32_t _parse_escape_literal(const char *re, size_t *len) {
+	int32_t value = 0;
+	size_t i = 1;
+
+	switch (re[0]) {
+		case 'n': value = '\n'; break;
+		case 't': value = '\t'; break;
+		case 'r': value = '\r'; break;
+		case 'f': value = '\f'; break;
+		case 'e': value = 0x1b; break;
+		case 'a': value = 0x07; break;
+
+		case '0':
+			while (i < 3 && re[i] >= '0' && re[i] <= '7') {
+				value = value * 8 + (re[i++] - '0');
+			}
+			break;
+
+		case 'x':
+			if (re[1] == '{') {
+				for (i = 2; _hex_value(re[i]) >= 0 && value <= 0x10ffff; i++) {
+					value = value * 16 + _hex_value(re[i]);
+				}
+				if (re[i] != '}' || i == 2) {
+					return -1;
+				}
+				i++;
+			} else {
+				while (i < 3 && _hex_value(re[i]) >= 0) {
+					value = value * 16 + _hex_value(re[i++]);
+				}
+			}
+			break;
+
+		default:
+			// Escaped punctuation is always a literal
+			if (re[0] == '\0' || (unsigned char)re[0] >= 0x80 ||
+				(re[0] >= '0' && re[0] <= '9') ||
+				((re[0] | 0x20) >= 'a' && (re[0] | 0x20) <= 'z'))
+			{
+				return -1;
+			}
+			value = re[0];
+			break;
+	}
+
+	*len = i;
+	return value;
+}
+
+
+// A literal character within a class, either plain, escaped or UTF-8.
+static int32_t _parse_class_literal(struct parse_ctx *ctx) {
+	const char *re = &ctx->re[ctx->pos];
+	size_t len = 1;
+	int32_t value;
+
+	if (re[0] == '\\') {
+		value = re[1] == 'b' ? '\b' : _parse_escape_literal(&re[1], &len);
+		len++;
+	} else {
+		value = _utf8_decode(re, &len);
+	}
+
+	if (value < 0) {
+		ctx->failed = true;
+		return -1;
+	}
+
+	ctx->pos += len;
+	return value;
+}
+
+
+static void _class_add_range(struct charset *set, bool *non_ascii, int32_t lo, int32_t hi) {
+	if (lo < 0x80) {
+		_charset_add_range(set, lo, hi < 0x80 ? hi : 0x7f);
+	}
+	if (hi >= 0x80) {
+		*non_ascii = true;
+	}
+}
+
+
+static bool _parse_posix_class(struct parse_ctx *ctx, struct charset *set, bool *non_ascii) {
+	static const struct {
+		const char *name;
+		const char *ranges; // pairs of inclusive bounds
+	} classes[] = {
+		{ "alpha:]",  "AZaz" },
+		{ "digit:]",  "09" },
+		{ "alnum:]",  "09AZaz" },
+		{ "upper:]",  "AZ" },
+		{ "lower:]",  "az" },
+		{ "space:]",  "\t\r  " },
+		{ "xdigit:]", "09AFaf" },
+		{ "word:]",   "09AZaz__" },
+		{ "punct:]",  "!/:@[`{~" },
+	};
+
+	const char *re = &ctx->re[ctx->pos + 2];
+	const bool negate = re[0] == '^';
+	re += negate;
+
+	for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		const size_t len = strlen(classes[i].name);
+		if (strncmp(re, classes[i].name, len) == 0) {
+			struct charset members = { { 0, 0, 0, 0 } };
+			for (const char *range = classes[i].ranges; *range; range += 2) {
+				_charset_add_range(&members, range[0], range[1]);
+			}
+			if (negate) {
+				_charset_invert_ascii(&members);
+				*non_ascii = true;
+			}
+			for (int j = 0; j < 4; j++) {
+				set->bits[j] |= members.bits[j];
+			}
+			ctx->pos = (re + len) - ctx->re;
+			return true;
+		}
+	}
+
+	ctx->failed = true;
+	return false;
+}
+
+
+static struct fragment _parse_class(struct parse_ctx *ctx) {
+	struct charset set = { { 0, 0, 0, 0 } };
+	bool non_ascii = false;
+	bool negate = false;
+	const char *re = ctx->re;
+
+	ctx->pos++;
+	if (re[ctx->pos] == '^') {
+		negate = true;
+		ctx->pos++;
+	}
+
+	// A leading ']' is a literal
+	for (bool first = true; !ctx->failed; first = false) {
+		const char c = re[ctx->pos];
+
+		if (c == '\0') {
+			ctx->failed = true;
+			break;
+		} else if (c == ']' && !first) {
+			ctx->pos++;
+			break;
+		} else if (c == '[' && re[ctx->pos + 1] == ':') {
+			_parse_posix_class(ctx, &set, &non_ascii);
+			continue;
+		} else if (c == '\\' && _charset_add_escape_class(&set, re[ctx->pos + 1], &non_ascii)) {
+			ctx->pos += 2;
+			continue;
+		}
+
+		const int32_t lo = _parse_class_literal(ctx);
+		int32_t hi = lo;
+
+		if (re[ctx->pos] == '-' && re[ctx->pos + 1] != ']' && re[ctx->pos + 1] != '\0') {
+			ctx->pos++;
+			hi = _parse_class_literal(ctx);
+			if (hi < lo) {
+				ctx->failed = true;
+			}
+		}
+
+		if (!ctx->failed) {
+			_class_add_range(&set, &non_ascii, lo, hi);
+			if (ctx->caseless) {
+				_charset_add_ascii_folds(&set, lo, hi);
+			}
+		}
+	}
+
+	if (ctx->caseless) {
+		_charset_fold_case(&set);
+	}
+	if (negate) {
+		_charset_invert_ascii(&set);
+		non_ascii = true;
+	}
+
+	// Any non-ASCII character already covers the folds of the letters
+	const struct fragment frag = _frag_class(ctx, &set, non_ascii);
+	return ctx->caseless && !non_ascii ? _frag_fold_non_ascii(ctx, &set, frag) : frag;
+}
+
+
+static struct fragment _parse_escape(struct parse_ctx *ctx) {
+	const char *re = &ctx->re[ctx->pos + 1];
+	struct charset set = { { 0, 0, 0, 0 } };
+	bool non_ascii = false;
+
+	if (_charset_add_escape_class(&set, re[0], &non_ascii)) {
+		ctx->pos += 2;
+		return _frag_class(ctx, &set, non_ascii);
+	}
+
+	switch (re[0]) {
+		case 'b': // Word boundaries are widened to match anywhere
+		case 'B':
+			ctx->pos += 2;
+			return _frag_empty(ctx);
+
+		case 'A':
+			ctx->pos += 2;
+			return _frag_state(ctx, NFA_BEGIN, 0);
+
+		case 'z':
+		case 'Z':
+			ctx->pos += 2;
+			return _frag_end(ctx);
+
+		case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9': {
+			// Back references are widened to any string
+			ctx->pos += 2;
+			while (ctx->re[ctx->pos] >= '0' && ctx->re[ctx->pos] <= '9') {
+				ctx->pos++;
+			}
+			struct charset any;
+			memset(&any, 0xff, sizeof(any));
+			return _frag_star(ctx, _frag_charset(ctx, &any));
+		}
+
+		default:
+			break;
+	}
+
+	size_t len;
+	const int32_t value = _parse_escape_literal(re, &len);
+	if (value < 0) {
+		ctx->failed = true;
+		return _frag_empty(ctx);
+	}
+
+	ctx->pos += 1 + len;
+	if (value >= 0x80) {
+		return _frag_non_ascii_literal(ctx, value);
+	}
+	return _frag_byte(ctx, value, ctx->caseless);
+}
+
+
+static struct fragment _parse_literal(struct parse_ctx *ctx) {
+	size_t len;
+	const char *re = &ctx->re[ctx->pos];
+	const int32_t value = _utf8_decode(re, &len);
+
+	if (value < 0) {
+		ctx->failed = true;
+		return _frag_empty(ctx);
+	}
+	ctx->pos += len;
+
+	if (len == 1) {
+		return _frag_byte(ctx, (unsigned char)re[0], ctx->caseless);
+	} else if (ctx->caseless) {
+		// Other cases of a non-ASCII letter may have a different length
+		return _frag_non_ascii_literal(ctx, value);
+	}
+
+	struct fragment frag = _frag_byte(ctx, (unsigned char)re[0], false);
+	for (size_t i = 1; i < len; i++) {
+		frag = _frag_concat(ctx, frag, _frag_byte(ctx, (unsigned char)re[i], false));
+	}
+	return frag;
+}
+
+
+// Parse the option letters of (?imsx-imsx) or (?imsx-imsx: into `ctx`.
+// Returns the terminating character.
+static char _parse_options(struct parse_ctx *ctx) {
+	bool enable = true;
+
+	for (;;) {
+		const char c = ctx->re[ctx->pos++];
+		switch (c) {
+			case '-': enable = false; break;
+			case 'i': ctx->caseless = enable; break;
+			case 's': ctx->dotall = enable; break;
+			case 'm': ctx->multiline = enable; break;
+			case ')':
+			case ':':
+				return c;
+			default:
+				ctx->failed = true;
+				return '\0';
+		}
+	}
+}
+
+
+static struct fragment _parse_group(struct parse_ctx *ctx) {
+	const char *re = ctx->re;
+	bool lookaround = false;
+
+	const bool caseless = ctx->caseless;
+	const bool dotall = ctx->dotall;
+	const bool multiline = ctx->multiline;
+
+	ctx->pos++;
+	if (re[ctx->pos] == '?') {
+		const char *group = &re[ctx->pos + 1];
+
+		if (group[0] == ':' || group[0] == '>' || group[0] == '|') {
+			ctx->pos += 2;
+		} else if (group[0] == '=' || group[0] == '!') {
+			lookaround = true;
+			ctx->pos += 2;
+		} else if (group[0] == '<' && (group[1] == '=' || group[1] == '!')) {
+			lookaround = true;
+			ctx->pos += 3;
+		} else if (group[0] == '<' || group[0] == '\'' || (group[0] == 'P' && group[1] == '<')) {
+			// Named groups capture like any other
+			const char close = group[0] == '\'' ? '\'' : '>';
+			const char *end = strchr(group, close);
+			if (end == NULL) {
+				ctx->failed = true;
+				return _frag_empty(ctx);
+			}
+			ctx->pos = end + 1 - re;
+		} else if (group[0] == '#') {
+			const char *end = strchr(group, ')');
+			if (end == NULL) {
+				ctx->failed = true;
+			} else {
+				ctx->pos = end + 1 - re;
+			}
+			return _frag_empty(ctx);
+		} else {
+			// Option settings, which last until the end of the enclosing group
+			ctx->pos++;
+			if (_parse_options(ctx) != ':') {
+				return _frag_empty(ctx);
+			}
+		}
+	} else if (re[ctx->pos] == '*') {
+		ctx->failed = true;
+		return _frag_empty(ctx);
+	}
+
+	if (++ctx->depth > MAX_GROUP_DEPTH) {
+		ctx->failed = true;
+		return _frag_empty(ctx);
+	}
+
+	struct fragment frag = _parse_alternation(ctx);
+
+	ctx->depth--;
+	ctx->caseless = caseless;
+	ctx->dotall = dotall;
+	ctx->multiline = multiline;
+
+	if (re[ctx->pos] != ')') {
+		ctx->failed = true;
+		return frag;
+	}
+	ctx->pos++;
+
+	// Lookarounds are widened to always succeed, their automaton is dropped
+	return lookaround ? _frag_empty(ctx) : frag;
+}
+
+
+static struct fragment _parse_atom(struct parse_ctx *ctx) {
+	struct charset set = { { 0, 0, 0, 0 } };
+
+	switch (ctx->re[ctx->pos]) {
+		case '(':
+			return _parse_group(ctx);
+
+		case '[':
+			return _parse_class(ctx);
+
+		case '\\':
+			return _parse_escape(ctx);
+
+		case '.':
+			ctx->pos++;
+			_charset_add_range(&set, 0, 0x7f);
+			if (!ctx->dotall) {
+				set.bits[0] &= ~((uint64_t)1 << '\n');
+			}
+			return _frag_class(ctx, &set, true);
+
+		case '^':
+			ctx->pos++;
+			return ctx->multiline ? _frag_empty(ctx) : _frag_state(ctx, NFA_BEGIN, 0);
+
+		case '$':
+			ctx->pos++;
+			return ctx->multiline ? _frag_empty(ctx) : _frag_end(ctx);
+
+		case '*':
+		case '+':
+		case '?':
+			ctx->failed = true;
+			return _frag_empty(ctx);
+
+		default:
+			return _parse_literal(ctx);
+	}
+}
+
+
+static bool _parse_count(const char *re, size_t *pos, uint32_t *count) {
+	if (re[*pos] < '0' || re[*pos] > '9') {
+		return false;
+	}
+
+	*count = 0;
+	while (re[*pos] >= '0' && re[*pos] <= '9') {
+		if (*count < UNBOUNDED / 10) {
+			*count = *count * 10 + (re[*pos] - '0');
+		}
+		(*pos)++;
+	}
+	return true;
+}
+
+
+// Parse a quantifier, if one follows. Anything that isn't a valid counted
+// repeat leaves the '{' to be parsed as a literal.
+static bool _parse_quantifier(struct parse_ctx *ctx, uint32_t *min, uint32_t *max) {
+	const char *re = ctx->re;
+	size_t pos = ctx->pos;
+
+	switch (re[pos]) {
+		case '*': *min = 0; *max = UNBOUNDED; pos++; break;
+		case '+': *min = 1; *max = UNBOUNDED; pos++; break;
+		case '?': *min = 0; *max = 1;         pos++; break;
+
+		case '{':
+			pos++;
+			if (!_parse_count(re, &pos, min)) {
+				return false;
+			}
+			*max = *min;
+			if (re[pos] == ',') {
+				pos++;
+				*max = UNBOUNDED;
+				_parse_count(re, &pos, max);
+			}
+			if (re[pos] != '}' || *max < *min) {
+				return false;
+			}
+			pos++;
+			break;
+
+		default:
+			return false;
+	}
+
+	// Lazy and possessive repeats match the same set of strings
+	if (re[pos] == '?' || re[pos] == '+') {
+		pos++;
+	}
+
+	ctx->pos = pos;
+	return true;
+}
+
+
+// Repeat `atom`, which was parsed from `atom_start`. Extra copies are made by
+// parsing the atom again.
+static struct fragment _parse_repeat(
+		struct parse_ctx *ctx,
+		struct fragment atom,
+		size_t atom_start,
+		uint32_t min,
+		uint32_t max)
+{
+	if (max != UNBOUNDED && max > MAX_REPEAT_COPIES) {
+		max = UNBOUNDED;
+	}
+	if (min > MAX_REPEAT_COPIES) {
+		min = 0;
+	}
+
+	if (min == 0 && max == 0) {
+		return _frag_empty(ctx);
+	} else if (min == 0 && max == 1) {
+		return _frag_optional(ctx, atom);
+	} else if (min == 0 && max == UNBOUNDED) {
+		return _frag_star(ctx, atom);
+	} else if (min == 1 && max == UNBOUNDED) {
+		return _frag_plus(ctx, atom);
+	}
+
+	const size_t resume = ctx->pos;
+	const uint32_t copies = max == UNBOUNDED ? min + 1 : max;
+	struct fragment frag = atom;
+
+	for (uint32_t i = 1; i < copies && !ctx->failed; i++) {
+		ctx->pos = atom_start;
+		struct fragment copy = _parse_atom(ctx);
+
+		if (max == UNBOUNDED && i == copies - 1) {
+			copy = _frag_star(ctx, copy);
+		} else if (i >= min) {
+			copy = _frag_optional(ctx, copy);
+		}
+		frag = _frag_concat(ctx, frag, copy);
+	}
+
+	if (min == 0) {
+		frag = _frag_optional(ctx, frag);
+	}
+
+	ctx->pos = resume;
+	return frag;
+}
+
+
+static struct fragment _parse_sequence(struct parse_ctx *ctx) {
+	struct fragment frag = _frag_empty(ctx);
+
+	while (!ctx->failed) {
+		const char c = ctx->re[ctx->pos];
+		if (c == '\0' || c == '|' || c == ')') {
+			break;
+		}
+
+		const size_t atom_start = ctx->pos;
+		struct fragment atom = _parse_atom(ctx);
+
+		uint32_t min, max;
+		if (!ctx->failed && _parse_quantifier(ctx, &min, &max)) {
+			atom = _parse_repeat(ctx, atom, atom_start, min, max);
+		}
+
+		frag = _frag_concat(ctx, frag, atom);
+	}
+
+	return frag;
+}
+
+
+static struct fragment _parse_alternation(struct parse_ctx *ctx) {
+	struct fragment frag = _parse_sequence(ctx);
+
+	while (!ctx->failed && ctx->re[ctx->pos] == '|') {
+		ctx->pos++;
+		frag = _frag_alternate(ctx, frag, _parse_sequence(ctx));
+	}
+
+	return frag;
+}
+
+
+///###############################
+//# Closures
+///###############################
+
+static bool _closure_init(struct closure *closure, size_t num_states) {
+	const size_t size = num_states ? num_states : 1;
+	closure->set = malloc(size * sizeof(uint32_t));
+	closure->marks = calloc(size, sizeof(uint32_t));
+	closure->stack = malloc(size * sizeof(uint32_t));
+	closure->generation = 0;
+	closure->size = 0;
+	closure->best = NO_RULE;
+	return closure->set && closure->marks && closure->stack;
+}
+
+
+static void _closure_free(struct closure *closure) {
+	free(closure->set);
+	free(closure->marks);
+	free(closure->stack);
+}
+
+
+static void _closure_reset(struct closure *closure, size_t num_states, uint32_t best) {
+	if (++closure->generation == 0) {
+		memset(closure->marks, 0, num_states * sizeof(uint32_t));
+		closure->generation = 1;
+	}
+	closure->size = 0;
+	closure->best = best;
+}
+
+
+static inline bool _closure_mark(struct closure *closure, uint32_t state) {
+	if (state == NO_STATE || closure->marks[state] == closure->generation) {
+		return false;
+	}
+	closure->marks[state] = closure->generation;
+	return true;
+}
+
+
+// Follow every empty transition from `state`, collecting the states which
+// consume a byte (or wait for the end of the string) and noting matches.
+static void _closure_add(const struct rule_dfa_t *dfa, struct closure *closure, uint32_t state, bool at_start, bool at_end) {
+	uint32_t top = 0;
+
+	if (_closure_mark(closure, state)) {
+		closure->stack[top++] = state;
+	}
+
+	while (top) {
+		const struct nfa_state *nfa = &dfa->states[closure->stack[--top]];
+		uint32_t follow[2] = { NO_STATE, NO_STATE };
+
+		switch (nfa->type) {
+			case NFA_CHARSET:
+				if (!at_end) {
+					closure->set[closure->size++] = nfa - dfa->states;
+				}
+				break;
+			case NFA_END:
+				if (at_end) {
+					follow[0] = nfa->out;
+				} else {
+					closure->set[closure->size++] = nfa - dfa->states;
+				}
+				break;
+			case NFA_BEGIN:
+				if (at_start) {
+					follow[0] = nfa->out;
+				}
+				break;
+			case NFA_EMPTY:
+				follow[0] = nfa->out;
+				break;
+			case NFA_SPLIT:
+				follow[0] = nfa->out;
+				follow[1] = nfa->out1;
+				break;
+			case NFA_MATCH:
+				if (nfa->arg < closure->best) {
+					closure->best = nfa->arg;
+				}
+				break;
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (_closure_mark(closure, follow[i])) {
+				closure->stack[top++] = follow[i];
+			}
+		}
+	}
+}
+
+
+static int _compare_state(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t*)a;
+	const uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+// Drop states which can only lead to rules after the best match, and sort
+// what remains so that equal sets compare equal.
+static void _closure_finish(const struct rule_dfa_t *dfa, struct closure *closure) {
+	if (closure->best != NO_RULE) {
+		const uint32_t limit = dfa->rule_first_state[closure->best];
+		uint32_t size = 0;
+		for (uint32_t i = 0; i < closure->size; i++) {
+			if (closure->set[i] < limit) {
+				closure->set[size++] = closure->set[i];
+			}
+		}
+		closure->size = size;
+	}
+
+	qsort(closure->set, closure->size, sizeof(uint32_t), &_compare_state);
+}
+
+
+///###############################
+//# Rule DFA
+///###############################
+
+struct rule_dfa_t *rule_dfa_create() {
+	return calloc(1, sizeof(struct rule_dfa_t));
+}
+
+
+void rule_dfa_destroy(struct rule_dfa_t *dfa) {
+	if (dfa) {
+		free(dfa->states);
+		free(dfa->charsets);
+		free(dfa->rule_ids);
+		free(dfa->rule_first_state);
+		free(dfa->rule_starts);
+		free(dfa->inject);
+		free(dfa);
+	}
+}
+
+
+bool rule_dfa_add_regex(struct rule_dfa_t *dfa, uint32_t rule_id, const char *regex, bool caseless) {
+	const size_t num_states = dfa->num_states;
+	const size_t num_charsets = dfa->num_charsets;
+
+	if (dfa->num_rules == dfa->rules_capacity) {
+		dfa->rules_capacity = dfa->rules_capacity ? dfa->rules_capacity * 2 : 64;
+		dfa->rule_ids = realloc(dfa->rule_ids, dfa->rules_capacity * sizeof(uint32_t));
+		dfa->rule_first_state = realloc(dfa->rule_first_state, dfa->rules_capacity * sizeof(uint32_t));
+		dfa->rule_starts = realloc(dfa->rule_starts, dfa->rules_capacity * sizeof(uint32_t));
+	}
+
+	struct parse_ctx ctx = {
+		.dfa       = dfa,
+		.re        = regex,
+		.pos       = 0,
+		.depth     = 0,
+		.caseless  = caseless,
+		.dotall    = false,
+		.multiline = false,
+		.failed    = false,
+	};
+
+	struct fragment frag = _parse_alternation(&ctx);
+
+	// Anything left over is an unbalanced ')'
+	if (ctx.failed || regex[ctx.pos] != '\0') {
+		dfa->num_states = num_states;
+		dfa->num_charsets = num_charsets;
+		return false;
+	}
+
+	const uint32_t rule = dfa->num_rules++;
+	_patch(dfa, frag.exits, _nfa_state(&ctx, NFA_MATCH, rule, NO_STATE, NO_STATE));
+	dfa->rule_ids[rule] = rule_id;
+	dfa->rule_first_state[rule] = num_states;
+	dfa->rule_starts[rule] = frag.start;
+
+	return true;
+}
+
+
+void rule_dfa_compile(struct rule_dfa_t *dfa) {
+	// Split bytes into classes which no character set tells apart
+	memset(dfa->class_map, 0, sizeof(dfa->class_map));
+	dfa->num_classes = 1;
+
+	for (size_t i = 0; i < dfa->num_charsets; i++) {
+		int16_t remap[512];
+		uint32_t num_classes = 0;
+		memset(remap, 0xff, sizeof(remap));
+
+		for (unsigned int byte = 0; byte < 256; byte++) {
+			const unsigned int key = dfa->class_map[byte] * 2 + _charset_has(&dfa->charsets[i], byte);
+			if (remap[key] < 0) {
+				remap[key] = num_classes++;
+			}
+			dfa->class_map[byte] = remap[key];
+		}
+		dfa->num_classes = num_classes;
+	}
+
+	for (int byte = 255; byte >= 0; byte--) {
+		dfa->class_bytes[dfa->class_map[byte]] = byte;
+	}
+
+	// Rules can start matching anywhere, which is folded into every step
+	struct closure closure;
+	if (!_closure_init(&closure, dfa->num_states)) {
+		_closure_free(&closure);
+		return;
+	}
+
+	_closure_reset(&closure, dfa->num_states, NO_RULE);
+	for (uint32_t rule = 0; rule < dfa->num_rules; rule++) {
+		_closure_add(dfa, &closure, dfa->rule_starts[rule], false, false);
+	}
+	qsort(closure.set, closure.size, sizeof(uint32_t), &_compare_state);
+
+	dfa->inject = closure.set;
+	dfa->num_inject = closure.size;
+	dfa->inject_best = closure.best;
+	dfa->compiled = true;
+	closure.set = NULL;
+	_closure_free(&closure);
+}
+
+
+///###############################
+//# DFA state cache
+///###############################
+
+struct rule_dfa_cache_t *rule_dfa_cache_create(const struct rule_dfa_t *dfa) {
+	struct rule_dfa_cache_t *cache = calloc(1, sizeof(struct rule_dfa_cache_t));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	cache->dfa = dfa;
+	cache->start = NO_STATE;
+	cache->max_memory = CACHE_MAX_MEMORY;
+	cache->table_size = 256;
+	cache->table = calloc(cache->table_size, sizeof(uint32_t));
+
+	if (!_closure_init(&cache->closure, dfa->num_states) || cache->table == NULL) {
+		rule_dfa_cache_destroy(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+
+void rule_dfa_cache_destroy(struct rule_dfa_cache_t *cache) {
+	if (cache) {
+		free(cache->states);
+		free(cache->transitions);
+		free(cache->sets);
+		free(cache->table);
+		_closure_free(&cache->closure);
+		free(cache);
+	}
+}
+
+
+static size_t _cache_memory(const struct rule_dfa_cache_t *cache) {
+	return cache->num_states * (sizeof(struct dfa_state) + cache->dfa->num_classes * sizeof(uint32_t))
+		+ cache->sets_used * sizeof(uint32_t)
+		+ cache->table_size * sizeof(uint32_t);
+}
+
+
+static void _cache_flush(struct rule_dfa_cache_t *cache) {
+	cache->num_states = 0;
+	cache->sets_used = 0;
+	cache->start = NO_STATE;
+	cache->flushes++;
+	memset(cache->table, 0, cache->table_size * sizeof(uint32_t));
+}
+
+
+static uint32_t _cache_hash(const uint32_t *set, uint32_t size, uint32_t best) {
+	uint32_t hash = 2166136261u ^ best;
+	for (uint32_t i = 0; i < size; i++) {
+		hash = (hash ^ set[i]) * 16777619u;
+	}
+	return hash;
+}
+
+
+static bool _cache_grow_table(struct rule_dfa_cache_t *cache) {
+	const uint32_t table_size = cache->table_size * 2;
+	uint32_t *table = calloc(table_size, sizeof(uint32_t));
+
+	if (table == NULL) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < cache->num_states; i++) {
+		uint32_t slot = cache->states[i].hash & (table_size - 1);
+		while (table[slot]) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		table[slot] = i + 1;
+	}
+
+	free(cache->table);
+	cache->table = table;
+	cache->table_size = table_size;
+	return true;
+}
+
+
+// Find or create the DFA state for the finished closure.
+static uint32_t _cache_add_state(struct rule_dfa_cache_t *cache) {
+	const struct rule_dfa_t *dfa = cache->dfa;
+	struct closure *closure = &cache->closure;
+
+	_closure_finish(dfa, closure);
+	const uint32_t hash = _cache_hash(closure->set, closure->size, closure->best);
+
+	uint32_t slot = hash & (cache->table_size - 1);
+	while (cache->table[slot]) {
+		const struct dfa_state *state = &cache->states[cache->table[slot] - 1];
+		if (state->hash == hash && state->best == closure->best && state->size == closure->size &&
+			memcmp(&cache->sets[state->set], closure->set, closure->size * sizeof(uint32_t)) == 0)
+		{
+			return cache->table[slot] - 1;
+		}
+		slot = (slot + 1) & (cache->table_size - 1);
+	}
+
+	if (_cache_memory(cache) + closure->size * sizeof(uint32_t) > cache->max_memory) {
+		if (cache->flushes >= CACHE_MAX_FLUSHES) {
+			return NO_STATE;
+		}
+		_cache_flush(cache);
+	}
+
+	if (cache->num_states == cache->states_capacity) {
+		const uint32_t capacity = cache->states_capacity ? cache->states_capacity * 2 : 64;
+		struct dfa_state *states = realloc(cache->states, capacity * sizeof(struct dfa_state));
+		uint32_t *transitions = states ? realloc(cache->transitions, (size_t)capacity * dfa->num_classes * sizeof(uint32_t)) : NULL;
+		if (states) {
+			cache->states = states;
+		}
+		if (transitions == NULL) {
+			return NO_STATE;
+		}
+		cache->transitions = transitions;
+		cache->states_capacity = capacity;
+	}
+
+	if (cache->sets_used + closure->size > cache->sets_capacity) {
+		const size_t capacity = (cache->sets_used + closure->size) * 2;
+		uint32_t *sets = realloc(cache->sets, capacity * sizeof(uint32_t));
+		if (sets == NULL) {
+			return NO_STATE;
+		}
+		cache->sets = sets;
+		cache->sets_capacity = capacity;
+	}
+
+	if ((cache->num_states + 1) * 2 > cache->table_size && !_cache_grow_table(cache)) {
+		return NO_STATE;
+	}
+
+	const uint32_t index = cache->num_states++;
+	struct dfa_state *state = &cache->states[index];
+	state->set = cache->sets_used;
+	state->size = closure->size;
+	state->best = closure->best;
+	state->end_best = UNKNOWN_RULE;
+	state->hash = hash;
+	state->done = closure->size == 0 || closure->best == 0;
+
+	memcpy(&cache->sets[state->set], closure->set, closure->size * sizeof(uint32_t));
+	cache->sets_used += closure->size;
+	memset(&cache->transitions[(size_t)index * dfa->num_classes], 0xff, dfa->num_classes * sizeof(uint32_t));
+
+	slot = hash & (cache->table_size - 1);
+	while (cache->table[slot]) {
+		slot = (slot + 1) & (cache->table_size - 1);
+	}
+	cache->table[slot] = index + 1;
+
+	return index;
+}
+
+
+static uint32_t _cache_start(struct rule_dfa_cache_t *cache) {
+	if (cache->start == NO_STATE) {
+		const struct rule_dfa_t *dfa = cache->dfa;
+
+		_closure_reset(&cache->closure, dfa->num_states, NO_RULE);
+		for (uint32_t rule = 0; rule < dfa->num_rules; rule++) {
+			_closure_add(dfa, &cache->closure, dfa->rule_starts[rule], true, false);
+		}
+		cache->start = _cache_add_state(cache);
+	}
+
+	return cache->start;
+}
+
+
+static uint32_t _cache_step(struct rule_dfa_cache_t *cache, uint32_t from, uint32_t byte_class) {
+	const struct rule_dfa_t *dfa = cache->dfa;
+	struct closure *closure = &cache->closure;
+	const struct dfa_state *state = &cache->states[from];
+	const uint32_t *set = &cache->sets[state->set];
+	const unsigned char byte = dfa->class_bytes[byte_class];
+
+	_closure_reset(closure, dfa->num_states, state->best);
+
+	for (uint32_t i = 0; i < state->size; i++) {
+		const struct nfa_state *nfa = &dfa->states[set[i]];
+		if (nfa->type == NFA_CHARSET && _charset_has(&dfa->charsets[nfa->arg], byte)) {
+			_closure_add(dfa, closure, nfa->out, false, false);
+		}
+	}
+
+	// Every rule may also begin matching after this byte
+	if (dfa->inject_best < closure->best) {
+		closure->best = dfa->inject_best;
+	}
+	for (uint32_t i = 0; i < dfa->num_inject; i++) {
+		if (_closure_mark(closure, dfa->inject[i])) {
+			closure->set[closure->size++] = dfa->inject[i];
+		}
+	}
+
+	return _cache_add_state(cache);
+}
+
+
+static uint32_t _cache_end_best(struct rule_dfa_cache_t *cache, uint32_t index) {
+	const struct rule_dfa_t *dfa = cache->dfa;
+	struct dfa_state *state = &cache->states[index];
+
+	if (state->end_best == UNKNOWN_RULE) {
+		_closure_reset(&cache->closure, dfa->num_states, state->best);
+
+		const uint32_t *set = &cache->sets[state->set];
+		for (uint32_t i = 0; i < state->size; i++) {
+			if (dfa->states[set[i]].type == NFA_END) {
+				_closure_add(dfa, &cache->closure, dfa->states[set[i]].out, true, true);
+			}
+		}
+		state->end_best = cache->closure.best;
+	}
+
+	return state->end_best;
+}
+
+
+// Scan with the precomputed table alone. Returns false as soon as the scan
+// reaches a state which wasn't compiled in.
+static bool _table_first(const struct rule_dfa_t *dfa, const unsigned char *bytes, size_t len, uint32_t *best) {
+	const struct rule_dfa_table *table = dfa->table;
+	uint32_t state = 0;
+
+	for (size_t i = 0; i < len && !table->states[state].done; i++) {
+		const uint32_t slot = table->states[state].base + dfa->class_map[bytes[i]];
+		if (table->check[slot] != state) {
+			return false;
+		}
+		state = table->next[slot];
+	}
+
+	*best = table->states[state].best;
+	return true;
+}
+
+
+uint32_t rule_dfa_first(const struct rule_dfa_t *dfa, struct rule_dfa_cache_t *cache, const char *str, size_t len) {
+	if (dfa->num_rules == 0) {
+		return RULE_DFA_NO_MATCH;
+	} else if (!dfa->compiled) {
+		return 0;
+	}
+
+	const unsigned char *bytes = (const unsigned char*)str;
+	uint32_t best;
+
+	if (dfa->table && _table_first(dfa, bytes, len, &best)) {
+		return best == NO_RULE ? RULE_DFA_NO_MATCH : dfa->rule_ids[best];
+	}
+
+	cache->flushes = 0;
+	uint32_t state = _cache_start(cache);
+	if (state == NO_STATE) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < len && !cache->states[state].done; i++) {
+		const uint32_t byte_class = dfa->class_map[bytes[i]];
+		uint32_t next = cache->transitions[(size_t)state * dfa->num_classes + byte_class];
+
+		if (next == NO_STATE) {
+			const uint32_t flushes = cache->flushes;
+			next = _cache_step(cache, state, byte_class);
+			if (next == NO_STATE) {
+				return 0;
+			}
+			// A flush discards `state`, so there's nothing to link from
+			if (cache->flushes == flushes) {
+				cache->transitions[(size_t)state * dfa->num_classes + byte_class] = next;
+			}
+		}
+
+		state = next;
+	}
+
+	best = cache->states[state].done ? cache->states[state].best : _cache_end_best(cache, state);
+	return best == NO_RULE ? RULE_DFA_NO_MATCH : dfa->rule_ids[best];
+}
+
+
+///###############################
+//# Precomputed tables
+///###############################
+
+bool rule_dfa_attach_table(struct rule_dfa_t *dfa, const struct rule_dfa_table *table) {
+	if (!dfa->compiled || table == NULL || table->num_states == 0 ||
+		table->num_rules != dfa->num_rules ||
+		table->num_nfa_states != dfa->num_states ||
+		table->num_classes != dfa->num_classes ||
+		memcmp(table->class_map, dfa->class_map, sizeof(dfa->class_map)) != 0)
+	{
+		return false;
+	}
+
+	dfa->table = table;
+	return true;
+}
+
+
+// Write `values` as a C array, with NO_STATE written as RULE_DFA_TABLE_MISS.
+static void _write_array(FILE *out, const char *type, const char *name, const char *suffix, const uint32_t *values, size_t count) {
+	fprintf(out, "static const %s %s%s[] = {", type, name, suffix);
+	for (size_t i = 0; i < count; i++) {
+		fputs(i % 16 ? " " : "\n\t", out);
+		if (values[i] == NO_STATE) {
+			fputs("RULE_DFA_TABLE_MISS,", out);
+		} else {
+			fprintf(out, "%u,", values[i]);
+		}
+	}
+	fprintf(out, "\n};\n\n\n");
+}
+
+
+// Pack the rows of the transition table into `check` and `next` so that they
+// overlap wherever their taken transitions don't collide, setting the offset
+// of each row in `bases`. Returns the size of the packed arrays.
+static size_t _pack_transitions(const struct rule_dfa_cache_t *cache, uint32_t num_states, uint32_t *bases, uint32_t **check, uint32_t **next) {
+	const uint32_t num_classes = cache->dfa->num_classes;
+	size_t capacity = (size_t)num_classes * 2;
+	size_t size = num_classes; // any row may be looked up at any base
+	size_t first_free = 0;
+
+	*check = malloc(capacity * sizeof(uint32_t));
+	*next = malloc(capacity * sizeof(uint32_t));
+	if (*check == NULL || *next == NULL) {
+		return 0;
+	}
+	memset(*check, 0xff, capacity * sizeof(uint32_t));
+
+	for (uint32_t state = 0; state < num_states; state++) {
+		const uint32_t *row = &cache->transitions[(size_t)state * num_classes];
+		size_t base = first_free >= num_classes ? first_free - num_classes + 1 : 0;
+
+		for (;; base++) {
+			if (base + num_classes > capacity) {
+				const size_t grown = capacity * 2;
+				uint32_t *grown_check = realloc(*check, grown * sizeof(uint32_t));
+				if (grown_check) {
+					*check = grown_check;
+				}
+				uint32_t *grown_next = grown_check ? realloc(*next, grown * sizeof(uint32_t)) : NULL;
+				if (grown_next == NULL) {
+					return 0;
+				}
+				*next = grown_next;
+				memset(&(*check)[capacity], 0xff, (grown - capacity) * sizeof(uint32_t));
+				capacity = grown;
+			}
+
+			uint32_t c = 0;
+			while (c < num_classes && (row[c] >= num_states || (*check)[base + c] == NO_STATE)) {
+				c++;
+			}
+			if (c == num_classes) {
+				break;
+			}
+		}
+
+		bases[state] = base;
+		for (uint32_t c = 0; c < num_classes; c++) {
+			if (row[c] < num_states) {
+				(*check)[base + c] = state;
+				(*next)[base + c] = row[c];
+			}
+		}
+
+		while (first_free < capacity && (*check)[first_free] != NO_STATE) {
+			first_free++;
+		}
+		if (base + num_classes > size) {
+			size = base + num_classes;
+		}
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		if ((*check)[i] == NO_STATE) {
+			(*next)[i] = NO_STATE;
+		}
+	}
+
+	return size;
+}
+
+
+bool rule_dfa_write_table(const struct rule_dfa_t *dfa, FILE *out, const char *name, const char *const *samples, size_t num_samples) {
+	if (!dfa->compiled) {
+		return false;
+	}
+
+	struct rule_dfa_cache_t *cache = rule_dfa_cache_create(dfa);
+	if (cache == NULL) {
+		return false;
+	}
+
+	// Nothing may be flushed, or states written out would be lost
+	cache->max_memory = SIZE_MAX;
+	_cache_start(cache);
+
+	for (size_t i = 0; i < num_samples && cache->num_states < RULE_DFA_TABLE_MAX_STATES; i++) {
+		rule_dfa_first(dfa, cache, samples[i], strlen(samples[i]));
+	}
+
+	// Transitions never taken by the samples, or past the limit, are misses
+	const uint32_t num_states = cache->num_states < RULE_DFA_TABLE_MAX_STATES ? cache->num_states : RULE_DFA_TABLE_MAX_STATES;
+	uint32_t *bases = malloc((num_states ? num_states : 1) * sizeof(uint32_t));
+	uint32_t *check = NULL;
+	uint32_t *next = NULL;
+	const size_t size = bases ? _pack_transitions(cache, num_states, bases, &check, &next) : 0;
+
+	if (num_states == 0 || size == 0) {
+		free(bases);
+		free(check);
+		free(next);
+		rule_dfa_cache_destroy(cache);
+		return false;
+	}
+
+	uint32_t class_map[256];
+	for (int byte = 0; byte < 256; byte++) {
+		class_map[byte] = dfa->class_map[byte];
+	}
+	_write_array(out, "unsigned char", name, "_class_map", class_map, 256);
+	_write_array(out, "uint16_t", name, "_check", check, size);
+	_write_array(out, "uint16_t", name, "_next", next, size);
+
+	fprintf(out, "static const struct rule_dfa_table_state %s_states[] = {\n", name);
+	for (uint32_t i = 0; i < num_states; i++) {
+		const struct dfa_state *state = &cache->states[i];
+		const uint32_t best = state->done ? state->best : _cache_end_best(cache, i);
+		if (best == NO_RULE) {
+			fprintf(out, "\t{ %u, RULE_DFA_NO_MATCH, %d },\n", bases[i], state->done);
+		} else {
+			fprintf(out, "\t{ %u, %u, %d },\n", bases[i], best, state->done);
+		}
+	}
+	fprintf(out, "};\n\n\n");
+
+	fprintf(out, "static const struct rule_dfa_table %s = {\n", name);
+	fprintf(out, "\t.num_rules      = %u,\n", dfa->num_rules);
+	fprintf(out, "\t.num_nfa_states = %lu,\n", (unsigned long)dfa->num_states);
+	fprintf(out, "\t.num_classes    = %u,\n", dfa->num_classes);
+	fprintf(out, "\t.class_map      = %s_class_map,\n", name);
+	fprintf(out, "\t.num_states     = %u,\n", num_states);
+	fprintf(out, "\t.states         = %s_states,\n", name);
+	fprintf(out, "\t.check          = %s_check,\n", name);
+	fprintf(out, "\t.next           = %s_next,\n", name);
+	fprintf(out, "};\n\n\n");
+
+	free(bases);
+	free(check);
+	free(next);
+	rule_dfa_cache_destroy(cache);
+	return true;
+}
@@ -0,0 +1,358 @@
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uap/string_interner.h"
+#include "uap/unique_strings.h"
+#include "uap/uap.h"
+
+#define INTERNER_MIN_SLOTS 256          // must be a power of two
+#define INTERNER_BLOCK_SIZE (64 * 1024) // strings are packed into blocks of this size
+#define INTERNER_SEED 0x7f4a7c15        // random
+
+// Strings are also listed by ID, in segments which double in size, the first
+// holding 1 << INTERNER_SEGMENT_BITS of them
+#define INTERNER_SEGMENT_BITS 8
+#define INTERNER_SEGMENTS 24
+
+
+// A slot is filled in once, hash and length first and then `str`, which
+// readers check before looking at the rest.
+struct interner_slot {
+	const char *str; // NULL when unused
+	uint32_t hash;
+	uint32_t length;
+	uint32_t id;
+};
+
+
+struct interner_entry {
+	const char *str;
+	uint32_t length;
+};
+
+
+// Tables are never freed while the interner is alive, since readers may still
+// be probing one which has been replaced. Replaced tables are kept on the
+// `retired` list of their successor.
+struct interner_table {
+	struct interner_table *retired;
+	size_t mask;
+	struct interner_slot slots[];
+};
+
+
+struct interner_block {
+	struct interner_block *next;
+	char data[];
+};
+
+
+// Lookups only read `table`. Adding a string, which also covers replacing the
+// table with a larger one, happens under `lock`.
+struct string_interner_t {
+	struct interner_table *table;
+	pthread_mutex_t lock;
+
+	struct interner_block *blocks; // the first one is being filled
+	size_t block_used;
+	size_t block_capacity;
+
+	// Entries by ID, which never move once added. `strings` is only bumped
+	// once the entry for the new ID is in place.
+	struct interner_entry *segments[INTERNER_SEGMENTS];
+
+	size_t memory_used;
+	size_t memory_limit;
+	uint32_t strings;
+	uint64_t rejected;
+};
+
+
+// Find the segment holding `id`, and its index within it.
+static inline unsigned int _segment_of(uint32_t id, uint32_t *index) {
+	const uint32_t chunks = (id >> INTERNER_SEGMENT_BITS) + 1;
+	const unsigned int segment = 31 - __builtin_clz(chunks);
+	*index = id - (((1u << segment) - 1) << INTERNER_SEGMENT_BITS);
+	return segment;
+}
+
+
+static inline size_t _segment_size(unsigned int segment) {
+	return ((size_t)1 << (segment + INTERNER_SEGMENT_BITS)) * sizeof(struct interner_entry);
+}
+
+
+static inline size_t _table_size(size_t num_slots) {
+	return sizeof(struct interner_table) + num_slots * sizeof(struct interner_slot);
+}
+
+
+// Probe `table` for `length` bytes of `str`. Returns the slot holding it or
+// the empty slot where it belongs.
+static struct interner_slot *_table_find(
+		struct interner_table *table,
+		const char *str,
+		size_t length,
+		uint32_t hash)
+{
+	for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		struct interner_slot *slot = &table->slots[i];
+		const char *stored = __atomic_load_n(&slot->str, __ATOMIC_ACQUIRE);
+
+		if (stored == NULL) {
+			return slot;
+		}
+		if (slot->hash == hash && slot->length == length && memcmp(stored, str, length) == 0) {
+			return slot;
+		}
+	}
+}
+
+
+// Bytes of memory which storing a string of `length` bytes will take up, a
+// new block if it doesn't fit in the current one.
+static size_t _interner_store_size(const struct string_interner_t *interner, size_t length) {
+	if (interner->block_used + length + 1 <= interner->block_capacity) {
+		return 0;
+	}
+	return sizeof(struct interner_block) + (length + 1 > INTERNER_BLOCK_SIZE ? length + 1 : INTERNER_BLOCK_SIZE);
+}
+
+
+// Copy `length` bytes of `str` and a null terminator into the current block,
+// starting a new block if it doesn't fit. Strings larger than a block get a
+// block of their own, and the current one is kept for the next strings.
+static char *_interner_store(struct string_interner_t *interner, const char *str, size_t length) {
+	char *copy;
+
+	if (interner->block_used + length + 1 <= interner->block_capacity) {
+		copy = interner->blocks->data + interner->block_used;
+		interner->block_used += length + 1;
+	} else if (length + 1 > INTERNER_BLOCK_SIZE) {
+		struct interner_block *block = malloc(sizeof(struct interner_block) + length + 1);
+		if (block == NULL) {
+			return NULL;
+		}
+		if (interner->blocks) {
+			block->next = interner->blocks->next;
+			interner->blocks->next = block;
+		} else {
+			block->next = NULL;
+			interner->blocks = block;
+		}
+		copy = block->data;
+	} else {
+		struct interner_block *block = malloc(sizeof(struct interner_block) + INTERNER_BLOCK_SIZE);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->next = interner->blocks;
+		interner->blocks = block;
+		interner->block_used = length + 1;
+		interner->block_capacity = INTERNER_BLOCK_SIZE;
+		copy = block->data;
+	}
+
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+
+struct string_interner_t *string_interner_create(size_t max_memory) {
+	struct string_interner_t *interner = calloc(1, sizeof(struct string_interner_t));
+	if (interner == NULL) {
+		return NULL;
+	}
+
+	interner->table = calloc(1, _table_size(INTERNER_MIN_SLOTS));
+	if (interner->table == NULL) {
+		free(interner);
+		return NULL;
+	}
+	interner->table->mask = INTERNER_MIN_SLOTS - 1;
+
+	pthread_mutex_init(&interner->lock, NULL);
+	interner->memory_used = sizeof(struct string_interner_t) + _table_size(INTERNER_MIN_SLOTS);
+	interner->memory_limit = max_memory;
+
+	return interner;
+}
+
+
+void string_interner_destroy(struct string_interner_t *interner) {
+	if (interner == NULL) {
+		return;
+	}
+
+	struct interner_table *table = interner->table;
+	while (table) {
+		struct interner_table *retired = table->retired;
+		free(table);
+		table = retired;
+	}
+
+	for (unsigned int i = 0; i < INTERNER_SEGMENTS; i++) {
+		free(interner->segments[i]);
+	}
+
+	struct interner_block *block = interner->blocks;
+	while (block) {
+		struct interner_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	pthread_mutex_destroy(&interner->lock);
+	free(interner);
+}
+
+
+// Move every string over to a table twice the size and publish it. Returns
+// false if out of memory or over the limit, leaving the table as it was.
+static bool _interner_grow(struct string_interner_t *interner) {
+	struct interner_table *table = interner->table;
+	const size_t num_slots = (table->mask + 1) * 2;
+
+	if (interner->memory_used + _table_size(num_slots) > interner->memory_limit) {
+		return false;
+	}
+
+	struct interner_table *grown = calloc(1, _table_size(num_slots));
+	if (grown == NULL) {
+		return false;
+	}
+	grown->mask = num_slots - 1;
+	grown->retired = table;
+
+	for (size_t i = 0; i <= table->mask; i++) {
+		const struct interner_slot *slot = &table->slots[i];
+		if (slot->str != NULL) {
+			size_t j = slot->hash & grown->mask;
+			while (grown->slots[j].str != NULL) {
+				j = (j + 1) & grown->mask;
+			}
+			grown->slots[j] = *slot;
+		}
+	}
+
+	__atomic_store_n(&interner->table, grown, __ATOMIC_RELEASE);
+	interner->memory_used += _table_size(num_slots);
+	return true;
+}
+
+
+const char *string_interner_intern(struct string_interner_t *interner, const char *str, size_t length, uint32_t *id) {
+	if (length > INT_MAX) {
+		return NULL;
+	}
+
+	const uint32_t hash = hash_murmur2(str, (int)length, INTERNER_SEED);
+
+	// The common case, a string which was seen before
+	struct interner_table *table = __atomic_load_n(&interner->table, __ATOMIC_ACQUIRE);
+	const struct interner_slot *slot = _table_find(table, str, length, hash);
+	const char *found = __atomic_load_n(&slot->str, __ATOMIC_ACQUIRE);
+	if (found) {
+		if (id) {
+			*id = slot->id;
+		}
+		return found;
+	}
+
+	pthread_mutex_lock(&interner->lock);
+
+	// Look again, another thread may have added it or grown the table since
+	struct interner_slot *new_slot = _table_find(interner->table, str, length, hash);
+
+	if (new_slot->str == NULL) {
+		const uint32_t new_id = interner->strings;
+		uint32_t index;
+		const unsigned int segment = _segment_of(new_id, &index);
+		size_t needed = 0;
+
+		if (((size_t)new_id + 1) * 4 > (interner->table->mask + 1) * 3) {
+			if (_interner_grow(interner)) {
+				new_slot = _table_find(interner->table, str, length, hash);
+			} else {
+				new_slot = NULL;
+			}
+		}
+
+		// The first ID of a segment needs the segment itself
+		if (new_slot && segment >= INTERNER_SEGMENTS) {
+			new_slot = NULL;
+		} else if (new_slot && interner->segments[segment] == NULL) {
+			needed += _segment_size(segment);
+		}
+
+		needed += _interner_store_size(interner, length);
+		char *copy = NULL;
+
+		if (new_slot && interner->memory_used + needed <= interner->memory_limit) {
+			if (interner->segments[segment] == NULL) {
+				interner->segments[segment] = malloc(_segment_size(segment));
+			}
+			if (interner->segments[segment] != NULL) {
+				copy = _interner_store(interner, str, length);
+			}
+		}
+
+		if (copy) {
+			struct interner_entry *entry = &interner->segments[segment][index];
+			entry->str = copy;
+			entry->length = (uint32_t)length;
+
+			new_slot->hash = hash;
+			new_slot->length = (uint32_t)length;
+			new_slot->id = new_id;
+			__atomic_store_n(&new_slot->str, copy, __ATOMIC_RELEASE);
+			__atomic_store_n(&interner->strings, new_id + 1, __ATOMIC_RELEASE);
+			interner->memory_used += needed;
+		} else {
+			interner->rejected++;
+			new_slot = NULL;
+		}
+	}
+
+	found = new_slot ? new_slot->str : NULL;
+	if (found && id) {
+		*id = new_slot->id;
+	}
+	pthread_mutex_unlock(&interner->lock);
+
+	return found;
+}
+
+
+uint32_t string_interner_count(struct string_interner_t *interner) {
+	return __atomic_load_n(&interner->strings, __ATOMIC_ACQUIRE);
+}
+
+
+const char *string_interner_lookup(struct string_interner_t *interner, uint32_t id, size_t *length) {
+	if (id >= __atomic_load_n(&interner->strings, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	uint32_t index;
+	const struct interner_entry *entry = &interner->segments[_segment_of(id, &index)][index];
+	if (length) {
+		*length = entry->length;
+	}
+	return entry->str;
+}
+
+
+void string_interner_stats(struct string_interner_t *interner, struct uap_intern_stats *stats) {
+	pthread_mutex_lock(&interner->lock);
+	stats->strings     = interner->strings;
+	stats->memory_used = interner->memory_used;
+	stats->rejected    = interner->rejected;
+	pthread_mutex_unlock(&interner->lock);
+}
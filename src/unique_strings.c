@@ -5,7 +5,9 @@
 
 #include "uap/unique_strings.h"
 
-#define UNIQUE_STRING_BUCKETS 32
+#define UNIQUE_STRINGS_MIN_SLOTS 64     // must be a power of two
+#define UNIQUE_STRINGS_MIN_BUFFER 1024
+#define UNIQUE_STRINGS_EMPTY_SLOT SIZE_MAX
 #define MURMUR_SEED 0xf9a025a4 // random
 
 
@@ -16,22 +18,20 @@ struct buffer_t {
 };
 
 
-struct string_hash_pair_t {
+// One entry of the open addressed table, the string itself lives in the
+// buffer at `addr`.
+struct unique_string_slot {
+	size_t addr; // UNIQUE_STRINGS_EMPTY_SLOT when unused
 	uint32_t hash;
-	const char *str;
-};
-
-
-struct unique_string_node {
-	struct unique_string_node *next;
-	uint32_t hash;
-	struct unique_string_handle_t buffer_ptr;
 };
 
 
 struct unique_strings_t {
 	struct buffer_t buffer;
-	struct unique_string_node **buckets; // pointer to an array of UNIQUE_STRING_BUCKETS pointers
+	struct unique_string_slot *slots; // NULL once frozen
+	size_t num_slots;                 // a power of two
+	size_t num_strings;
+	bool borrowed; // buffer data belongs to someone else, see unique_strings_create_static()
 };
 
 
@@ -42,8 +42,12 @@ struct unique_strings_t {
 // Allocate a unique_string_handle_t associated with the requested size.
 // Use buffer_addr() to get an actual pointer
 static struct unique_string_handle_t buffer_alloc(struct buffer_t* buffer, size_t size) {
-	if (buffer->used + size >= buffer->capacity) {
-		buffer->capacity += 1024 * ((size / 1024) + 1); // grow by multiples of 1kB
+	if (buffer->used + size > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity : UNIQUE_STRINGS_MIN_BUFFER;
+		while (capacity < buffer->used + size) {
+			capacity *= 2; // grow geometrically, so adding n strings copies O(n) bytes
+		}
+		buffer->capacity = capacity;
 		buffer->data = realloc(buffer->data, buffer->capacity);
 	}
 
@@ -73,14 +77,15 @@ static void buffer_compact(struct buffer_t *buffer) {
 }
 
 
-static uint32_t hash_murmur2(const char *data, int len, uint32_t seed) {
+uint32_t hash_murmur2(const char *data, int len, uint32_t seed) {
 	const uint32_t m = 0x5bd1e995;
 	const int r = 24;
 
 	uint32_t h = seed ^ len;
 
 	while (len >= 4) {
-		uint32_t k = *(uint32_t*)data;
+		uint32_t k;
+		memcpy(&k, data, sizeof(k)); // `data` needn't be aligned
 
 		k *= m;
 		k ^= k >> r;
@@ -115,148 +120,136 @@ static uint32_t hash_murmur2(const char *data, int len, uint32_t seed) {
 }
 
 
-// Copies the string pointer to the string_hash_pair_t and generates
-// a hash from it. Also returns the hash.
-static uint32_t _string_hash_pair_prepare(struct string_hash_pair_t *shp, const char *str) {
-	shp->str = str;
-	shp->hash = hash_murmur2(str, strlen(str), MURMUR_SEED);
-	return shp->hash;
+static struct unique_string_slot *_unique_strings_alloc_slots(size_t num_slots) {
+	struct unique_string_slot *slots = malloc(num_slots * sizeof(struct unique_string_slot));
+	if (slots) {
+		for (size_t i = 0; i < num_slots; i++) {
+			slots[i].addr = UNIQUE_STRINGS_EMPTY_SLOT;
+		}
+	}
+	return slots;
 }
 
 
 struct unique_strings_t * unique_strings_create() {
 	struct unique_strings_t *us = calloc(1, sizeof(struct unique_strings_t));
-	us->buckets = calloc(UNIQUE_STRING_BUCKETS, sizeof(struct unique_string_node *));
+	if (us) {
+		us->slots = _unique_strings_alloc_slots(UNIQUE_STRINGS_MIN_SLOTS);
+		if (us->slots == NULL) {
+			free(us);
+			return NULL;
+		}
+		us->num_slots = UNIQUE_STRINGS_MIN_SLOTS;
+	}
 	return us;
 }
 
 
-static uint32_t _get_bucket_index(const struct string_hash_pair_t *pair) {
-	return pair->hash % UNIQUE_STRING_BUCKETS;
-}
-
-
 static inline char * _unique_strings_get(const struct unique_string_handle_t *handle) {
 	return handle->parent->data + handle->addr;
 }
 
 
-// Returns true on successful find `node` will point to node on success,
-// otherwise it will be set to point to the parent (used for insertion)
-static bool _unique_strings_find_node(
-		struct unique_string_node **node,
-		struct unique_strings_t *us,
-		struct string_hash_pair_t *pair)
+// Linear probing from `hash` for either the slot holding `length` bytes of
+// `str`, or the empty slot where it belongs.
+static struct unique_string_slot *_unique_strings_find_slot(
+		const struct unique_strings_t *us,
+		const char *str,
+		size_t length,
+		uint32_t hash)
 {
-	const uint32_t bucket_id = _get_bucket_index(pair);
-	const uint32_t pair_hash = pair->hash;
-	struct unique_string_node *iter = us->buckets[bucket_id];
-	*node = NULL;
-
-	while (iter) {
-		*node = iter;
-
-		if (iter->hash == pair_hash &&
-			strcmp(unique_strings_get(&iter->buffer_ptr), pair->str) == 0)
-		{
-			// Found matching hash and string
-			return true;
-		}
+	const size_t mask = us->num_slots - 1;
 
-		// Sorted search/insert
-		if (iter->hash < pair_hash) {
-			break;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct unique_string_slot *slot = &us->slots[i];
+		if (slot->addr == UNIQUE_STRINGS_EMPTY_SLOT) {
+			return slot;
 		}
 
-		iter = iter->next;
+		// Stored strings are null terminated, so strncmp() stops at the end of
+		// a shorter one and the terminator check rules out a longer one
+		const char *stored = us->buffer.data + slot->addr;
+		if (slot->hash == hash && strncmp(stored, str, length) == 0 && stored[length] == '\0') {
+			return slot;
+		}
 	}
-
-	return false;
 }
 
 
-// Copies data from `pair` into `node`.  Hash is copied over, while the string
-// data is allocated via the managed buffer.
-static struct unique_string_node *unique_string_node_create(
-		struct string_hash_pair_t *pair,
-		struct buffer_t *buffer)
-{
-	struct unique_string_node *node = malloc(sizeof(struct unique_string_node));
-
-	if (node) {
-		node->next = NULL;
-		node->hash = pair->hash;
-		node->buffer_ptr = buffer_alloc(buffer, strlen(pair->str) + 1);
-		char *ptr = _unique_strings_get(&node->buffer_ptr);
-		const size_t length = strlen(pair->str);
-		memcpy(ptr, pair->str, length + 1);
+// Double the table, rehashing from the stored hashes. Returns false if out
+// of memory, leaving the table as it was.
+static bool _unique_strings_grow(struct unique_strings_t *us) {
+	const size_t num_slots = us->num_slots * 2;
+	struct unique_string_slot *slots = _unique_strings_alloc_slots(num_slots);
+	if (slots == NULL) {
+		return false;
 	}
 
-	return node;
-}
-
-
-struct unique_string_handle_t unique_strings_add(struct unique_strings_t *us, const char *str) {
-	struct string_hash_pair_t pair;
-	_string_hash_pair_prepare(&pair, str);
-	struct unique_string_node *found = NULL;
-
-	if (! _unique_strings_find_node(&found, us, &pair)) {
-		// Node was not found...
-		struct unique_string_node *new_node = unique_string_node_create(&pair, &us->buffer);
-
-		if (found) {
-			// If parent is set, then it is the appropriate parent node for the
-			// new node. If it's null, then we just throw the new node into the
-			// appropriate bucket.
-			new_node->next = found->next;
-			found->next = new_node;
-		} else {
-			// Insert a new root node into the bucket
-			us->buckets[_get_bucket_index(&pair)] = new_node;
+	for (size_t i = 0; i < us->num_slots; i++) {
+		const struct unique_string_slot *slot = &us->slots[i];
+		if (slot->addr != UNIQUE_STRINGS_EMPTY_SLOT) {
+			size_t j = slot->hash & (num_slots - 1);
+			while (slots[j].addr != UNIQUE_STRINGS_EMPTY_SLOT) {
+				j = (j + 1) & (num_slots - 1);
+			}
+			slots[j] = *slot;
 		}
-		return new_node->buffer_ptr;
 	}
 
-	return found->buffer_ptr;
+	free(us->slots);
+	us->slots = slots;
+	us->num_slots = num_slots;
+	return true;
 }
 
 
-static void _unique_string_free_nodes(struct unique_string_node *node) {
-	if (node->next) {
-		_unique_string_free_nodes(node->next);
+struct unique_string_handle_t unique_strings_add_len(struct unique_strings_t *us, const char *str, size_t length) {
+	const uint32_t hash = hash_murmur2(str, (int)length, MURMUR_SEED);
+	struct unique_string_slot *slot = _unique_strings_find_slot(us, str, length, hash);
+
+	if (slot->addr == UNIQUE_STRINGS_EMPTY_SLOT) {
+		// Keep the load factor under 3/4, so probe sequences stay short
+		if ((us->num_strings + 1) * 4 > us->num_slots * 3 && _unique_strings_grow(us)) {
+			slot = _unique_strings_find_slot(us, str, length, hash);
+		}
+
+		struct unique_string_handle_t handle = buffer_alloc(&us->buffer, length + 1);
+		char *ptr = _unique_strings_get(&handle);
+		memcpy(ptr, str, length);
+		ptr[length] = '\0';
+
+		slot->addr = handle.addr;
+		slot->hash = hash;
+		us->num_strings++;
+		return handle;
 	}
 
-	free(node);
+	return unique_strings_handle(us, slot->addr);
 }
 
 
-static void _unique_string_free_buckets(struct unique_strings_t *us) {
-	if (us->buckets) {
-		for (unsigned int i=0; i < UNIQUE_STRING_BUCKETS; i++) {
-			if (us->buckets[i]) {
-				_unique_string_free_nodes(us->buckets[i]);
-			}
-		}
-		free(us->buckets);
-	}
-	us->buckets = NULL;
+struct unique_string_handle_t unique_strings_add(struct unique_strings_t *us, const char *str) {
+	return unique_strings_add_len(us, str, strlen(str));
 }
 
 
 void unique_strings_destroy(struct unique_strings_t *us) {
 	if (us) {
-		_unique_string_free_buckets(us);
-		buffer_clear(&us->buffer);
+		free(us->slots);
+		if (!us->borrowed) {
+			buffer_clear(&us->buffer);
+		}
 		free(us);
 	}
 }
 
 
-// Frees the bucket structures, reducing the footprint of the unique strings
-// object to only hold the deduped string data.
+// Frees the hash table, reducing the footprint of the unique strings object
+// to only hold the deduped string data.
 void unique_strings_freeze(struct unique_strings_t *us) {
-	_unique_string_free_buckets(us);
+	free(us->slots);
+	us->slots = NULL;
+	us->num_slots = 0;
 	buffer_compact(&us->buffer);
 }
 
@@ -269,3 +262,32 @@ const char * unique_strings_get(const struct unique_string_handle_t *handle) {
 bool unique_strings_owns(struct unique_strings_t *us, const char* str) {
 	return str >= us->buffer.data && str < (us->buffer.data + us->buffer.used);
 }
+
+
+struct unique_strings_t *unique_strings_create_static(const char *data, size_t size) {
+	struct unique_strings_t *us = calloc(1, sizeof(struct unique_strings_t));
+
+	if (us) {
+		us->buffer.data = (char*)data;
+		us->buffer.used = size;
+		us->buffer.capacity = size;
+		us->borrowed = true;
+	}
+
+	return us;
+}
+
+
+const char *unique_strings_data(const struct unique_strings_t *us, size_t *size) {
+	*size = us->buffer.used;
+	return us->buffer.data;
+}
+
+
+struct unique_string_handle_t unique_strings_handle(struct unique_strings_t *us, size_t addr) {
+	struct unique_string_handle_t handle = {
+		.addr = addr,
+		.parent = &us->buffer,
+	};
+	return handle;
+}
@@ -1,17 +1,58 @@
 #define NDEBUG
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <limits.h>
 #include <pcre.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 #include <yaml.h>
 
+#include "uap/builtin_rules.h"
+#include "uap/prefilter.h"
+#include "uap/result_cache.h"
+#include "uap/rule_dfa.h"
+#include "uap/string_interner.h"
 #include "uap/unique_strings.h"
 #include "uap/uap.h"
 
 #define MAX_PATTERN_MATCHES (32)
 #define SUBSTRING_VEC_COUNT (MAX_PATTERN_MATCHES*2)
 
+// Stack space for templated replacements in uap_parser_parse_string()
+#define PARSE_SCRATCH_SIZE (1024)
+
+// Replacement records are padded to this, see _ua_replacement_size()
+#define REPLACEMENT_ALIGN (8)
+
+// A rule whose matches may begin with any byte, see ua_rule.first_bytes
+#define RULE_ANY_FIRST_BYTE UINT32_MAX
+
+// Fewest rules worth handing each thread of _ua_parser_compile_rules()
+#define COMPILE_MIN_RULES_PER_THREAD (16)
+#define COMPILE_MAX_THREADS (64)
+
+// Initial and maximum size of each thread's JIT stack
+#define JIT_STACK_START_SIZE (32 * 1024)
+#define JIT_STACK_MAX_SIZE   (512 * 1024)
+
+// A piece of a pre-tokenized replacement template, either a literal span of
+// the replacement value or a reference to a captured group ($1...$9).
+struct ua_template_token {
+	uint32_t offset;  // literal: start within the replacement value
+	uint32_t length;  // literal: length in bytes
+	uint8_t capture;  // 0 for literals, otherwise the capture group index
+};
+
+
+// Replacements are packed back to back in their group's `replacements`
+// buffer, each record followed by its template tokens.
 struct ua_replacement {
 	union {
 		enum ua_user_agent_replacement_type {
@@ -40,9 +81,13 @@ struct ua_replacement {
 		} type;
 	};
 
-	bool has_placeholders; // pattern contains $1, etc.
 	struct unique_string_handle_t value;
-	struct ua_replacement *next;
+	uint32_t value_length;
+
+	// When the value contains $1, etc. it is split into tokens at load time,
+	// otherwise num_tokens is 0 and the value is used as-is.
+	uint32_t num_tokens;
+	struct ua_template_token tokens[];
 };
 
 
@@ -54,126 +99,566 @@ enum ua_parser_type {
 };
 
 
-// This should maintain the same layout as the user_agent_info struct
+// The user agent string of a parse along with what's worked out about it up
+// front, once, rather than again by every group or expression.
+struct ua_input {
+	const char *str;
+	int length;
+	bool valid_utf8;            // checked here, so pcre_exec() needn't
+	const uint64_t *candidates; // rules whose required literals were all found
+	uint64_t bytes[4];          // set of the bytes which appear in `str`, once `have_bytes`
+	bool have_bytes;
+};
+
+
+// Working state for a single parse. Matched fields are written directly to
+// the caller's spans, and templated replacements are assembled in `scratch`.
 struct ua_parse_state {
-	struct ua_parse_state_user_agent {
-		const char *family;
-		const char *major;
-		const char *minor;
-		const char *patch;
-	} user_agent;
-
-	struct ua_parse_state_os {
-		const char *family;
-		const char *major;
-		const char *minor;
-		const char *patch;
-		const char *patchMinor;
-	} os;
-
-	struct ua_parse_state_device {
-		const char *family;
-		const char *brand;
-		const char *model;
-	} device;
-
-	const char *buffer;
+	struct uap_useragent_spans *spans;
+	char *scratch;
+	size_t scratch_size;
+	size_t scratch_used; // may exceed scratch_size, see _apply_replacements()
+	const struct uap_parser_limits *limits;
+	uint64_t deadline;   // _ua_clock_ns() at which the parse_budget_ns runs out, or 0
+	int status;          // UAP_ERROR_* once a limit was hit, otherwise 0
 };
 
 
-struct ua_expression_pair {
+// The part of a rule that ua_parser_group_exec() looks at for every parse,
+// kept apart from the rest so a group's rules are walked as one small array.
+struct ua_rule {
 	pcre *regex;
 	pcre_extra *pcre_extra;
-	struct ua_replacement *replacements;
-	struct ua_expression_pair *next;
+	uint32_t rule_id; // index across all groups, used by the prefilter
+	uint32_t min_length;  // shortest string the expression can match
+	uint32_t first_bytes; // index of the rule's set in the group's `first_bytes`, or RULE_ANY_FIRST_BYTE
+	bool in_dfa;      // covered by the group's rule_dfa
+};
+
+
+// The rest of a rule, only needed once it has matched or by loaders.
+struct ua_rule_info {
+	struct unique_string_handle_t source; // original expression text
+	uint32_t replacements;     // offset of the first record in the group's `replacements`
+	uint32_t num_replacements;
+	char regex_flag;     // 'i' or '\0', as given in regexes.yaml
+	bool jit;            // the PCRE JIT accepted this expression
+	bool borrowed_regex; // `regex` lives in a snapshot
+	bool borrowed_extra; // `pcre_extra` was built around snapshot study data
 };
 
 
 struct ua_parser_group {
-	struct ua_expression_pair* expression_pairs;
+	struct ua_rule *rules;          // in priority order
+	struct ua_rule_info *rule_info; // parallel to `rules`
+	uint32_t num_rules;
+	uint32_t rules_capacity;
+	unsigned char *replacements;    // packed ua_replacement records
+	size_t replacements_size;
+	size_t replacements_capacity;
+	struct rule_dfa_t *dfa; // finds the first expression which can match
+	uint64_t (*first_bytes)[4]; // sets of bytes which rules' matches may begin with
+	uint32_t num_first_bytes;
 	void (*apply_replacements_cb)(
 			struct ua_parse_state*,
 			const char *ua_string,
-			struct ua_expression_pair*,
+			const struct ua_parser_group*,
+			const struct ua_rule_info*,
 			const int *matches_vector, // SUBSTRING_VEC_COUNT
-			const int num_matches,
-			pcre *replacement_re);
+			const int num_matches);
+};
+
+
+// Per-rule counters kept with UAP_PARSER_STATS. Each is only written by its
+// own thread, but read by others, so they're accessed atomically.
+struct ua_rule_counters {
+	uint64_t attempts;
+	uint64_t matches;
+	uint64_t nanoseconds;
+};
+
+
+// Per-thread scratch data, created the first time a thread needs it and
+// released when that thread exits or the parser is destroyed.
+struct ua_thread_state {
+	struct uap_parser *parser;
+	pthread_t thread;
+	pcre_jit_stack *jit_stack;
+	struct rule_dfa_cache_t *dfa_caches[3]; // one per parser group
+	struct ua_rule_counters *rule_counters; // indexed by rule_id, with UAP_PARSER_STATS
+	struct ua_thread_state *next;
 };
 
 
 struct uap_parser {
+	unsigned int flags; // UAP_PARSER_*
 	struct ua_parser_group user_agent_parser_group;
 	struct ua_parser_group os_parser_group;
 	struct ua_parser_group device_parser_group;
 	struct unique_strings_t *strings;
 	struct unique_string_handle_t string_handle_other; // handle -> "Other"
-	pcre *replacement_re;
+	struct prefilter_t *prefilter;
+	uint32_t num_rules;
+	struct result_cache_t *cache; // optional, see uap_parser_set_cache()
+	struct string_interner_t *interner; // optional, see uap_parser_set_interning()
+	struct string_interner_t **retired_interners; // replaced, but results may still point into them
+	size_t num_retired_interners;
+	struct uap_parser_limits limits; // see uap_parser_set_limits()
+	unsigned int compile_threads;    // see uap_parser_set_compile_threads()
+	struct uap_load_stats load_stats;
+
+	// Loaded snapshot, which compiled expressions and strings point into
+	struct {
+		const void *data;
+		size_t size;
+		bool mapped; // owned mmap rather than a caller supplied buffer
+	} snapshot;
+
+	pthread_key_t thread_key;      // -> struct ua_thread_state
+
+	// Rule counters of threads which have since exited, under ua_thread_lock
+	struct ua_rule_counters *retired_counters;
 };
 
 
-static void ua_replacement_destroy(struct ua_replacement *replacement) {
-	struct ua_replacement *next;
+// The states of every thread for every parser. A thread may exit while its
+// parser is being destroyed, so its state is only ever freed by whoever
+// takes it out of this list, and a parser outlives its listed states.
+static pthread_mutex_t ua_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ua_thread_state *ua_thread_states;
+
+
+static void ua_thread_state_free(struct ua_thread_state *thread_state) {
+	if (thread_state->jit_stack) {
+		pcre_jit_stack_free(thread_state->jit_stack);
+	}
+	for (int i = 0; i < 3; i++) {
+		rule_dfa_cache_destroy(thread_state->dfa_caches[i]);
+	}
+	free(thread_state->rule_counters);
+	free(thread_state);
+}
+
+
+// pthread key destructor, called as a thread exits. If the parser is being
+// destroyed at the same time, `ptr` may already have been freed, so it's only
+// used once it's found in the list. Matching the thread as well guards against
+// its memory having been reused for another thread's state since.
+static void _ua_thread_state_release(void *ptr) {
+	pthread_mutex_lock(&ua_thread_lock);
+	struct ua_thread_state **link = &ua_thread_states;
+	while (*link && (*link != ptr || !pthread_equal((*link)->thread, pthread_self()))) {
+		link = &(*link)->next;
+	}
+
+	struct ua_thread_state *thread_state = *link;
+	if (thread_state == NULL) {
+		pthread_mutex_unlock(&ua_thread_lock);
+		return;
+	}
+	*link = thread_state->next;
+
+	// Keep the thread's rule counters around for uap_parser_rule_stats()
+	struct uap_parser *ua_parser = thread_state->parser;
+	if (thread_state->rule_counters) {
+		if (ua_parser->retired_counters == NULL) {
+			ua_parser->retired_counters = calloc(ua_parser->num_rules, sizeof(struct ua_rule_counters));
+		}
+		for (uint32_t i = 0; ua_parser->retired_counters && i < ua_parser->num_rules; i++) {
+			ua_parser->retired_counters[i].attempts    += thread_state->rule_counters[i].attempts;
+			ua_parser->retired_counters[i].matches     += thread_state->rule_counters[i].matches;
+			ua_parser->retired_counters[i].nanoseconds += thread_state->rule_counters[i].nanoseconds;
+		}
+	}
+	pthread_mutex_unlock(&ua_thread_lock);
+
+	ua_thread_state_free(thread_state);
+}
+
+
+// Fetch the calling thread's state, creating it if necessary. The parser
+// is otherwise read-only while parsing, so the registry of thread states is
+// the only thing which needs the lock.
+static struct ua_thread_state *ua_thread_state_get(const struct uap_parser *ua_parser) {
+	struct ua_thread_state *thread_state = pthread_getspecific(ua_parser->thread_key);
+
+	if (thread_state == NULL) {
+		struct uap_parser *mutable_parser = (struct uap_parser*)ua_parser;
+
+		thread_state = calloc(1, sizeof(struct ua_thread_state));
+		if (thread_state == NULL) {
+			return NULL;
+		}
+		thread_state->parser = mutable_parser;
+		thread_state->thread = pthread_self();
+
+		if (pthread_setspecific(ua_parser->thread_key, thread_state) != 0) {
+			free(thread_state);
+			return NULL;
+		}
+
+		pthread_mutex_lock(&ua_thread_lock);
+		thread_state->next = ua_thread_states;
+		ua_thread_states = thread_state;
+		pthread_mutex_unlock(&ua_thread_lock);
+	}
+
+	return thread_state;
+}
+
+
+// Called by PCRE before running JIT compiled code. Returning NULL makes PCRE
+// fall back to its small default stack on the machine stack.
+static pcre_jit_stack *_ua_jit_stack_cb(void *data) {
+	struct ua_thread_state *thread_state = ua_thread_state_get(data);
+
+	if (thread_state == NULL) {
+		return NULL;
+	}
+
+	if (thread_state->jit_stack == NULL) {
+		thread_state->jit_stack = pcre_jit_stack_alloc(JIT_STACK_START_SIZE, JIT_STACK_MAX_SIZE);
+	}
+
+	return thread_state->jit_stack;
+}
+
+
+// Size of a replacement record and its tokens, padded so the next record
+// is aligned.
+static inline size_t _ua_replacement_size(uint32_t num_tokens) {
+	const size_t size = sizeof(struct ua_replacement) + num_tokens * sizeof(struct ua_template_token);
+	return (size + (REPLACEMENT_ALIGN - 1)) & ~(size_t)(REPLACEMENT_ALIGN - 1);
+}
+
+
+static inline const struct ua_replacement *_ua_replacement_next(const struct ua_replacement *repl) {
+	return (const struct ua_replacement*)((const unsigned char*)repl + _ua_replacement_size(repl->num_tokens));
+}
+
+
+static void ua_parser_group_init(
+		struct ua_parser_group *group,
+		void (*apply_replacements_cb)(
+			struct ua_parse_state*,
+			const char*,
+			const struct ua_parser_group*,
+			const struct ua_rule_info*,
+			const int*,
+			const int))
+{
+	memset(group, 0, sizeof(struct ua_parser_group));
+	group->apply_replacements_cb = apply_replacements_cb;
+}
+
+
+// Free the group's rules and replacements, leaving it empty.
+static void ua_parser_group_clear(struct ua_parser_group *group) {
+	for (uint32_t i = 0; i < group->num_rules; i++) {
+		if (!group->rule_info[i].borrowed_regex) {
+			pcre_free(group->rules[i].regex);
+		}
+		if (group->rule_info[i].borrowed_extra) {
+			free(group->rules[i].pcre_extra);
+		} else {
+			pcre_free_study(group->rules[i].pcre_extra);
+		}
+	}
+
+	free(group->rules);
+	free(group->rule_info);
+	free(group->replacements);
+	free(group->first_bytes);
+	group->rules = NULL;
+	group->rule_info = NULL;
+	group->num_rules = 0;
+	group->rules_capacity = 0;
+	group->replacements = NULL;
+	group->replacements_size = 0;
+	group->replacements_capacity = 0;
+	group->first_bytes = NULL;
+	group->num_first_bytes = 0;
+}
+
+
+// Append an empty rule to the group, returning its index.
+static uint32_t ua_parser_group_append_rule(struct ua_parser_group *group) {
+	if (group->num_rules == group->rules_capacity) {
+		group->rules_capacity = group->rules_capacity ? group->rules_capacity * 2 : 64;
+		group->rules = realloc(group->rules, group->rules_capacity * sizeof(struct ua_rule));
+		group->rule_info = realloc(group->rule_info, group->rules_capacity * sizeof(struct ua_rule_info));
+		assert(group->rules && group->rule_info);
+	}
+
+	const uint32_t index = group->num_rules++;
+	memset(&group->rules[index], 0, sizeof(struct ua_rule));
+	memset(&group->rule_info[index], 0, sizeof(struct ua_rule_info));
+	return index;
+}
+
+
+// Append a zeroed replacement record with room for `num_tokens` tokens,
+// returning its offset in the group's `replacements`.
+static size_t ua_parser_group_append_replacement(struct ua_parser_group *group, uint32_t num_tokens) {
+	const size_t size = _ua_replacement_size(num_tokens);
+
+	if (group->replacements_size + size > group->replacements_capacity) {
+		group->replacements_capacity = (group->replacements_size + size) * 2;
+		group->replacements = realloc(group->replacements, group->replacements_capacity);
+		assert(group->replacements);
+	}
+
+	const size_t offset = group->replacements_size;
+	memset(&group->replacements[offset], 0, size);
+	group->replacements_size += size;
+
+	((struct ua_replacement*)&group->replacements[offset])->num_tokens = num_tokens;
+	return offset;
+}
+
+
+// Trim the group's arrays to their final size once loading is done.
+static void ua_parser_group_shrink(struct ua_parser_group *group) {
+	if (group->num_rules > 0 && group->num_rules < group->rules_capacity) {
+		struct ua_rule *rules = realloc(group->rules, group->num_rules * sizeof(struct ua_rule));
+		struct ua_rule_info *rule_info = realloc(group->rule_info, group->num_rules * sizeof(struct ua_rule_info));
+		if (rules) {
+			group->rules = rules;
+		}
+		if (rule_info) {
+			group->rule_info = rule_info;
+		}
+		group->rules_capacity = group->num_rules;
+	}
+
+	if (group->replacements_size > 0 && group->replacements_size < group->replacements_capacity) {
+		unsigned char *replacements = realloc(group->replacements, group->replacements_size);
+		if (replacements) {
+			group->replacements = replacements;
+			group->replacements_capacity = group->replacements_size;
+		}
+	}
+}
+
 
-	while (replacement) {
-		next = replacement->next;
-		free(replacement);
-		replacement = next;
+// Note whether the JIT accepted the expression and, if so, hook up the
+// per-thread JIT stacks. Expressions the JIT can't handle are left on the
+// interpreter.
+static void _ua_rule_check_jit(struct uap_parser *ua_parser, struct ua_rule *rule, struct ua_rule_info *info) {
+	if (ua_parser->flags & UAP_PARSER_JIT) {
+		int jit = 0;
+		pcre_fullinfo(rule->regex, rule->pcre_extra, PCRE_INFO_JIT, &jit);
+		info->jit = jit != 0;
+		if (info->jit) {
+			pcre_assign_jit_stack(rule->pcre_extra, &_ua_jit_stack_cb, ua_parser);
+		}
 	}
 }
 
 
-static void ua_expression_pair_destroy(struct ua_expression_pair *pair) {
-	struct ua_expression_pair *next;
+static inline uint64_t _ua_clock_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+
+// Only the owning thread writes to its counters, so a plain load and store is
+// enough, but both are atomic as other threads may be reading them.
+static inline void _ua_counter_add(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+
+// Check that `len` bytes of `str` are valid UTF-8 as PCRE defines it (RFC
+// 3629, so no overlong forms, surrogates or code points past U+10FFFF). Runs
+// of ASCII are skipped a word at a time.
+static bool _ua_utf8_valid(const char *str, size_t len) {
+	const unsigned char *s = (const unsigned char*)str;
+	size_t i = 0;
+
+	while (i < len) {
+		uint64_t word;
+		if (len - i >= sizeof(word)) {
+			memcpy(&word, &s[i], sizeof(word));
+			if ((word & UINT64_C(0x8080808080808080)) == 0) {
+				i += sizeof(word);
+				continue;
+			}
+		}
+
+		const unsigned char c = s[i];
+		if (c < 0x80) {
+			i++;
+			continue;
+		}
+
+		// Number of continuation bytes, and the range allowed for the first
+		// of them to rule out overlong forms, surrogates and U+110000 up
+		size_t n;
+		unsigned char low = 0x80, high = 0xbf;
+
+		if (c >= 0xc2 && c <= 0xdf)      { n = 1; }
+		else if (c == 0xe0)              { n = 2; low = 0xa0; }
+		else if (c == 0xed)              { n = 2; high = 0x9f; }
+		else if (c >= 0xe1 && c <= 0xef) { n = 2; }
+		else if (c == 0xf0)              { n = 3; low = 0x90; }
+		else if (c >= 0xf1 && c <= 0xf3) { n = 3; }
+		else if (c == 0xf4)              { n = 3; high = 0x8f; }
+		else return false;
+
+		if (len - i <= n || s[i + 1] < low || s[i + 1] > high) {
+			return false;
+		}
+		for (size_t k = 2; k <= n; k++) {
+			if ((s[i + k] & 0xc0) != 0x80) {
+				return false;
+			}
+		}
+		i += n + 1;
+	}
 
-	while (pair) {
-		next = pair->next;
+	return true;
+}
 
-		ua_replacement_destroy(pair->replacements);
-		pcre_free(pair->regex);
-		pcre_free(pair->pcre_extra);
-		free(pair);
 
-		pair = next;
+// The set of bytes in the input, worked out when a parse first needs it.
+static const uint64_t *_ua_input_bytes(struct ua_input *input) {
+	if (!input->have_bytes) {
+		memset(input->bytes, 0, sizeof(input->bytes));
+		for (int i = 0; i < input->length; i++) {
+			const unsigned char c = (unsigned char)input->str[i];
+			input->bytes[c >> 6] |= UINT64_C(1) << (c & 63);
+		}
+		input->have_bytes = true;
 	}
+	return input->bytes;
 }
 
+
+static inline bool _ua_bytes_intersect(const uint64_t *a, const uint64_t *b) {
+	return ((a[0] & b[0]) | (a[1] & b[1]) | (a[2] & b[2]) | (a[3] & b[3])) != 0;
+}
+
+
 static int ua_parser_group_exec(
 		const struct ua_parser_group *group,
 		struct ua_parse_state *state,
-		const char *ua_string,
-		pcre *replacement_re)
+		struct ua_input *input,
+		const uint32_t first_rule,
+		struct ua_rule_counters *counters, // NULL unless UAP_PARSER_STATS
+		int *matched_rule)
 {
-	struct ua_expression_pair *pair = group->expression_pairs;
-	const size_t ua_string_length = strlen(ua_string);
-
 	// @TODO urldecode ua_string
 	int matches_vector[SUBSTRING_VEC_COUNT];
+	const struct uap_parser_limits *limits = state->limits;
+	const bool match_limits = limits->match_limit > 0 || limits->match_limit_recursion > 0;
+
+	for (uint32_t i = 0; i < group->num_rules; i++) {
+		const struct ua_rule *rule = &group->rules[i];
+
+		// The DFA has already ruled out the expressions it covers ahead of
+		// `first_rule`, and the prefilter those whose required literals don't
+		// appear anywhere in the string.
+		if ((rule->in_dfa && rule->rule_id < first_rule) || !prefilter_is_candidate(input->candidates, rule->rule_id)) {
+			continue;
+		}
+
+		// Nor can an expression match a string with fewer bytes than it
+		// needs characters, or one without any of the bytes its matches
+		// begin with. That's rarely worth checking for the rule the DFA
+		// pointed at.
+		if ((uint32_t)input->length < rule->min_length) {
+			continue;
+		}
+		if (rule->first_bytes != RULE_ANY_FIRST_BYTE && !(rule->in_dfa && rule->rule_id == first_rule)
+				&& !_ua_bytes_intersect(group->first_bytes[rule->first_bytes], _ua_input_bytes(input))) {
+			continue;
+		}
+
+		const uint64_t start_time = (counters || state->deadline) ? _ua_clock_ns() : 0;
+
+		if (state->deadline && start_time >= state->deadline) {
+			state->status = UAP_ERROR_TIME_BUDGET;
+			return 0;
+		}
+
+		// The rule's pcre_extra is shared between threads, so the limits are
+		// set on a copy of it.
+		const pcre_extra *extra = rule->pcre_extra;
+		pcre_extra limited_extra;
+
+		if (match_limits) {
+			if (extra) {
+				limited_extra = *extra;
+			} else {
+				memset(&limited_extra, 0, sizeof(limited_extra));
+			}
+			if (limits->match_limit > 0) {
+				limited_extra.flags |= PCRE_EXTRA_MATCH_LIMIT;
+				limited_extra.match_limit = limits->match_limit;
+			}
+			if (limits->match_limit_recursion > 0) {
+				limited_extra.flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+				limited_extra.match_limit_recursion = limits->match_limit_recursion;
+			}
+			extra = &limited_extra;
+		}
 
-	while (pair) {
 		int pcre_result = pcre_exec(
-				pair->regex,
-				pair->pcre_extra,
-				ua_string,
-				ua_string_length,
-				0,
+				rule->regex,
+				extra,
+				input->str,
+				input->length,
 				0,
+				PCRE_NO_UTF8_CHECK,
 				matches_vector,
 				SUBSTRING_VEC_COUNT);
 
+		// The JIT ran out of stack for this subject; run it again on the
+		// interpreter, which isn't bound by the JIT stack size.
+		if (pcre_result == PCRE_ERROR_JIT_STACKLIMIT) {
+			pcre_extra interpreter_extra = *extra;
+			interpreter_extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+
+			pcre_result = pcre_exec(
+					rule->regex,
+					&interpreter_extra,
+					input->str,
+					input->length,
+					0,
+					PCRE_NO_UTF8_CHECK,
+					matches_vector,
+					SUBSTRING_VEC_COUNT);
+		}
+
+		if (counters) {
+			struct ua_rule_counters *counter = &counters[rule->rule_id];
+			_ua_counter_add(&counter->attempts, 1);
+			_ua_counter_add(&counter->matches, pcre_result > 0);
+			_ua_counter_add(&counter->nanoseconds, _ua_clock_ns() - start_time);
+		}
+
 		if (pcre_result > 0) {
-			group->apply_replacements_cb(state, ua_string, pair, &matches_vector[0], pcre_result, replacement_re);
+			group->apply_replacements_cb(state, input->str, group, &group->rule_info[i], &matches_vector[0], pcre_result);
+			*matched_rule = (int)i;
 
 			// Found a matching expression, all done.
 			return 1;
 		}
 
+		// Give up on the group rather than fall through to a lower priority
+		// expression, which might match where this one would have.
 		switch (pcre_result) {
 			case PCRE_ERROR_NOMATCH: break;
+			case PCRE_ERROR_MATCHLIMIT:
+			case PCRE_ERROR_RECURSIONLIMIT:
+				state->status = UAP_ERROR_MATCH_LIMIT;
+				return 0;
 			default:
-				printf("PCRE Error %d\n", pcre_result);
+				state->status = UAP_ERROR_PCRE;
+				return 0;
 		}
-
-		pair = pair->next;
 	}
 
 	// Failed to match any expressions!
@@ -181,45 +666,76 @@ static int ua_parser_group_exec(
 }
 
 
-// Free any dynamically allocated strings but don't bother with data which
-// is managed by the unique_strings system.
-static void ua_parse_state_destroy(struct ua_parse_state *state, struct unique_strings_t *strings) {
-	// ua_parse_state is just a bunch of const character pointers, so, this is fine.
-	char **field = (char**)state;
-
-	// the overall size of the structure, divided by the size of a const character pointer (size of each field)
-	const char **end = (const char**)field + (sizeof(struct ua_parse_state) / sizeof(const char*));
+// Ask the group's DFA for the first expression which can match, creating the
+// calling thread's cache of DFA states on first use. Returns 0, which rules
+// nothing out, when there's no DFA to ask.
+static uint32_t ua_parser_group_first_rule(
+		const struct ua_parser_group *group,
+		struct ua_thread_state *thread_state,
+		const int group_index,
+		const char *ua_string,
+		const size_t ua_string_length)
+{
+	if (group->dfa == NULL || thread_state == NULL) {
+		return 0;
+	}
 
-	while ((const char**)field < end) {
-		if (!unique_strings_owns(strings, *field)) {
-			free(*field);
-			*field = NULL;
+	if (thread_state->dfa_caches[group_index] == NULL) {
+		thread_state->dfa_caches[group_index] = rule_dfa_cache_create(group->dfa);
+		if (thread_state->dfa_caches[group_index] == NULL) {
+			return 0;
 		}
-		field++;
 	}
+
+	return rule_dfa_first(group->dfa, thread_state->dfa_caches[group_index], ua_string, ua_string_length);
 }
 
 
-static void ua_parse_state_create_useragent_info(
+// Point the fields of `info` at the parsed spans. Fields are copied into a
+// single buffer attached to `info`, except those the optional `interner`
+// hands out a shared copy of. Returns the size of the buffer, or 0 if every
+// field was interned and nothing was copied.
+static size_t ua_parse_state_create_useragent_info(
 		struct uap_useragent_info *info,
-		struct ua_parse_state *state)
+		const struct uap_useragent_spans *spans,
+		struct string_interner_t *interner)
 {
-	// Calculate total buffer requirements for all info strings
-	size_t size = 0;
-	const char **src_field = (const char**)state;
-	const char **end = src_field + (sizeof(struct ua_parse_state) / sizeof(const char*));
+	const struct uap_span *src_fields = (const struct uap_span*)spans;
+	const char *interned[UAP_SPAN_FIELD_COUNT];
+
+	// Calculate total buffer requirements for the strings which weren't
+	// interned, plus a trailing null terminator for the fields which weren't
+	// matched
+	size_t size = 1;
+	bool copied = false;
+
+	for (size_t i = 0; i < UAP_SPAN_FIELD_COUNT; i++) {
+		const struct uap_span *src_field = &src_fields[i];
+		interned[i] = NULL;
+
+		if (interner) {
+			interned[i] = src_field->ptr
+				? string_interner_intern(interner, src_field->ptr, src_field->len, NULL)
+				: string_interner_intern(interner, "", 0, NULL);
+		}
 
-	// Total up all the string lengths plus null terminators
-	while (src_field != end) {
-		size += *src_field ? strlen(*src_field) + 1 : 0;
-		src_field++;
+		if (interned[i] == NULL) {
+			size += src_field->ptr ? src_field->len + 1 : 0;
+			copied = true;
+		}
 	}
 
 	// Allocate a new buffer to hold the strings, this will be
 	// attached to the user_agent_info structure which has a
 	// lifetime beyond this system, so it will need to be freed.
 	// (automatically handled by user_agent_info_free());
-	char *buffer = realloc((void*)info->strings, size);
+	// When everything was interned, the previous buffer is kept for reuse.
+	const char *strings = info->strings;
+	char *buffer = NULL;
+	if (copied) {
+		buffer = realloc((void*)info->strings, size);
+		strings = buffer;
+	}
 
 	// Wipe the info entirely (overwriting info->strings as well,
 	// but we'll re-attach that near the end)
@@ -228,200 +744,199 @@ static void ua_parse_state_create_useragent_info(
 	// Go back to the first field to begin copying to the buffer
 	{
 		char *write_ptr = buffer;
-		src_field = (const char**)state;
 		const char **dst_field = (const char**)info;
 
-		while (src_field != end) {
-			*dst_field = write_ptr;
+		for (size_t i = 0; i < UAP_SPAN_FIELD_COUNT; i++) {
+			const struct uap_span *src_field = &src_fields[i];
 
-			if (*src_field != NULL) {
-				const size_t len = strlen(*src_field) + 1;
-				memcpy(write_ptr, *src_field, len);
-				write_ptr += len;
+			if (interned[i] != NULL) {
+				dst_field[i] = interned[i];
+			} else if (src_field->ptr != NULL) {
+				dst_field[i] = write_ptr;
+				memcpy(write_ptr, src_field->ptr, src_field->len);
+				write_ptr[src_field->len] = '\0';
+				write_ptr += src_field->len + 1;
 			} else {
 				// This will point to a null terminator, since it's
 				// at the end of the buffer.
-				*dst_field = &buffer[size-1];
+				dst_field[i] = &buffer[size-1];
 			}
-
-			src_field++;
-			dst_field++;
 		}
 	}
 
+	if (buffer) {
+		buffer[size-1] = '\0';
+	}
+
 	// Store a pointer to the beginning of the buffer
-	info->strings = buffer;
+	info->strings = strings;
+
+	return copied ? size : 0;
 }
 
 
 static void _apply_replacements(
-		const char **state_fields,
+		struct uap_span *fields,
+		struct ua_parse_state *state,
 		const char *ua_string,
-		struct ua_expression_pair *pair,
+		const struct ua_parser_group *group,
+		const struct ua_rule_info *info,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		pcre *replacement_re)
+		const int num_matches)
 {
-	struct ua_replacement *repl = pair->replacements;
+	const struct ua_replacement *repl = (const struct ua_replacement*)&group->replacements[info->replacements];
 
-	{
-		int i = 0;
-		while (repl) {
-			repl = repl->next;
-			i++;
+	for (uint32_t r = 0; r < info->num_replacements; r++, repl = _ua_replacement_next(repl)) {
+		// fields points to the first field, so the repl->type enum
+		// can be used to adjust the pointer to the appropriate field.
+		struct uap_span *dest = (fields + repl->type);
+		const char *replacement_str = unique_strings_get(&repl->value);
+
+		// Without any $1...$9 placeholders, the value from the unique_strings
+		// buffer can be used directly. Otherwise the value is assembled from
+		// the template tokens in the scratch buffer.
+		if (repl->num_tokens == 0) {
+			dest->ptr = replacement_str;
+			dest->len = repl->value_length;
+			continue;
 		}
-	}
-	repl = pair->replacements;
 
-	while (repl) {
-		// state_fields points to the first field, so the repl->type enum
-		// can be used to adjust the pointer to the appropriate field.
-		const char **dest = (state_fields + repl->type);
-
-		// Check if we need to replace instances of $1...$9 with
-		// the matched values or not. If we do, then new memory
-		// is allocated for the field value rather than just
-		// assigned to the unique_strings buffer. This is fine.
-		if (repl->has_placeholders) {
-			const char* replacement_str = unique_strings_get(&repl->value);
-			int out_size = strlen(replacement_str) + 1;
-			int replacements_vector[SUBSTRING_VEC_COUNT];
-
-
-			// At this phase we're scanning a replacement expression for the
-			// "$N" patterns and collecting their positions within the replacement string.
-			// These positions will determine where we inject the matched patterns from the
-			// original user agent string (identified by `substring_vec`)
-			//
-
-			int replacements_count = 0;
-			{
-				int repl_vec[6]; // pattern only has one expression, at most 2 matches
-				int start_offset = 0;
-				const int replacement_strlen = strlen(replacement_str);
-
-				while (start_offset < replacement_strlen && replacements_count < MAX_PATTERN_MATCHES) {
-					const int pcre_res = pcre_exec(
-						replacement_re,
-						NULL, // Simple expression; doesn't utilize study data.
-						replacement_str,
-						replacement_strlen,
-						start_offset,
-						0, // No options.
-						repl_vec,
-						6);
-
-					// Found a match
-					if (pcre_res > 0) {
-						replacements_vector[replacements_count * 2]     = repl_vec[0];
-						replacements_vector[replacements_count * 2 + 1] = repl_vec[1];
-						replacements_count++;
-						start_offset = repl_vec[1];
-					} else {
-						// No matches, exit the loop
-						start_offset = replacement_strlen;
-					}
-				}
+		// Total up the output size. Placeholders for groups which didn't
+		// participate in the match are replaced with nothing.
+		size_t out_size = 0;
+		for (uint32_t i = 0; i < repl->num_tokens; i++) {
+			const struct ua_template_token *token = &repl->tokens[i];
+			if (token->capture == 0) {
+				out_size += token->length;
+			} else if (token->capture < num_matches && matches_vector[token->capture * 2] >= 0) {
+				out_size += matches_vector[token->capture * 2 + 1] - matches_vector[token->capture * 2];
 			}
+		}
 
-			// repl->has_placeholders is true, so this should always succeed.
-			if (replacements_count > 0) {
-				// lookup for ua_string/substring_vec[] positions
-				int replacement_index[MAX_PATTERN_MATCHES];
-
-				// Iterate over replacement identifier matches
-				for (int i = 0; i < replacements_count; i++) {
-					// Convert the ASCII character to the matching integer
-					// "$1" becomes integer 1. We don't start with the 0-position pattern match
-					// because that is the overall PCRE match result.
-					replacement_index[i] = replacement_str[replacements_vector[i*2] + 1] - 48;
-					assert(replacement_index[i] > 0 && replacement_index[i] < 10);
-
-					if (replacement_index[i] < 1 || replacement_index[i] > 9) {
-						// Invalid replacement index, this is likely an input error of regexes.yaml
-						// and so we'll treat it as a fatal error, since it could cause a buffer overflow.
-						return;
-					}
-
-					const int idx = replacement_index[i];
-					const int replacement_strlen = matches_vector[idx * 2 + 1] - matches_vector[idx * 2];
-
-					// For each replacement match, we SUBTRACT 2 from the out_size (strlen("$1"))
-					// and then we ADD the size of the matches string that will be inserted
-					if (replacement_strlen > 0) {
-						out_size += (-2) + replacement_strlen;
-					}
-				}
-
-				// Allocate a new buffer for the output
-				char *out = calloc(1, out_size);
-
-				// Now combine matched user agent patterns with replacement patterns.
-				int write_index = 0; // to output.
-				int read_index = 0; // from replacement_str, eg: "Foo $5 Bar $2 Baz"
-
-				for (int i = 0; i < replacements_count; i++) {
-
-					// Copy everything from the replacement string leading up
-					// to the point of the first match.
-					//
-					// "Foo $5 Bar $2 Baz"
-					//  ---^
-					while (read_index < replacements_vector[i * 2]) {
-						out[write_index++] = replacement_str[read_index++];
-					}
-
-					// Advance the read_index by 2 bytes to skip the "$N" which
-					// we should now be at.
-					//
-					// "Foo $5 Bar $2 Baz"
-					//  ------^
-					assert(replacement_str[read_index] == '$');
-					read_index += 2;
-
-					// Copy the matched pattern from the original user agent
-					// string, identified by `matches_vector`.
-					int match_start     = matches_vector[replacement_index[i] * 2];
-					const int match_end = matches_vector[replacement_index[i] * 2 + 1];
-
-					while (match_start < match_end) {
-						out[write_index++] = ua_string[match_start++];
-					}
-				}
+		// If the scratch buffer is too small keep counting, so the caller
+		// can be told how much space is actually required.
+		if (state->scratch_used + out_size > state->scratch_size) {
+			state->scratch_used += out_size;
+			dest->ptr = NULL;
+			dest->len = 0;
+			continue;
+		}
 
-				// Copy any remaining replacement string data
-				while (replacement_str[read_index]) {
-					out[write_index++] = replacement_str[read_index++];
-				}
+		char *out = &state->scratch[state->scratch_used];
+		size_t write_index = 0;
+		state->scratch_used += out_size;
+
+		// Now combine matched user agent patterns with replacement literals.
+		for (uint32_t i = 0; i < repl->num_tokens; i++) {
+			const struct ua_template_token *token = &repl->tokens[i];
+			if (token->capture == 0) {
+				memcpy(&out[write_index], &replacement_str[token->offset], token->length);
+				write_index += token->length;
+			} else if (token->capture < num_matches && matches_vector[token->capture * 2] >= 0) {
+				const int match_start = matches_vector[token->capture * 2];
+				const int match_len   = matches_vector[token->capture * 2 + 1] - match_start;
+				memcpy(&out[write_index], &ua_string[match_start], match_len);
+				write_index += match_len;
+			}
+		}
 
-				// Trim leading whitespace
-				{
-					int i = 0;
-					while (i < out_size && out[i] == ' ') { i++; }
+		// Trim leading and trailing whitespace
+		{
+			size_t begin = 0;
+			while (begin < write_index && out[begin] == ' ') { begin++; }
+			while (write_index > begin && out[write_index - 1] == ' ') { write_index--; }
+			dest->ptr = &out[begin];
+			dest->len = write_index - begin;
+		}
+	}
+}
 
-					for (int j = i; j < out_size; j++) {
-						out[j - i] = out[j];
-					}
-				}
 
-				// Trim trailing whitespace
-				while (write_index > 0 && out[--write_index] == ' ') {
-					out[write_index] = '\0';
+// Split a replacement value into literal spans and $1...$9 capture group
+// references, so nothing needs to be searched for while parsing. Returns the
+// number of tokens, which are only written if `tokens` isn't NULL.
+static uint32_t _tokenize_replacement(const char *value, struct ua_template_token *tokens) {
+	uint32_t num_tokens = 0;
+	uint32_t literal_start = 0;
+	uint32_t i = 0;
+	bool templated = false;
+
+	while (value[i]) {
+		if (value[i] == '$' && value[i + 1] >= '1' && value[i + 1] <= '9') {
+			if (i > literal_start) {
+				if (tokens) {
+					tokens[num_tokens] = (struct ua_template_token){ literal_start, i - literal_start, 0 };
 				}
-
-				// All done
-				*dest = out;
+				num_tokens++;
 			}
+			if (tokens) {
+				tokens[num_tokens] = (struct ua_template_token){ 0, 0, value[i + 1] - '0' };
+			}
+			num_tokens++;
+			templated = true;
+			i += 2;
+			literal_start = i;
 		} else {
-			*dest = unique_strings_get(&repl->value);
+			i++;
+		}
+	}
+
+	// Values without any placeholders are used as-is, without tokens
+	if (!templated) {
+		return 0;
+	}
+
+	if (i > literal_start) {
+		if (tokens) {
+			tokens[num_tokens] = (struct ua_template_token){ literal_start, i - literal_start, 0 };
 		}
+		num_tokens++;
+	}
+
+	return num_tokens;
+}
+
+
+// Append a replacement of `value`, whose handle is `handle`, to the group's
+// packed replacements.
+static void ua_parser_group_add_replacement(
+		struct ua_parser_group *group,
+		const char *value,
+		struct unique_string_handle_t handle,
+		enum ua_replacement_type type)
+{
+	const size_t offset = ua_parser_group_append_replacement(group, _tokenize_replacement(value, NULL));
+	struct ua_replacement *repl = (struct ua_replacement*)&group->replacements[offset];
+
+	repl->type = type;
+	repl->value = handle;
+	repl->value_length = strlen(value);
+	_tokenize_replacement(value, repl->tokens);
+}
 
-		repl = repl->next;
+
+// Point `field` at the captured group `index`. Groups which didn't
+// participate in the match still produce an empty (non-NULL) value.
+static inline void _capture_to_span(
+		struct uap_span *field,
+		const char *ua_string,
+		const int *matches_vector,
+		const int index)
+{
+	const int start = matches_vector[index * 2];
+
+	if (start < 0) {
+		field->ptr = ua_string;
+		field->len = 0;
+	} else {
+		field->ptr = &ua_string[start];
+		field->len = matches_vector[index * 2 + 1] - start;
 	}
 }
 
 
 static void _apply_defaults(
-		const char **field,
+		struct uap_span *field,
 		const char *ua_string,
 		const int num_fields,
 		const int *matches_vector,
@@ -432,12 +947,8 @@ static void _apply_defaults(
 #undef MIN
 
 	for (int i = 0; i < max_iterations; i++) {
-		if (!*field) {
-			const int mv_idx = (i + 1) * 2;
-			const size_t len = matches_vector[mv_idx + 1] - matches_vector[mv_idx];
-			char *out = calloc(1, len + 1);
-			memcpy(out, &ua_string[matches_vector[mv_idx]], len);
-			*field = out;
+		if (!field->ptr) {
+			_capture_to_span(field, ua_string, matches_vector, i + 1);
 		}
 
 		++field;
@@ -446,19 +957,17 @@ static void _apply_defaults(
 
 
 static void _apply_defaults_for_device(
-		struct ua_parse_state_device *device,
+		struct uap_useragent_spans *spans,
 		const char *ua_string,
 		const int *matches_vector,
 		const int num_matches)
 {
 	if (num_matches > 1) {
-		const char **fields[] = { &device->family, &device->model };
+		struct uap_span *fields[] = { &spans->device.family, &spans->device.model };
 		for (int i = 0; i < 2; i++) {
 			// If the field is undefined, use the first matched pattern if available
-			if (!*fields[i]) {
-				const size_t len = matches_vector[2 + 1] - matches_vector[2];
-				*fields[i] = calloc(1, len + 1);
-				memcpy((void*)*fields[i], &ua_string[matches_vector[2]], len);
+			if (!fields[i]->ptr) {
+				_capture_to_span(fields[i], ua_string, matches_vector, 1);
 			}
 		}
 	}
@@ -468,101 +977,401 @@ static void _apply_defaults_for_device(
 inline static void apply_replacements_user_agent(
 		struct ua_parse_state *state,
 		const char *ua_string,
-		struct ua_expression_pair *pair,
+		const struct ua_parser_group *group,
+		const struct ua_rule_info *info,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->user_agent, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults((const char**)&state->user_agent, ua_string, 4, matches_vector, num_matches);
+	_apply_replacements(&state->spans->user_agent.family, state, ua_string, group, info, matches_vector, num_matches);
+	_apply_defaults(&state->spans->user_agent.family, ua_string, 4, matches_vector, num_matches);
 }
 
 
 inline static void apply_replacements_os(
 		struct ua_parse_state *state,
 		const char *ua_string,
-		struct ua_expression_pair *pair,
+		const struct ua_parser_group *group,
+		const struct ua_rule_info *info,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->os, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults((const char**)&state->os, ua_string, 5, matches_vector, num_matches);
+	_apply_replacements(&state->spans->os.family, state, ua_string, group, info, matches_vector, num_matches);
+	_apply_defaults(&state->spans->os.family, ua_string, 5, matches_vector, num_matches);
 }
 
 
 inline static void apply_replacements_device(
 		struct ua_parse_state *state,
 		const char *ua_string,
-		struct ua_expression_pair *pair,
+		const struct ua_parser_group *group,
+		const struct ua_rule_info *info,
 		const int *matches_vector, // SUBSTRING_VEC_COUNT
-		const int num_matches,
-		pcre *replacement_re)
+		const int num_matches)
 {
-	_apply_replacements((const char**)&state->device, ua_string, pair, matches_vector, replacement_re);
-	_apply_defaults_for_device(&state->device, ua_string, matches_vector, num_matches);
+	_apply_replacements(&state->spans->device.family, state, ua_string, group, info, matches_vector, num_matches);
+	_apply_defaults_for_device(state->spans, ua_string, matches_vector, num_matches);
 }
 
 
 struct uap_parser *uap_parser_create() {
-	struct uap_parser *ua_parser = malloc(sizeof(struct uap_parser));
+	return uap_parser_create_with_flags(0);
+}
 
-	ua_parser->user_agent_parser_group.expression_pairs = NULL;
-	ua_parser->os_parser_group.expression_pairs         = NULL;
-	ua_parser->device_parser_group.expression_pairs     = NULL;
-	ua_parser->strings                                  = NULL;
 
-	ua_parser->user_agent_parser_group.apply_replacements_cb = &apply_replacements_user_agent;
-	ua_parser->os_parser_group.apply_replacements_cb         = &apply_replacements_os;
-	ua_parser->device_parser_group.apply_replacements_cb     = &apply_replacements_device;
+struct uap_parser *uap_parser_create_with_flags(unsigned int flags) {
+	struct uap_parser *ua_parser = malloc(sizeof(struct uap_parser));
 
-	// Compile expressions for finding $1...$9 in replacement strings
-	{
-		const char *error;
-		int error_offset;
-		ua_parser->replacement_re = pcre_compile("\\$\\d", PCRE_UTF8, &error, &error_offset, NULL);
-		assert(ua_parser->replacement_re);
+	if (ua_parser == NULL) {
+		return NULL;
+	}
+
+	if (pthread_key_create(&ua_parser->thread_key, &_ua_thread_state_release) != 0) {
+		free(ua_parser);
+		return NULL;
+	}
+	ua_parser->retired_counters = NULL;
+
+	// Only request the JIT if this build of PCRE actually provides it
+	if (flags & UAP_PARSER_JIT) {
+		int jit_available = 0;
+		pcre_config(PCRE_CONFIG_JIT, &jit_available);
+		if (!jit_available) {
+			flags &= ~UAP_PARSER_JIT;
+		}
 	}
 
+	ua_parser->flags           = flags;
+	ua_parser->strings         = NULL;
+	ua_parser->prefilter       = NULL;
+	ua_parser->num_rules       = 0;
+	ua_parser->cache           = NULL;
+	ua_parser->interner        = NULL;
+	ua_parser->compile_threads = 0;
+	memset(&ua_parser->limits, 0, sizeof(ua_parser->limits));
+	memset(&ua_parser->load_stats, 0, sizeof(ua_parser->load_stats));
+	ua_parser->snapshot.data   = NULL;
+	ua_parser->snapshot.size   = 0;
+	ua_parser->snapshot.mapped = false;
+	ua_parser->retired_interners     = NULL;
+	ua_parser->num_retired_interners = 0;
+
+	ua_parser_group_init(&ua_parser->user_agent_parser_group, &apply_replacements_user_agent);
+	ua_parser_group_init(&ua_parser->os_parser_group, &apply_replacements_os);
+	ua_parser_group_init(&ua_parser->device_parser_group, &apply_replacements_device);
+
 	return ua_parser;
 }
 
 
 void uap_parser_destroy(struct uap_parser *ua_parser) {
-	ua_expression_pair_destroy(ua_parser->user_agent_parser_group.expression_pairs);
-	ua_expression_pair_destroy(ua_parser->os_parser_group.expression_pairs);
-	ua_expression_pair_destroy(ua_parser->device_parser_group.expression_pairs);
+	ua_parser_group_clear(&ua_parser->user_agent_parser_group);
+	ua_parser_group_clear(&ua_parser->os_parser_group);
+	ua_parser_group_clear(&ua_parser->device_parser_group);
+	rule_dfa_destroy(ua_parser->user_agent_parser_group.dfa);
+	rule_dfa_destroy(ua_parser->os_parser_group.dfa);
+	rule_dfa_destroy(ua_parser->device_parser_group.dfa);
 	unique_strings_destroy(ua_parser->strings);
-	pcre_free(ua_parser->replacement_re);
+	prefilter_destroy(ua_parser->prefilter);
+	result_cache_destroy(ua_parser->cache);
+	string_interner_destroy(ua_parser->interner);
+	for (size_t i = 0; i < ua_parser->num_retired_interners; i++) {
+		string_interner_destroy(ua_parser->retired_interners[i]);
+	}
+	free(ua_parser->retired_interners);
+
+	if (ua_parser->snapshot.mapped) {
+		munmap((void*)ua_parser->snapshot.data, ua_parser->snapshot.size);
+	}
+
+	// No destructor starts once the key is deleted, but one may be running
+	// already, so the states are taken out of the list before freeing them
+	pthread_key_delete(ua_parser->thread_key);
+
+	struct ua_thread_state *detached = NULL;
+	pthread_mutex_lock(&ua_thread_lock);
+	struct ua_thread_state **link = &ua_thread_states;
+	while (*link) {
+		struct ua_thread_state *thread_state = *link;
+		if (thread_state->parser == ua_parser) {
+			*link = thread_state->next;
+			thread_state->next = detached;
+			detached = thread_state;
+		} else {
+			link = &thread_state->next;
+		}
+	}
+	pthread_mutex_unlock(&ua_thread_lock);
+
+	while (detached) {
+		struct ua_thread_state *next = detached->next;
+		ua_thread_state_free(detached);
+		detached = next;
+	}
+
+	free(ua_parser->retired_counters);
 	free(ua_parser);
 }
 
 
-static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_parser_t *yaml_parser) {
-	// Structure to retain the active parsing state
-	struct {
-		enum {
-			UNKNOWN,
-			REGEX, // regex
-			REPLACEMENT,
-			PARSER, // user_agent_parsers, os_parsers, device_parsers
-			REGEX_FLAG,
-		} key_type;
+// An unanchored expression which begins with a lazy ".*?" matches the same
+// captures without it, only the start of the whole match moves, and PCRE no
+// longer retries the rest from every position. That doesn't hold if anything
+// at the top level is an alternative to it, or it's quantified in turn.
+// Returns where in `regex` to compile from.
+static const char *_ua_regex_skip_lazy_prefix(const char *regex) {
+	if (strncmp(regex, ".*?", 3) != 0 || regex[3] == '\0' || strchr("?*+{", regex[3])
+			|| strstr(regex, "\\Q") || strstr(regex, "[:")) {
+		return regex;
+	}
 
-		enum {
-			KEY,
-			VALUE,
-		} scalar_type;
+	int depth = 0;
+	bool in_class = false;
 
-		enum ua_replacement_type current_replacement_type;
-		struct ua_parser_group *current_parser_group;
-		enum ua_parser_type current_parser_type;
-		struct ua_expression_pair **current_expression_pair_insert;
-		struct ua_expression_pair *new_expression_pair;
+	for (const char *c = regex + 3; *c; c++) {
+		if (*c == '\\') {
+			if (*++c == '\0') {
+				break;
+			}
+		} else if (in_class) {
+			in_class = *c != ']';
+		} else if (*c == '[') {
+			in_class = true;
+			c += (c[1] == '^');
+			c += (c[1] == ']'); // a leading ']' is literal
+		} else if (*c == '(') {
+			depth++;
+		} else if (*c == ')') {
+			depth--;
+		} else if (*c == '|' && depth == 0) {
+			return regex;
+		}
+	}
 
-		char *regex_temp;
-		size_t regex_temp_size;
-		char regex_flag;
+	return regex + 3;
+}
+
+
+// Append the expression `source` to `group` as its next rule, along with the
+// `num_replacements` replacement records which were appended to the group
+// starting at offset `replacements`. The expression is compiled later, along
+// with all the others, by _ua_parser_compile_rules().
+static void _ua_parser_add_expression(
+		struct ua_parser_group *group,
+		struct unique_string_handle_t source,
+		char regex_flag,
+		size_t replacements,
+		uint32_t num_replacements)
+{
+	const uint32_t index = ua_parser_group_append_rule(group);
+	struct ua_rule_info *info = &group->rule_info[index];
+
+	info->source = source;
+	info->regex_flag = regex_flag;
+	info->replacements = replacements;
+	info->num_replacements = num_replacements;
+}
+
+
+// A rule to be compiled by _ua_parser_compile_rules(), and how that went
+struct ua_compile_item {
+	struct ua_parser_group *group;
+	uint32_t index;
+	const char *error;
+	int erroffset;
+};
+
+
+// Shared by the threads of _ua_parser_compile_rules()
+struct ua_compile_job {
+	struct uap_parser *ua_parser;
+	struct ua_compile_item *items;
+	uint32_t num_items;
+	uint32_t next_item; // claimed atomically
+};
+
+
+// Compile and study a rule's expression. Each rule is only touched by one
+// thread, and PCRE itself is safe to use from several at once.
+static void _ua_rule_compile(struct uap_parser *ua_parser, struct ua_compile_item *item) {
+	struct ua_rule *rule = &item->group->rules[item->index];
+	struct ua_rule_info *info = &item->group->rule_info[item->index];
+
+	const int options = 0
+		| PCRE_UTF8
+		| PCRE_EXTRA
+		| (info->regex_flag == 'i' ? PCRE_CASELESS : 0)
+		;
+
+	rule->regex = pcre_compile(
+			_ua_regex_skip_lazy_prefix(unique_strings_get(&info->source)),
+			options,
+			&item->error,     // error message
+			&item->erroffset, // error offset
+			NULL);            // use default character tables
+
+	if (rule->regex == NULL) {
+		return;
+	}
+
+	const int study_options = (ua_parser->flags & UAP_PARSER_JIT) ? PCRE_STUDY_JIT_COMPILE : 0;
+	const char *error;
+
+	rule->pcre_extra = pcre_study(rule->regex, study_options, &error);
+	_ua_rule_check_jit(ua_parser, rule, info);
+}
+
+
+static void *_ua_compile_worker_run(void *ptr) {
+	struct ua_compile_job *job = ptr;
+
+	for (;;) {
+		const uint32_t i = __atomic_fetch_add(&job->next_item, 1, __ATOMIC_RELAXED);
+		if (i >= job->num_items) {
+			return NULL;
+		}
+		_ua_rule_compile(job->ua_parser, &job->items[i]);
+	}
+}
+
+
+// The number of threads to compile `num_items` rules with.
+static unsigned int _ua_parser_compile_threads(const struct uap_parser *ua_parser, uint32_t num_items) {
+	unsigned int num_threads = ua_parser->compile_threads;
+	if (num_threads == 0) {
+		const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = num_cpus > 0 ? num_cpus : 1;
+	}
+	if (num_threads > COMPILE_MAX_THREADS) {
+		num_threads = COMPILE_MAX_THREADS;
+	}
+	if (num_threads > num_items / COMPILE_MIN_RULES_PER_THREAD) {
+		num_threads = num_items / COMPILE_MIN_RULES_PER_THREAD > 0 ? num_items / COMPILE_MIN_RULES_PER_THREAD : 1;
+	}
+	return num_threads;
+}
+
+
+// Compile every rule added since the last call across up to
+// `compile_threads` threads, the calling one included. Afterwards, in rule
+// order, expressions which didn't compile are reported and dropped, and the
+// rest are given their rule ids and handed to the prefilter, so the outcome
+// doesn't depend on which thread compiled what.
+static void _ua_parser_compile_rules(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	uint32_t num_rules = 0;
+	for (int g = 0; g < 3; g++) {
+		num_rules += groups[g]->num_rules;
+	}
+
+	struct ua_compile_job job = {
+		.ua_parser = ua_parser,
+		.items     = calloc(num_rules ? num_rules : 1, sizeof(struct ua_compile_item)),
+		.num_items = 0,
+		.next_item = 0,
+	};
+	assert(job.items);
+
+	for (int g = 0; g < 3; g++) {
+		for (uint32_t i = 0; i < groups[g]->num_rules; i++) {
+			if (groups[g]->rules[i].regex == NULL) {
+				job.items[job.num_items].group = groups[g];
+				job.items[job.num_items].index = i;
+				job.num_items++;
+			}
+		}
+	}
+
+	const unsigned int num_threads = _ua_parser_compile_threads(ua_parser, job.num_items);
+	pthread_t threads[COMPILE_MAX_THREADS];
+	bool started[COMPILE_MAX_THREADS];
+	for (unsigned int t = 1; t < num_threads; t++) {
+		started[t] = pthread_create(&threads[t], NULL, &_ua_compile_worker_run, &job) == 0;
+	}
+
+	_ua_compile_worker_run(&job);
+
+	unsigned int threads_used = 1;
+	for (unsigned int t = 1; t < num_threads; t++) {
+		if (started[t]) {
+			pthread_join(threads[t], NULL);
+			threads_used++;
+		}
+	}
+	ua_parser->load_stats.compile_threads = threads_used;
+
+	// Drop the expressions which failed. Their replacement records are left
+	// in the group's buffer, unreferenced.
+	const struct ua_compile_item *item = job.items;
+	const struct ua_compile_item *items_end = job.items + job.num_items;
+
+	for (int g = 0; g < 3; g++) {
+		struct ua_parser_group *group = groups[g];
+		uint32_t kept = 0;
+
+		for (uint32_t i = 0; i < group->num_rules; i++) {
+			struct ua_rule *rule = &group->rules[i];
+			struct ua_rule_info *info = &group->rule_info[i];
+
+			if (item != items_end && item->group == group && item->index == i) {
+				if (rule->regex == NULL) {
+					printf("pcre error: %d %s\n", item->erroffset, item->error);
+					ua_parser->load_stats.failed_rules++;
+					item++;
+					continue;
+				}
+
+				const char *source = unique_strings_get(&info->source);
+				rule->rule_id = ua_parser->num_rules++;
+				prefilter_add_regex(ua_parser->prefilter, rule->rule_id, source, info->regex_flag == 'i');
+				item++;
+			}
+
+			group->rules[kept] = *rule;
+			group->rule_info[kept] = *info;
+			kept++;
+		}
+
+		group->num_rules = kept;
+	}
+
+	free(job.items);
+}
+
+
+static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_parser_t *yaml_parser) {
+	// Structure to retain the active parsing state
+	struct {
+		enum {
+			UNKNOWN,
+			REGEX, // regex
+			REPLACEMENT,
+			PARSER, // user_agent_parsers, os_parsers, device_parsers
+			REGEX_FLAG,
+		} key_type;
+
+		enum {
+			KEY,
+			VALUE,
+		} scalar_type;
+
+		enum ua_replacement_type current_replacement_type;
+		struct ua_parser_group *current_parser_group;
+		enum ua_parser_type current_parser_type;
+
+		// The item being parsed, and its replacements so far, which are
+		// appended to the current group as they're found
+		bool in_item;
+		size_t item_replacements;
+		uint32_t item_num_replacements;
+
+		char *regex_temp;
+		size_t regex_temp_size;
+		char regex_flag;
 
 	} state = {
 		.key_type                       = UNKNOWN,
@@ -570,8 +1379,9 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 		.current_replacement_type       = UNKNOWN,
 		.current_parser_group           = NULL,
 		.current_parser_type            = PARSER_TYPE_UNKNOWN,
-		.current_expression_pair_insert = NULL,
-		.new_expression_pair            = NULL,
+		.in_item                        = false,
+		.item_replacements              = 0,
+		.item_num_replacements          = 0,
 		.regex_temp                     = NULL,
 		.regex_temp_size                = 0,
 		.regex_flag                     = '\0',
@@ -595,59 +1405,19 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 			} break;
 
 			case YAML_BLOCK_END_TOKEN: {
-				if (state.new_expression_pair && state.regex_temp) {
-					struct ua_expression_pair *new_pair = state.new_expression_pair;
-					state.new_expression_pair = NULL;
+				if (state.in_item && state.regex_temp && state.current_parser_group) {
+					state.in_item = false;
 
 					//##################################
 					// Commit the active item if present
 					//##################################
-					if (new_pair != NULL && state.regex_temp) {
-						const char *error;
-						int erroffset;
-
-						const int options = 0
-							| PCRE_UTF8
-							| PCRE_EXTRA
-							| (state.regex_flag == 'i' ? PCRE_CASELESS : 0)
-							;
-
-						// Compile the expression (handled here
-						pcre *re = pcre_compile(
-								state.regex_temp,
-								options,     // options - @toto handle regex_flag
-								&error,      // error message
-								&erroffset,  // error offset
-								NULL);       // use default character tables
-
-						// If the expression compiled successfully, attach it to
-						// the new expression_pair, otherwise free the new pair and continue
-						if (re) {
-							new_pair->regex = re;
-							new_pair->pcre_extra = pcre_study(re, 0, &error);
-							state.regex_flag = '\0';
-						} else {
-							printf("pcre error: %d %s\n", erroffset, error);
-							ua_expression_pair_destroy(new_pair);
-							break;
-						}
-
-						int i = 0;
-						struct ua_replacement *repl = new_pair->replacements;
-						while (repl) {
-							i++;
-							repl = repl->next;
-						}
-
-						if (state.current_expression_pair_insert) {
-							*state.current_expression_pair_insert  = new_pair;
-							state.current_expression_pair_insert   = &(new_pair->next);
-						} else {
-							ua_expression_pair_destroy(new_pair);
-						}
-
-					}
-					new_pair = NULL;
+					struct ua_parser_group *group = state.current_parser_group;
+					struct unique_string_handle_t source = unique_strings_add(ua_parser->strings, state.regex_temp);
+					_ua_parser_add_expression(group, source, state.regex_flag,
+							state.item_num_replacements ? state.item_replacements : group->replacements_size,
+							state.item_num_replacements);
+					state.item_num_replacements = 0;
+					state.regex_flag = '\0';
 				}
 			} break;
 
@@ -733,9 +1503,6 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 
 							assert(state.current_parser_group);
 
-							// Switch to the new parser group's expression list
-							state.current_expression_pair_insert = &(state.current_parser_group->expression_pairs);
-
 						} else if (strcmp(value, "regex_flag") == 0) {
 							state.key_type = REGEX_FLAG;
 
@@ -746,10 +1513,7 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 						break;
 
 					case VALUE:
-						// Ensure we have somewhere to put the parsed data
-						if (state.new_expression_pair == NULL) {
-							state.new_expression_pair = calloc(1, sizeof(struct ua_expression_pair));
-						}
+						state.in_item = true;
 
 						switch (state.key_type) {
 
@@ -771,15 +1535,17 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 							} break;
 
 							case REPLACEMENT: {
-								// Create a new ua_replacement
-								struct ua_replacement *repl = malloc(sizeof(struct ua_replacement));
-								repl->value = unique_strings_add(ua_parser->strings, value);
-								repl->has_placeholders = strstr(unique_strings_get(&repl->value), "$") != NULL;
-								repl->type = state.current_replacement_type;
-
-								// Append the new ua_replacement to the current new_expression_pair
-								repl->next = state.new_expression_pair->replacements;
-								state.new_expression_pair->replacements = repl;
+								struct ua_parser_group *group = state.current_parser_group;
+								if (group == NULL) {
+									break;
+								}
+
+								// The item's replacements are contiguous, so only the first is noted
+								if (state.item_num_replacements++ == 0) {
+									state.item_replacements = group->replacements_size;
+								}
+								ua_parser_group_add_replacement(group, value, unique_strings_add(ua_parser->strings, value),
+										state.current_replacement_type);
 							} break;
 
 
@@ -796,9 +1562,9 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 
 	} while (token.type != YAML_STREAM_END_TOKEN);
 
-	if (state.new_expression_pair) {
-		ua_expression_pair_destroy(state.new_expression_pair);
-		state.new_expression_pair = NULL;
+	// Drop the replacements of an item which was never finished
+	if (state.item_num_replacements && state.current_parser_group) {
+		state.current_parser_group->replacements_size = state.item_replacements;
 	}
 
 	free(state.regex_temp);
@@ -806,6 +1572,104 @@ static void _user_agent_parser_parse_yaml(struct uap_parser *ua_parser, yaml_par
 }
 
 
+// Record what PCRE's study worked out about each of the group's rules, the
+// shortest subject they can match and which bytes a match may begin with, so
+// ua_parser_group_exec() can rule them out without calling pcre_exec().
+static void ua_parser_group_index_rules(struct ua_parser_group *group) {
+	free(group->first_bytes);
+	group->first_bytes = NULL;
+	group->num_first_bytes = 0;
+
+	if (group->num_rules > 0) {
+		group->first_bytes = malloc(group->num_rules * sizeof(group->first_bytes[0]));
+	}
+
+	for (uint32_t i = 0; i < group->num_rules; i++) {
+		struct ua_rule *rule = &group->rules[i];
+		rule->min_length = 0;
+		rule->first_bytes = RULE_ANY_FIRST_BYTE;
+
+		int min_length = -1;
+		if (pcre_fullinfo(rule->regex, rule->pcre_extra, PCRE_INFO_MINLENGTH, &min_length) == 0 && min_length > 0) {
+			rule->min_length = (uint32_t)min_length;
+		}
+
+		// Only the study's table of starting bytes is used. The single first
+		// character PCRE reports otherwise doesn't say if it's caseless.
+		const unsigned char *table = NULL;
+		if (group->first_bytes == NULL
+				|| pcre_fullinfo(rule->regex, rule->pcre_extra, PCRE_INFO_FIRSTTABLE, &table) != 0
+				|| table == NULL) {
+			continue;
+		}
+
+		uint64_t *set = group->first_bytes[group->num_first_bytes];
+		memset(set, 0, sizeof(group->first_bytes[0]));
+		for (int c = 0; c < 256; c++) {
+			if (table[c / 8] & (1 << (c % 8))) {
+				set[c >> 6] |= UINT64_C(1) << (c & 63);
+			}
+		}
+		rule->first_bytes = group->num_first_bytes++;
+	}
+}
+
+
+// Called through _ua_parser_freeze_groups() by every loader once all rules
+// are in. Trims the group's arrays, indexes its rules and covers its
+// expressions with a rule_dfa. Building one only takes parsing the
+// expressions again, so it's redone here rather than being stored in
+// snapshots.
+static void *_ua_parser_group_freeze(void *ptr) {
+	struct ua_parser_group *group = ptr;
+	ua_parser_group_shrink(group);
+	ua_parser_group_index_rules(group);
+
+	struct rule_dfa_t *dfa = rule_dfa_create();
+	if (dfa == NULL) {
+		return NULL;
+	}
+
+	for (uint32_t i = 0; i < group->num_rules; i++) {
+		struct ua_rule *rule = &group->rules[i];
+		unsigned long options = 0;
+		pcre_fullinfo(rule->regex, rule->pcre_extra, PCRE_INFO_OPTIONS, &options);
+		rule->in_dfa = rule_dfa_add_regex(dfa, rule->rule_id, unique_strings_get(&group->rule_info[i].source), (options & PCRE_CASELESS) != 0);
+	}
+
+	rule_dfa_compile(dfa);
+	group->dfa = dfa;
+	return NULL;
+}
+
+
+// Groups share nothing while being frozen, so with more than one compile
+// thread each group's DFA is built on its own thread.
+static void _ua_parser_freeze_groups(struct uap_parser *ua_parser) {
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	const bool threaded = _ua_parser_compile_threads(ua_parser, UINT32_MAX) > 1;
+	pthread_t threads[3];
+	bool started[3] = { false, false, false };
+
+	for (int g = 1; g < 3 && threaded; g++) {
+		started[g] = pthread_create(&threads[g], NULL, &_ua_parser_group_freeze, groups[g]) == 0;
+	}
+
+	for (int g = 0; g < 3; g++) {
+		if (started[g]) {
+			pthread_join(threads[g], NULL);
+		} else {
+			_ua_parser_group_freeze(groups[g]);
+		}
+	}
+}
+
+
 static void _user_agent_parser_init(struct uap_parser *ua_parser, yaml_parser_t *parser) {
 	// Create unique_strings_t for string deduping/packing of replacement strings
 	ua_parser->strings = unique_strings_create();
@@ -814,6 +1678,10 @@ static void _user_agent_parser_init(struct uap_parser *ua_parser, yaml_parser_t
 	// add "Other" as a unique string and grab a handle for possible later user.
 	ua_parser->string_handle_other = unique_strings_add(ua_parser->strings, "Other");
 
+	// Literal prefilter shared by all parser groups
+	ua_parser->prefilter = prefilter_create();
+
+	const uint64_t start_time = _ua_clock_ns();
 	_user_agent_parser_parse_yaml(ua_parser, parser);
 
 	// Free the YAML parser
@@ -821,6 +1689,492 @@ static void _user_agent_parser_init(struct uap_parser *ua_parser, yaml_parser_t
 
 	// Free look-up structures and shrink allocated space if necessary
 	unique_strings_freeze(ua_parser->strings);
+
+	const uint64_t compile_time = _ua_clock_ns();
+	_ua_parser_compile_rules(ua_parser);
+
+	// Build the automaton for all of the collected literals
+	const uint64_t index_time = _ua_clock_ns();
+	prefilter_compile(ua_parser->prefilter);
+
+	_ua_parser_freeze_groups(ua_parser);
+
+	ua_parser->load_stats.read_ns    = compile_time - start_time;
+	ua_parser->load_stats.compile_ns = index_time - compile_time;
+	ua_parser->load_stats.index_ns   = _ua_clock_ns() - index_time;
+}
+
+
+///##################
+//# Compiled snapshots
+///##################
+
+#define SNAPSHOT_MAGIC "UAPSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_ALIGN 8
+#define SNAPSHOT_ALIGNED(_size) (((_size) + (SNAPSHOT_ALIGN - 1)) & ~(size_t)(SNAPSHOT_ALIGN - 1))
+#define SNAPSHOT_SEED 0x5bd1e995
+#define SNAPSHOT_CHECKSUM_CHUNK (1 << 30) // hash_murmur2() takes an int length
+
+// PCRE reads the magic number, size, options and flags of a compiled pattern
+// before anything else, and the size of study data first
+#define SNAPSHOT_MIN_REGEX_SIZE (4 * sizeof(uint32_t))
+#define SNAPSHOT_MIN_STUDY_SIZE sizeof(uint32_t)
+
+
+// A snapshot is this header followed by the sections it points to, each
+// aligned to SNAPSHOT_ALIGN bytes so they can be used in place once mapped.
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	char pcre_version[64];      // compiled patterns are specific to a PCRE build
+	uint32_t num_rules;
+	uint32_t group_sizes[3];    // user_agent, os, device
+	uint64_t string_other;      // handle address of "Other"
+	uint64_t strings_offset;    // unique_strings data
+	uint64_t strings_size;
+	uint64_t rules_offset;      // num_rules snapshot_rule records
+	uint64_t replacements_offset;
+	uint64_t replacements_size;
+	uint64_t patterns_offset;   // compiled patterns and study data
+	uint64_t patterns_size;
+	uint64_t prefilter_offset;
+	uint64_t prefilter_size;
+	uint64_t file_size;
+	uint32_t checksum;          // of everything following the header
+	uint32_t reserved;
+};
+
+
+struct snapshot_rule {
+	uint32_t rule_id;
+	uint32_t num_replacements;
+	uint64_t source;            // handle address of the expression text
+	uint64_t regex_offset;      // relative to patterns_offset
+	uint64_t regex_size;
+	uint64_t study_offset;      // relative to patterns_offset
+	uint64_t study_size;        // 0 if there is no study data
+	uint64_t replacements;      // relative to replacements_offset
+};
+
+
+// Followed by `num_tokens` ua_template_token, padded to SNAPSHOT_ALIGN.
+struct snapshot_replacement {
+	uint32_t type;
+	uint32_t value_length;
+	uint64_t value;             // handle address
+	uint32_t num_tokens;
+	uint32_t reserved;
+};
+
+
+// Hash `size` bytes of `data`, in pieces that hash_murmur2() can take.
+static uint32_t _snapshot_checksum(const char *data, size_t size) {
+	uint32_t hash = SNAPSHOT_SEED;
+	for (size_t offset = 0; offset < size; offset += SNAPSHOT_CHECKSUM_CHUNK) {
+		const size_t length = size - offset < SNAPSHOT_CHECKSUM_CHUNK ? size - offset : SNAPSHOT_CHECKSUM_CHUNK;
+		hash = hash_murmur2(data + offset, (int)length, hash);
+	}
+	return hash;
+}
+
+
+struct snapshot_buffer {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+
+// Append `size` bytes, padded to SNAPSHOT_ALIGN, returning their offset.
+static size_t _snapshot_append(struct snapshot_buffer *buffer, const void *data, size_t size) {
+	const size_t offset = buffer->size;
+	const size_t padded = SNAPSHOT_ALIGNED(size);
+
+	if (buffer->size + padded > buffer->capacity) {
+		buffer->capacity = (buffer->size + padded) * 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+
+	if (size > 0) {
+		memcpy(&buffer->data[offset], data, size);
+	}
+	memset(&buffer->data[offset + size], 0, padded - size);
+	buffer->size += padded;
+
+	return offset;
+}
+
+
+int uap_parser_save_snapshot(const struct uap_parser *ua_parser, FILE *fd) {
+	if (ua_parser->strings == NULL || ua_parser->prefilter == NULL) {
+		return 0;
+	}
+
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	struct snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	strncpy(header.pcre_version, pcre_version(), sizeof(header.pcre_version) - 1);
+	header.num_rules = ua_parser->num_rules;
+	header.string_other = ua_parser->string_handle_other.addr;
+
+	struct snapshot_buffer rules = { NULL, 0, 0 };
+	struct snapshot_buffer replacements = { NULL, 0, 0 };
+	struct snapshot_buffer patterns = { NULL, 0, 0 };
+
+	for (int g = 0; g < 3; g++) {
+		const struct ua_parser_group *group = groups[g];
+
+		for (uint32_t i = 0; i < group->num_rules; i++) {
+			const struct ua_rule *group_rule = &group->rules[i];
+			const struct ua_rule_info *info = &group->rule_info[i];
+			struct snapshot_rule rule;
+			memset(&rule, 0, sizeof(rule));
+			rule.rule_id = group_rule->rule_id;
+			rule.source = info->source.addr;
+
+			size_t regex_size = 0;
+			pcre_fullinfo(group_rule->regex, NULL, PCRE_INFO_SIZE, &regex_size);
+			rule.regex_size = regex_size;
+			rule.regex_offset = _snapshot_append(&patterns, group_rule->regex, regex_size);
+
+			if (group_rule->pcre_extra && (group_rule->pcre_extra->flags & PCRE_EXTRA_STUDY_DATA)) {
+				size_t study_size = 0;
+				pcre_fullinfo(group_rule->regex, group_rule->pcre_extra, PCRE_INFO_STUDYSIZE, &study_size);
+				if (study_size > 0) {
+					rule.study_size = study_size;
+					rule.study_offset = _snapshot_append(&patterns, group_rule->pcre_extra->study_data, study_size);
+				}
+			}
+
+			rule.replacements = replacements.size;
+			const struct ua_replacement *repl = (const struct ua_replacement*)&group->replacements[info->replacements];
+			for (uint32_t r = 0; r < info->num_replacements; r++, repl = _ua_replacement_next(repl)) {
+				struct snapshot_replacement record = {
+					.type         = repl->type,
+					.value_length = repl->value_length,
+					.value        = repl->value.addr,
+					.num_tokens   = repl->num_tokens,
+					.reserved     = 0,
+				};
+				_snapshot_append(&replacements, &record, sizeof(record));
+				_snapshot_append(&replacements, repl->tokens, repl->num_tokens * sizeof(struct ua_template_token));
+				rule.num_replacements++;
+			}
+
+			_snapshot_append(&rules, &rule, sizeof(rule));
+			header.group_sizes[g]++;
+		}
+	}
+
+	size_t strings_size;
+	const char *strings = unique_strings_data(ua_parser->strings, &strings_size);
+	const size_t prefilter_size = prefilter_serialized_size(ua_parser->prefilter);
+	struct snapshot_buffer prefilter = { NULL, SNAPSHOT_ALIGNED(prefilter_size), SNAPSHOT_ALIGNED(prefilter_size) };
+	prefilter.data = calloc(1, prefilter.capacity);
+	prefilter_serialize(ua_parser->prefilter, prefilter.data);
+
+	// Lay the sections out one after another
+	size_t offset = SNAPSHOT_ALIGNED(sizeof(header));
+	header.strings_offset      = offset;
+	header.strings_size        = strings_size;
+	offset += SNAPSHOT_ALIGNED(strings_size);
+	header.rules_offset        = offset;
+	offset += rules.size;
+	header.replacements_offset = offset;
+	header.replacements_size   = replacements.size;
+	offset += replacements.size;
+	header.patterns_offset     = offset;
+	header.patterns_size       = patterns.size;
+	offset += patterns.size;
+	header.prefilter_offset    = offset;
+	header.prefilter_size      = prefilter_size;
+	offset += prefilter.size;
+	header.file_size           = offset;
+
+	struct snapshot_buffer out = { NULL, 0, 0 };
+	_snapshot_append(&out, &header, sizeof(header));
+	_snapshot_append(&out, strings, strings_size);
+	_snapshot_append(&out, rules.data, rules.size);
+	_snapshot_append(&out, replacements.data, replacements.size);
+	_snapshot_append(&out, patterns.data, patterns.size);
+	_snapshot_append(&out, prefilter.data, prefilter.size);
+
+	const size_t payload_offset = SNAPSHOT_ALIGNED(sizeof(header));
+	header.checksum = _snapshot_checksum(&out.data[payload_offset], out.size - payload_offset);
+	memcpy(out.data, &header, sizeof(header));
+
+	const int success = out.size == header.file_size && fwrite(out.data, 1, out.size, fd) == out.size;
+
+	free(out.data);
+	free(prefilter.data);
+	free(rules.data);
+	free(replacements.data);
+	free(patterns.data);
+
+	return success;
+}
+
+
+static bool _snapshot_section_valid(const struct snapshot_header *header, uint64_t offset, uint64_t size) {
+	return offset % SNAPSHOT_ALIGN == 0 && offset <= header->file_size && size <= header->file_size - offset;
+}
+
+
+static bool _snapshot_header_valid(const struct snapshot_header *header, size_t size) {
+	return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+		&& header->version == SNAPSHOT_VERSION
+		&& header->byte_order == SNAPSHOT_BYTE_ORDER
+		&& strncmp(header->pcre_version, pcre_version(), sizeof(header->pcre_version)) == 0
+		&& header->file_size == size
+		&& (uint64_t)header->group_sizes[0] + header->group_sizes[1] + header->group_sizes[2] == header->num_rules
+		&& _snapshot_section_valid(header, header->strings_offset, header->strings_size)
+		&& _snapshot_section_valid(header, header->rules_offset, (uint64_t)header->num_rules * sizeof(struct snapshot_rule))
+		&& _snapshot_section_valid(header, header->replacements_offset, header->replacements_size)
+		&& _snapshot_section_valid(header, header->patterns_offset, header->patterns_size)
+		&& _snapshot_section_valid(header, header->prefilter_offset, header->prefilter_size)
+		&& header->string_other < header->strings_size;
+}
+
+
+// Damage anywhere past the header shows up as a different checksum.
+static bool _snapshot_payload_valid(const struct snapshot_header *header, const char *base) {
+	const size_t payload_offset = SNAPSHOT_ALIGNED(sizeof(struct snapshot_header));
+	return header->file_size >= payload_offset
+		&& _snapshot_checksum(base + payload_offset, header->file_size - payload_offset) == header->checksum;
+}
+
+
+// Every string is read up to its null terminator, so the last one must have one.
+static bool _snapshot_strings_valid(const struct snapshot_header *header, const char *base) {
+	return header->strings_size > 0 && base[header->strings_offset + header->strings_size - 1] == '\0';
+}
+
+
+// A replacement must name one of its group's `num_fields` fields, and its
+// literal tokens must lie within its value.
+static bool _snapshot_replacement_valid(
+		const struct snapshot_header *header,
+		const struct snapshot_replacement *record,
+		const struct ua_template_token *tokens,
+		uint32_t num_fields)
+{
+	if (record->type >= num_fields
+			|| record->value >= header->strings_size
+			|| record->value_length > header->strings_size - record->value)
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < record->num_tokens; i++) {
+		if (tokens[i].capture == 0 && (uint64_t)tokens[i].offset + tokens[i].length > record->value_length) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Rebuild a rule around the snapshot data, appending it to `group`, which has
+// `num_fields` fields. Returns false if the record doesn't fit within the
+// snapshot.
+static bool _snapshot_load_rule(
+		struct uap_parser *ua_parser,
+		struct ua_parser_group *group,
+		uint32_t num_fields,
+		const struct snapshot_header *header,
+		const char *base,
+		const struct snapshot_rule *record)
+{
+	if (record->rule_id >= header->num_rules
+			|| record->source >= header->strings_size
+			|| record->regex_offset % SNAPSHOT_ALIGN != 0
+			|| record->regex_offset > header->patterns_size
+			|| record->regex_size > header->patterns_size - record->regex_offset
+			|| record->study_offset % SNAPSHOT_ALIGN != 0
+			|| record->study_offset > header->patterns_size
+			|| record->study_size > header->patterns_size - record->study_offset
+			|| record->regex_size < SNAPSHOT_MIN_REGEX_SIZE
+			|| (record->study_size > 0 && record->study_size < SNAPSHOT_MIN_STUDY_SIZE))
+	{
+		return false;
+	}
+
+	// PCRE trusts the sizes recorded within the pattern and study data, so
+	// they must agree with the record
+	const pcre *regex = (const pcre*)(base + header->patterns_offset + record->regex_offset);
+	size_t regex_size = 0;
+	if (pcre_fullinfo(regex, NULL, PCRE_INFO_SIZE, &regex_size) != 0 || regex_size != record->regex_size) {
+		return false;
+	}
+
+	if (record->study_size > 0) {
+		pcre_extra study = {
+			.flags      = PCRE_EXTRA_STUDY_DATA,
+			.study_data = (void*)(base + header->patterns_offset + record->study_offset),
+		};
+		size_t study_size = 0;
+		if (pcre_fullinfo(regex, &study, PCRE_INFO_STUDYSIZE, &study_size) != 0 || study_size != record->study_size) {
+			return false;
+		}
+	}
+
+	// Replacements are restored in their original order
+	const size_t first_replacement = group->replacements_size;
+	uint64_t offset = record->replacements;
+
+	for (uint32_t i = 0; i < record->num_replacements; i++) {
+		struct snapshot_replacement repl_record;
+		if (offset > header->replacements_size || sizeof(repl_record) > header->replacements_size - offset) {
+			group->replacements_size = first_replacement;
+			return false;
+		}
+		memcpy(&repl_record, base + header->replacements_offset + offset, sizeof(repl_record));
+		offset += sizeof(repl_record);
+
+		const uint64_t tokens_size = (uint64_t)repl_record.num_tokens * sizeof(struct ua_template_token);
+		const struct ua_template_token *tokens = (const struct ua_template_token*)(base + header->replacements_offset + offset);
+		if (tokens_size > header->replacements_size - offset
+				|| !_snapshot_replacement_valid(header, &repl_record, tokens, num_fields))
+		{
+			group->replacements_size = first_replacement;
+			return false;
+		}
+
+		const size_t repl_offset = ua_parser_group_append_replacement(group, repl_record.num_tokens);
+		struct ua_replacement *repl = (struct ua_replacement*)&group->replacements[repl_offset];
+		repl->type = repl_record.type;
+		repl->value = unique_strings_handle(ua_parser->strings, repl_record.value);
+		repl->value_length = repl_record.value_length;
+		memcpy(repl->tokens, base + header->replacements_offset + offset, tokens_size);
+		offset += SNAPSHOT_ALIGNED(tokens_size);
+	}
+
+	const uint32_t index = ua_parser_group_append_rule(group);
+	struct ua_rule *rule = &group->rules[index];
+	struct ua_rule_info *info = &group->rule_info[index];
+
+	rule->rule_id = record->rule_id;
+	rule->regex = (pcre*)(base + header->patterns_offset + record->regex_offset);
+	info->borrowed_regex = true;
+	info->source = unique_strings_handle(ua_parser->strings, record->source);
+	info->replacements = first_replacement;
+	info->num_replacements = record->num_replacements;
+
+	if (ua_parser->flags & UAP_PARSER_JIT) {
+		// JIT compiled code can't be stored, so the expression is studied again
+		const char *error;
+		rule->pcre_extra = pcre_study(rule->regex, PCRE_STUDY_JIT_COMPILE, &error);
+		_ua_rule_check_jit(ua_parser, rule, info);
+	} else if (record->study_size > 0) {
+		rule->pcre_extra = calloc(1, sizeof(pcre_extra));
+		rule->pcre_extra->flags = PCRE_EXTRA_STUDY_DATA;
+		rule->pcre_extra->study_data = (void*)(base + header->patterns_offset + record->study_offset);
+		info->borrowed_extra = true;
+	}
+
+	return true;
+}
+
+
+int uap_parser_load_snapshot_buffer(struct uap_parser *ua_parser, const void *buffer, size_t size) {
+	struct snapshot_header header;
+
+	// Only a freshly created parser can be loaded, and the data is used in place
+	if (ua_parser->strings != NULL || size < sizeof(header) || ((uintptr_t)buffer % SNAPSHOT_ALIGN) != 0) {
+		return 0;
+	}
+
+	memcpy(&header, buffer, sizeof(header));
+	const char *base = buffer;
+	if (!_snapshot_header_valid(&header, size)
+			|| !_snapshot_payload_valid(&header, base)
+			|| !_snapshot_strings_valid(&header, base)) {
+		return 0;
+	}
+
+	struct prefilter_t *prefilter = prefilter_deserialize(base + header.prefilter_offset, header.prefilter_size);
+	if (prefilter == NULL || prefilter_candidates_size(prefilter) * 64 < header.num_rules) {
+		prefilter_destroy(prefilter);
+		return 0;
+	}
+
+	ua_parser->prefilter = prefilter;
+	ua_parser->strings = unique_strings_create_static(base + header.strings_offset, header.strings_size);
+	ua_parser->string_handle_other = unique_strings_handle(ua_parser->strings, header.string_other);
+	ua_parser->num_rules = header.num_rules;
+	ua_parser->snapshot.data = buffer;
+	ua_parser->snapshot.size = size;
+
+	const struct snapshot_rule *rules = (const struct snapshot_rule*)(base + header.rules_offset);
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+	const uint32_t group_fields[] = { 4, 5, 3 };
+
+	for (int g = 0; g < 3; g++) {
+		for (uint32_t i = 0; i < header.group_sizes[g]; i++) {
+			if (!_snapshot_load_rule(ua_parser, groups[g], group_fields[g], &header, base, rules++)) {
+				// Leave the parser empty, but still destroyable
+				for (int j = 0; j < 3; j++) {
+					ua_parser_group_clear(groups[j]);
+				}
+				unique_strings_destroy(ua_parser->strings);
+				prefilter_destroy(ua_parser->prefilter);
+				ua_parser->strings = NULL;
+				ua_parser->prefilter = NULL;
+				ua_parser->num_rules = 0;
+				ua_parser->snapshot.data = NULL;
+				ua_parser->snapshot.size = 0;
+				return 0;
+			}
+		}
+	}
+
+	_ua_parser_freeze_groups(ua_parser);
+
+	return 1;
+}
+
+
+int uap_parser_load_snapshot(struct uap_parser *ua_parser, const char *path) {
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return 0;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	if (!uap_parser_load_snapshot_buffer(ua_parser, data, st.st_size)) {
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	ua_parser->snapshot.mapped = true;
+	return 1;
 }
 
 
@@ -853,41 +2207,727 @@ int uap_parser_read_buffer(struct uap_parser *ua_parser, const unsigned char *bu
 }
 
 
-int uap_parser_parse_string(const struct uap_parser *ua_parser, struct uap_useragent_info *info, const char* user_agent_string) {
-	struct ua_parse_state state;
-	memset(&state, 0, sizeof(struct ua_parse_state));
+int uap_parser_read_builtin(struct uap_parser *ua_parser) {
+	const struct builtin_ruleset *ruleset = &builtin_ruleset;
+
+	// Only a freshly created parser can be loaded
+	if (ua_parser->strings != NULL) {
+		return 0;
+	}
+
+	// The generated string pool is already de-duped and packed, so it's used
+	// in place rather than being added string by string.
+	ua_parser->strings = unique_strings_create_static(ruleset->strings, ruleset->strings_size);
+	ua_parser->string_handle_other = unique_strings_handle(ua_parser->strings, ruleset->string_other);
+	ua_parser->prefilter = prefilter_create();
+
+	struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	const uint64_t start_time = _ua_clock_ns();
+
+	for (uint32_t i = 0; i < ruleset->num_rules; i++) {
+		const struct builtin_rule *rule = &ruleset->rules[i];
+		struct ua_parser_group *group = groups[rule->group];
+		const size_t first_replacement = group->replacements_size;
+
+		for (uint32_t r = 0; r < rule->num_replacements; r++) {
+			const struct builtin_replacement *builtin_repl = &ruleset->replacements[rule->first_replacement + r];
+			ua_parser_group_add_replacement(group,
+					&ruleset->strings[builtin_repl->value],
+					unique_strings_handle(ua_parser->strings, builtin_repl->value),
+					(enum ua_replacement_type)builtin_repl->field);
+		}
+
+		_ua_parser_add_expression(group,
+				unique_strings_handle(ua_parser->strings, rule->regex),
+				rule->regex_flag,
+				first_replacement,
+				rule->num_replacements);
+	}
+
+	const uint64_t compile_time = _ua_clock_ns();
+	_ua_parser_compile_rules(ua_parser);
+
+	const uint64_t index_time = _ua_clock_ns();
+	prefilter_compile(ua_parser->prefilter);
+	_ua_parser_freeze_groups(ua_parser);
+
+	// Start each group's DFA from the states compiled into the library. They
+	// are skipped if any expression failed to compile here, as the DFA then
+	// covers different rules than the one they were generated from.
+	for (int g = 0; g < 3; g++) {
+		if (groups[g]->dfa) {
+			rule_dfa_attach_table(groups[g]->dfa, builtin_matchers[g]);
+		}
+	}
+
+	ua_parser->load_stats.read_ns    = compile_time - start_time;
+	ua_parser->load_stats.compile_ns = index_time - compile_time;
+	ua_parser->load_stats.index_ns   = _ua_clock_ns() - index_time;
+
+	return 1;
+}
+
+
+struct uap_parser *uap_parser_create_builtin() {
+	struct uap_parser *ua_parser = uap_parser_create();
 
-	const int matched_groups = 0
-		+ ua_parser_group_exec(&ua_parser->user_agent_parser_group, &state, user_agent_string, ua_parser->replacement_re)
-		+ ua_parser_group_exec(&ua_parser->os_parser_group, &state, user_agent_string, ua_parser->replacement_re)
-		+ ua_parser_group_exec(&ua_parser->device_parser_group, &state, user_agent_string, ua_parser->replacement_re);
+	if (ua_parser && !uap_parser_read_builtin(ua_parser)) {
+		uap_parser_destroy(ua_parser);
+		return NULL;
+	}
+
+	return ua_parser;
+}
+
+
+static int _uap_parser_parse(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_spans *spans,
+		const char *user_agent_string,
+		const size_t user_agent_length,
+		const unsigned int groups,
+		char *scratch,
+		size_t *scratch_size)
+{
+	const struct uap_parser_limits *limits = &ua_parser->limits;
+
+	// PCRE takes subject lengths as an int
+	if (user_agent_length > INT_MAX || (limits->max_input_length > 0 && user_agent_length > limits->max_input_length)) {
+		return UAP_ERROR_INPUT_TOO_LONG;
+	}
+
+	struct ua_parse_state state = {
+		.spans        = spans,
+		.scratch      = scratch,
+		.scratch_size = *scratch_size,
+		.scratch_used = 0,
+		.limits       = limits,
+		.deadline     = limits->parse_budget_ns > 0 ? _ua_clock_ns() + limits->parse_budget_ns : 0,
+		.status       = 0,
+	};
+	memset(spans, 0, sizeof(struct uap_useragent_spans));
+	spans->rules.user_agent = spans->rules.os = spans->rules.device = -1;
+
+	// Every expression is compiled for UTF-8, so PCRE rejects invalid strings
+	// outright and they can't match anything.
+	uint64_t candidates[prefilter_candidates_size(ua_parser->prefilter)];
+	struct ua_input input = {
+		.str        = user_agent_string,
+		.length     = (int)user_agent_length,
+		.valid_utf8 = _ua_utf8_valid(user_agent_string, user_agent_length),
+		.candidates = candidates,
+		.have_bytes = false,
+	};
+
+	// Scan the string once for the literals required by each expression, so
+	// only expressions that could possibly match are handed to PCRE.
+	if (input.valid_utf8) {
+		prefilter_scan(ua_parser->prefilter, input.str, user_agent_length, candidates);
+	}
+
+	// Groups the caller didn't ask for are skipped entirely
+	const struct {
+		unsigned int mask;
+		const struct ua_parser_group *group;
+		struct uap_span *family;
+		int *matched_rule;
+	} group_order[] = {
+		{ UAP_GROUP_USER_AGENT, &ua_parser->user_agent_parser_group, &spans->user_agent.family, &spans->rules.user_agent },
+		{ UAP_GROUP_OS,         &ua_parser->os_parser_group,         &spans->os.family,         &spans->rules.os },
+		{ UAP_GROUP_DEVICE,     &ua_parser->device_parser_group,     &spans->device.family,     &spans->rules.device },
+	};
+
+	// DFA states are built up lazily by each thread, as are its rule counters
+	struct ua_thread_state *thread_state = ua_thread_state_get(ua_parser);
+	struct ua_rule_counters *counters = NULL;
+
+	if ((ua_parser->flags & UAP_PARSER_STATS) && thread_state && ua_parser->num_rules > 0) {
+		if (thread_state->rule_counters == NULL) {
+			// Published atomically, as uap_parser_rule_stats() may be reading
+			__atomic_store_n(&thread_state->rule_counters, calloc(ua_parser->num_rules, sizeof(struct ua_rule_counters)), __ATOMIC_RELEASE);
+		}
+		counters = thread_state->rule_counters;
+	}
+
+	// Groups which were cut short by a limit aren't given a default family
+	unsigned int completed_groups = 0;
+	int matched_groups = 0;
+
+	for (int i = 0; i < 3 && state.status != UAP_ERROR_TIME_BUDGET; i++) {
+		if ((groups & group_order[i].mask) && !input.valid_utf8) {
+			completed_groups |= group_order[i].mask;
+		} else if (groups & group_order[i].mask) {
+			const int status = state.status;
+			state.status = 0;
+
+			const uint32_t first_rule = ua_parser_group_first_rule(group_order[i].group, thread_state, i, input.str, user_agent_length);
+			matched_groups += ua_parser_group_exec(group_order[i].group, &state, &input, first_rule, counters, group_order[i].matched_rule);
+
+			if (state.status == 0) {
+				completed_groups |= group_order[i].mask;
+				state.status = status;
+			}
+		}
+	}
 
 	// Special case for family, if (null) then set to "Other"
-	const char **family[] = { &state.device.family, &state.os.family, &state.user_agent.family };
 	for (int i = 0; i < 3; i++) {
-		if (*family[i] == NULL) {
-			*family[i] = unique_strings_get(&ua_parser->string_handle_other);
+		struct uap_span *family = group_order[i].family;
+		if ((completed_groups & group_order[i].mask) && family->ptr == NULL) {
+			family->ptr = unique_strings_get(&ua_parser->string_handle_other);
+			family->len = strlen(family->ptr);
+		}
+	}
+
+	*scratch_size = state.scratch_used;
+
+	if (state.scratch_used > state.scratch_size) {
+		return UAP_ERROR_SCRATCH_TOO_SMALL;
+	}
+
+	return state.status ? state.status : matched_groups;
+}
+
+
+int uap_parser_parse_spans(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_spans *spans,
+		const char *user_agent_string,
+		char *scratch,
+		size_t *scratch_size)
+{
+	return _uap_parser_parse(ua_parser, spans, user_agent_string, strlen(user_agent_string), UAP_GROUP_ALL, scratch, scratch_size);
+}
+
+
+int uap_parser_parse_spans_len(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_spans *spans,
+		const char *user_agent_string,
+		size_t user_agent_length,
+		char *scratch,
+		size_t *scratch_size)
+{
+	return _uap_parser_parse(ua_parser, spans, user_agent_string, user_agent_length, UAP_GROUP_ALL, scratch, scratch_size);
+}
+
+
+int uap_parser_parse_spans_groups(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_spans *spans,
+		const char *user_agent_string,
+		size_t user_agent_length,
+		unsigned int groups,
+		char *scratch,
+		size_t *scratch_size)
+{
+	return _uap_parser_parse(ua_parser, spans, user_agent_string, user_agent_length, groups, scratch, scratch_size);
+}
+
+
+int uap_parser_parse_string(const struct uap_parser *ua_parser, struct uap_useragent_info *info, const char* user_agent_string) {
+	return uap_parser_parse_string_len(ua_parser, info, user_agent_string, strlen(user_agent_string));
+}
+
+
+///#####################
+//# Result cache support
+///#####################
+
+// Cached results are stored as this header followed by the info strings, or
+// with interning, by a pointer to each field's interned string.
+struct ua_cached_info_header {
+	int32_t matched_groups;
+	int32_t interned;
+	struct uap_matched_rules rules;
+	uint32_t offsets[UAP_SPAN_FIELD_COUNT]; // of each field in info->strings
+};
+
+
+struct ua_cache_hit {
+	struct uap_useragent_info *info;
+	int matched_groups;
+	bool missed; // the result couldn't be copied out, so it's parsed instead
+};
+
+
+static void _ua_cache_hit_cb(void *ctx, const void *value, size_t value_len) {
+	struct ua_cache_hit *hit = ctx;
+	struct ua_cached_info_header header;
+	memcpy(&header, value, sizeof(header));
+
+	// Like a regular parse, the info is only touched if something matched
+	if (header.matched_groups > 0 && header.interned) {
+		memcpy(hit->info, (const char*)value + sizeof(header), UAP_SPAN_FIELD_COUNT * sizeof(const char*));
+	} else if (header.matched_groups > 0) {
+		const size_t size = value_len - sizeof(header);
+		char *buffer = realloc((void*)hit->info->strings, size);
+		if (buffer == NULL) {
+			hit->missed = true;
+			return;
 		}
+		memcpy(buffer, (const char*)value + sizeof(header), size);
+
+		const char **dst_field = (const char**)hit->info;
+		for (size_t i = 0; i < UAP_SPAN_FIELD_COUNT; i++) {
+			dst_field[i] = &buffer[header.offsets[i]];
+		}
+		hit->info->strings = buffer;
+	}
+
+	hit->matched_groups = header.matched_groups;
+	hit->info->rules = header.rules;
+}
+
+
+static void _ua_cache_store(
+		const struct uap_parser *ua_parser,
+		const char *user_agent_string,
+		size_t user_agent_length,
+		unsigned int groups,
+		const struct uap_useragent_info *info,
+		int matched_groups,
+		size_t strings_size)
+{
+	struct ua_cached_info_header header;
+	memset(&header, 0, sizeof(header));
+	header.matched_groups = matched_groups;
+	header.rules = info->rules;
+
+	// Every field is interned, so the pointers themselves can be stored
+	if (matched_groups > 0 && ua_parser->interner && strings_size == 0) {
+		header.interned = 1;
+		result_cache_insert(ua_parser->cache,
+				user_agent_string, user_agent_length, groups,
+				&header, sizeof(header),
+				info, UAP_SPAN_FIELD_COUNT * sizeof(const char*));
+		return;
 	}
 
 	if (matched_groups > 0) {
-		ua_parse_state_create_useragent_info(info, &state);
+		const char **src_field = (const char**)info;
+		for (size_t i = 0; i < UAP_SPAN_FIELD_COUNT; i++) {
+			const uintptr_t offset = (uintptr_t)src_field[i] - (uintptr_t)info->strings;
+
+			// A mix of interned strings and copies can't be stored as offsets
+			if (offset >= strings_size) {
+				return;
+			}
+			header.offsets[i] = offset;
+		}
+	} else {
+		strings_size = 0;
+	}
+
+	result_cache_insert(ua_parser->cache,
+			user_agent_string, user_agent_length, groups,
+			&header, sizeof(header),
+			info->strings, strings_size);
+}
+
+
+void uap_parser_set_compile_threads(struct uap_parser *ua_parser, unsigned int num_threads) {
+	ua_parser->compile_threads = num_threads;
+}
+
+
+void uap_parser_load_stats(const struct uap_parser *ua_parser, struct uap_load_stats *stats) {
+	*stats = ua_parser->load_stats;
+}
+
+
+void uap_parser_set_limits(struct uap_parser *ua_parser, const struct uap_parser_limits *limits) {
+	if (limits) {
+		ua_parser->limits = *limits;
+	} else {
+		memset(&ua_parser->limits, 0, sizeof(ua_parser->limits));
+	}
+}
+
+
+int uap_parser_set_cache(struct uap_parser *ua_parser, size_t max_memory) {
+	result_cache_destroy(ua_parser->cache);
+	ua_parser->cache = NULL;
+
+	if (max_memory > 0) {
+		ua_parser->cache = result_cache_create(max_memory);
+		return ua_parser->cache != NULL;
+	}
+
+	return 1;
+}
+
+
+// Give the strings which don't depend on the user agent, the empty string,
+// "Other" and the literal replacements of every rule, the first IDs in rule
+// order, so they're the same for every parser with the same rules.
+static void _ua_parser_seed_dictionary(struct uap_parser *ua_parser) {
+	const struct ua_parser_group *groups[] = {
+		&ua_parser->user_agent_parser_group,
+		&ua_parser->os_parser_group,
+		&ua_parser->device_parser_group,
+	};
+
+	string_interner_intern(ua_parser->interner, "", 0, NULL);
+	if (ua_parser->strings) {
+		const char *other = unique_strings_get(&ua_parser->string_handle_other);
+		string_interner_intern(ua_parser->interner, other, strlen(other), NULL);
+	}
+
+	for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+		const struct ua_parser_group *group = groups[g];
+		for (uint32_t i = 0; i < group->num_rules; i++) {
+			const struct ua_rule_info *info = &group->rule_info[i];
+			const struct ua_replacement *repl = (const struct ua_replacement*)&group->replacements[info->replacements];
+
+			for (uint32_t r = 0; r < info->num_replacements; r++, repl = _ua_replacement_next(repl)) {
+				if (repl->num_tokens == 0) {
+					string_interner_intern(ua_parser->interner, unique_strings_get(&repl->value), repl->value_length, NULL);
+				}
+			}
+		}
+	}
+}
+
+
+int uap_parser_set_interning(struct uap_parser *ua_parser, size_t max_memory) {
+	// Earlier results may still point at the interned strings, so the
+	// interner is kept until the parser is destroyed. Cached results are
+	// dropped so that new results only share strings from the new one.
+	if (ua_parser->interner) {
+		struct string_interner_t **retired = realloc(ua_parser->retired_interners,
+				(ua_parser->num_retired_interners + 1) * sizeof(struct string_interner_t*));
+		if (retired == NULL) {
+			return 0;
+		}
+		retired[ua_parser->num_retired_interners++] = ua_parser->interner;
+		ua_parser->retired_interners = retired;
+		ua_parser->interner = NULL;
+
+		if (ua_parser->cache) {
+			result_cache_clear(ua_parser->cache);
+		}
+	}
+
+	if (max_memory > 0) {
+		ua_parser->interner = string_interner_create(max_memory);
+		if (ua_parser->interner == NULL) {
+			return 0;
+		}
+		_ua_parser_seed_dictionary(ua_parser);
+	}
+
+	return 1;
+}
+
+
+uint32_t uap_parser_dictionary_size(const struct uap_parser *ua_parser) {
+	return ua_parser->interner ? string_interner_count(ua_parser->interner) : 0;
+}
+
+
+const char *uap_parser_dictionary_string(const struct uap_parser *ua_parser, uint32_t id, size_t *length) {
+	return ua_parser->interner ? string_interner_lookup(ua_parser->interner, id, length) : NULL;
+}
+
+
+void uap_parser_intern_stats(const struct uap_parser *ua_parser, struct uap_intern_stats *stats) {
+	if (ua_parser->interner) {
+		string_interner_stats(ua_parser->interner, stats);
+	} else {
+		memset(stats, 0, sizeof(struct uap_intern_stats));
+	}
+}
+
+
+void uap_parser_cache_stats(const struct uap_parser *ua_parser, struct uap_cache_stats *stats) {
+	if (ua_parser->cache) {
+		result_cache_stats(ua_parser->cache, stats);
+	} else {
+		memset(stats, 0, sizeof(struct uap_cache_stats));
+	}
+}
+
+
+int uap_parser_parse_string_len(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		size_t user_agent_length)
+{
+	return uap_parser_parse_groups(ua_parser, info, user_agent_string, user_agent_length, UAP_GROUP_ALL);
+}
+
+
+int uap_parser_parse_groups(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_info *info,
+		const char *user_agent_string,
+		size_t user_agent_length,
+		unsigned int groups)
+{
+	const bool use_cache = ua_parser->cache != NULL && user_agent_length <= INT_MAX;
+
+	if (use_cache) {
+		struct ua_cache_hit hit = { .info = info, .matched_groups = 0, .missed = false };
+		if (result_cache_lookup(ua_parser->cache, user_agent_string, user_agent_length, groups, &_ua_cache_hit_cb, &hit) && !hit.missed) {
+			return hit.matched_groups;
+		}
+	}
+
+	struct uap_useragent_spans spans;
+	char scratch[PARSE_SCRATCH_SIZE];
+	char *heap_scratch = NULL;
+	size_t scratch_size = sizeof(scratch);
+
+	int matched_groups = _uap_parser_parse(ua_parser, &spans, user_agent_string, user_agent_length, groups, scratch, &scratch_size);
+
+	// Unusually long replacements, parse again with enough scratch space
+	if (matched_groups == UAP_ERROR_SCRATCH_TOO_SMALL) {
+		heap_scratch = malloc(scratch_size);
+		// Without it the parse fails as too small, leaving the results untouched
+		if (heap_scratch != NULL) {
+			matched_groups = _uap_parser_parse(ua_parser, &spans, user_agent_string, user_agent_length, groups, heap_scratch, &scratch_size);
+		}
+	}
+
+	// Parses cut short by a limit still hand back what they found
+	const bool partial = matched_groups == UAP_ERROR_MATCH_LIMIT
+		|| matched_groups == UAP_ERROR_TIME_BUDGET
+		|| matched_groups == UAP_ERROR_PCRE;
+
+	size_t strings_size = 0;
+	if (matched_groups > 0 || partial) {
+		strings_size = ua_parse_state_create_useragent_info(info, &spans, ua_parser->interner);
+	}
+
+	if (matched_groups >= 0 || partial) {
+		info->rules = spans.rules;
+	}
+
+	if (use_cache && matched_groups >= 0) {
+		_ua_cache_store(ua_parser, user_agent_string, user_agent_length, groups, info, matched_groups, strings_size);
+	}
+
+	free(heap_scratch);
+
+	return matched_groups;
+}
+
+
+int uap_parser_parse_ids(
+		const struct uap_parser *ua_parser,
+		struct uap_useragent_ids *ids,
+		const char *user_agent_string,
+		size_t user_agent_length,
+		unsigned int groups)
+{
+	if (ua_parser->interner == NULL) {
+		return UAP_ERROR_NO_DICTIONARY;
+	}
+
+	struct uap_useragent_spans spans;
+	char scratch[PARSE_SCRATCH_SIZE];
+	char *heap_scratch = NULL;
+	size_t scratch_size = sizeof(scratch);
+
+	int matched_groups = _uap_parser_parse(ua_parser, &spans, user_agent_string, user_agent_length, groups, scratch, &scratch_size);
+
+	if (matched_groups == UAP_ERROR_SCRATCH_TOO_SMALL) {
+		heap_scratch = malloc(scratch_size);
+		if (heap_scratch != NULL) {
+			matched_groups = _uap_parser_parse(ua_parser, &spans, user_agent_string, user_agent_length, groups, heap_scratch, &scratch_size);
+		}
+	}
+
+	if (matched_groups != UAP_ERROR_SCRATCH_TOO_SMALL && matched_groups != UAP_ERROR_INPUT_TOO_LONG) {
+		const struct uap_span *src_field = (const struct uap_span*)&spans;
+		uint32_t *dst_field = (uint32_t*)ids;
+
+		// Fields which weren't matched are the empty string, ID 0
+		for (size_t i = 0; i < UAP_SPAN_FIELD_COUNT; i++) {
+			dst_field[i] = 0;
+			if (src_field[i].ptr && src_field[i].len > 0
+					&& !string_interner_intern(ua_parser->interner, src_field[i].ptr, src_field[i].len, &dst_field[i])) {
+				dst_field[i] = UAP_ID_NONE;
+			}
+		}
+		ids->rules = spans.rules;
 	}
 
-	ua_parse_state_destroy(&state, ua_parser->strings);
+	free(heap_scratch);
 
 	return matched_groups;
 }
 
 
+int uap_parser_jit_report(const struct uap_parser *ua_parser, FILE *out) {
+	const struct {
+		const char *name;
+		const struct ua_parser_group *group;
+	} groups[] = {
+		{ "user_agent", &ua_parser->user_agent_parser_group },
+		{ "os",         &ua_parser->os_parser_group },
+		{ "device",     &ua_parser->device_parser_group },
+	};
+
+	int jit_count = 0;
+
+	for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+		const struct ua_parser_group *group = groups[g].group;
+
+		for (uint32_t i = 0; i < group->num_rules; i++) {
+			const struct ua_rule_info *info = &group->rule_info[i];
+			jit_count += info->jit;
+
+			if (out) {
+				fprintf(out, "%s\t%u\t%s\t%s\n",
+						groups[g].name,
+						i,
+						info->jit ? "jit" : "interpreter",
+						unique_strings_get(&info->source));
+			}
+		}
+	}
+
+	if (out) {
+		fprintf(out, "%d of %u expressions JIT compiled\n", jit_count, ua_parser->num_rules);
+	}
+
+	return jit_count;
+}
+
+
+// Add up the counters of rule `rule_id` across all threads, including those
+// which have exited. The caller holds ua_thread_lock.
+static void _ua_rule_counters_sum(const struct uap_parser *ua_parser, uint32_t rule_id, struct uap_rule_stats *stats) {
+	stats->attempts = 0;
+	stats->matches = 0;
+	stats->nanoseconds = 0;
+
+	if (ua_parser->retired_counters) {
+		stats->attempts    = ua_parser->retired_counters[rule_id].attempts;
+		stats->matches     = ua_parser->retired_counters[rule_id].matches;
+		stats->nanoseconds = ua_parser->retired_counters[rule_id].nanoseconds;
+	}
+
+	for (const struct ua_thread_state *thread_state = ua_thread_states; thread_state; thread_state = thread_state->next) {
+		if (thread_state->parser != ua_parser) {
+			continue;
+		}
+		struct ua_rule_counters *counters = __atomic_load_n(&thread_state->rule_counters, __ATOMIC_ACQUIRE);
+		if (counters) {
+			stats->attempts    += __atomic_load_n(&counters[rule_id].attempts, __ATOMIC_RELAXED);
+			stats->matches     += __atomic_load_n(&counters[rule_id].matches, __ATOMIC_RELAXED);
+			stats->nanoseconds += __atomic_load_n(&counters[rule_id].nanoseconds, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+const char *uap_parser_rule_regex(const struct uap_parser *ua_parser, unsigned int group, int index) {
+	const struct ua_parser_group *parser_group =
+		group == UAP_GROUP_USER_AGENT ? &ua_parser->user_agent_parser_group :
+		group == UAP_GROUP_OS         ? &ua_parser->os_parser_group :
+		group == UAP_GROUP_DEVICE     ? &ua_parser->device_parser_group : NULL;
+
+	if (parser_group == NULL || index < 0 || (uint32_t)index >= parser_group->num_rules) {
+		return NULL;
+	}
+
+	return unique_strings_get(&parser_group->rule_info[index].source);
+}
+
+
+size_t uap_parser_rule_stats(const struct uap_parser *ua_parser, struct uap_rule_stats *stats, size_t max_stats) {
+	const struct {
+		unsigned int mask;
+		const struct ua_parser_group *group;
+	} groups[] = {
+		{ UAP_GROUP_USER_AGENT, &ua_parser->user_agent_parser_group },
+		{ UAP_GROUP_OS,         &ua_parser->os_parser_group },
+		{ UAP_GROUP_DEVICE,     &ua_parser->device_parser_group },
+	};
+
+	size_t count = 0;
+
+	pthread_mutex_lock(&ua_thread_lock);
+
+	for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+		const struct ua_parser_group *group = groups[g].group;
+
+		for (uint32_t i = 0; i < group->num_rules; i++, count++) {
+			if (count < max_stats) {
+				stats[count].group = groups[g].mask;
+				stats[count].index = i;
+				stats[count].regex = unique_strings_get(&group->rule_info[i].source);
+				_ua_rule_counters_sum(ua_parser, group->rules[i].rule_id, &stats[count]);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&ua_thread_lock);
+
+	return count;
+}
+
+
+int uap_parser_rule_stats_report(const struct uap_parser *ua_parser, FILE *out) {
+	const size_t num_rules = uap_parser_rule_stats(ua_parser, NULL, 0);
+	struct uap_rule_stats *stats = malloc((num_rules ? num_rules : 1) * sizeof(struct uap_rule_stats));
+
+	if (stats == NULL) {
+		return 0;
+	}
+
+	const size_t count = uap_parser_rule_stats(ua_parser, stats, num_rules);
+	uint64_t attempts = 0;
+	uint64_t matches = 0;
+	uint64_t nanoseconds = 0;
+
+	for (size_t i = 0; i < count && i < num_rules; i++) {
+		const char *group =
+			stats[i].group == UAP_GROUP_USER_AGENT ? "user_agent" :
+			stats[i].group == UAP_GROUP_OS         ? "os" : "device";
+
+		fprintf(out, "%s\t%u\t%llu\t%llu\t%llu\t%s\n",
+				group,
+				stats[i].index,
+				(unsigned long long)stats[i].attempts,
+				(unsigned long long)stats[i].matches,
+				(unsigned long long)stats[i].nanoseconds,
+				stats[i].regex);
+
+		attempts += stats[i].attempts;
+		matches += stats[i].matches;
+		nanoseconds += stats[i].nanoseconds;
+	}
+
+	fprintf(out, "%llu attempts, %llu matches, %.3f ms in pcre_exec\n",
+			(unsigned long long)attempts, (unsigned long long)matches, nanoseconds / 1e6);
+
+	free(stats);
+	return 1;
+}
+
+
 struct uap_useragent_info * uap_useragent_info_create() {
-	struct uap_useragent_info *info = calloc(1, sizeof(struct uap_useragent_info));
+	struct uap_useragent_info *info = malloc(sizeof(struct uap_useragent_info));
+	if (info != NULL) {
+		uap_useragent_info_init(info);
+	}
 	return info;
 }
 
 
 void uap_useragent_info_init(struct uap_useragent_info *info) {
 	memset(info, 0, sizeof(struct uap_useragent_info));
+	info->rules.user_agent = info->rules.os = info->rules.device = -1;
 }
 
 
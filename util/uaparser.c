@@ -1,6 +1,5 @@
 #include <stdio.h>
 #include "uap/uap.h"
-#include "regexes.yaml.h"
 
 int main(int argc, char **argv) {
 
@@ -9,10 +8,13 @@ int main(int argc, char **argv) {
 		return -1;
 	}
 
-	struct uap_parser *ua_parser = uap_parser_create();
-	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_parser *ua_parser = uap_parser_create_builtin();
+	if (ua_parser == NULL) {
+		fprintf(stderr, "failed to load the built-in rules\n");
+		return -1;
+	}
 
-	uap_parser_read_buffer(ua_parser, ___uap_core_regexes_yaml, ___uap_core_regexes_yaml_len);
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
 
 	if (uap_parser_parse_string(ua_parser, ua_info, argv[1])) {
 
@@ -0,0 +1,528 @@
+// Benchmark loading and parsing with the user agents of test case files
+//
+//   usage: uapbench [-j] [-n rounds] [-t threads] [-u strings] [-y regexes.yaml] <cases.yaml> [...]
+//
+// All "user_agent_string" values of the test case files are read into memory
+// up front. Parses run against the built-in ruleset, and report the time per
+// parse, its latency percentiles and allocations per parse, for each group on
+// its own and for all of them, through the info API with and without
+// interning, the spans API and the IDs API, then the throughput at 1 up to
+// `threads` threads. -y also times loading a "regexes.yaml", and -j creates the parsers
+// with UAP_PARSER_JIT. Last comes interning up to `strings` distinct strings
+// into a unique_strings_t, 0 skips it.
+//
+// The built-in matcher is usually compiled from the same uap-core test cases,
+// so their DFA states are warm from the start, as they would be in a long
+// running process.
+//
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <yaml.h>
+
+#include "uap/uap.h"
+#include "uap/unique_strings.h"
+
+// Enough for the replacements of any user agent in the test cases
+#define BENCH_SCRATCH_SIZE 4096
+
+
+// The parse functions measured by bench_latency()
+enum bench_api {
+	BENCH_INFO,   // uap_parser_parse_groups()
+	BENCH_SPANS,  // uap_parser_parse_spans_groups()
+	BENCH_INTERN, // uap_parser_parse_groups() with interning
+	BENCH_IDS,    // uap_parser_parse_ids()
+	BENCH_APIS,
+};
+
+static const char *const bench_api_names[BENCH_APIS] = { "info", "spans", "intern", "ids" };
+
+
+struct corpus {
+	struct uap_span *user_agents;
+	size_t count;
+};
+
+
+struct bench_thread {
+	const struct uap_parser *ua_parser;
+	const struct corpus *corpus;
+	unsigned int rounds;
+	size_t matched;
+};
+
+
+///#### Allocation counting
+//
+// With glibc the allocator can be wrapped by defining it here, which catches
+// the allocations made by PCRE as well as those of the library. Counts are
+// per thread, so only the thread which reads them is measured.
+//
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread uint64_t bench_allocations;
+
+void *malloc(size_t size) {
+	bench_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	bench_allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	bench_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+#define BENCH_COUNTS_ALLOCATIONS 1
+#define bench_allocation_count() (bench_allocations)
+
+#else
+
+#define BENCH_COUNTS_ALLOCATIONS 0
+#define bench_allocation_count() ((uint64_t)0)
+
+#endif
+
+
+static uint64_t bench_now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		fputs("uapbench: out of memory\n", stderr);
+		exit(1);
+	}
+	return ptr;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+///#### Test cases
+//
+// Only the user agents are kept, the expected results don't matter here.
+//
+static bool corpus_read_file(struct corpus *corpus, const char *path) {
+	FILE *fd = fopen(path, "rb");
+	if (fd == NULL) {
+		perror(path);
+		return false;
+	}
+
+	yaml_parser_t parser;
+	if (!yaml_parser_initialize(&parser)) {
+		fclose(fd);
+		return false;
+	}
+	yaml_parser_set_input_file(&parser, fd);
+
+	yaml_token_t token;
+	memset(&token, 0, sizeof(yaml_token_t));
+
+	bool ok = true;
+	bool is_key = false;
+	bool is_user_agent = false;
+
+	do {
+		yaml_token_delete(&token);
+		if (!yaml_parser_scan(&parser, &token)) {
+			fprintf(stderr, "uapbench: %s: %s at line %lu\n", path, parser.problem, (unsigned long)parser.problem_mark.line + 1);
+			ok = false;
+			break;
+		}
+
+		switch (token.type) {
+			case YAML_KEY_TOKEN: is_key = true; break;
+			case YAML_VALUE_TOKEN: is_key = false; break;
+			case YAML_SCALAR_TOKEN: {
+				const char *value = (const char*)token.data.scalar.value;
+				const size_t length = token.data.scalar.length;
+				if (is_key) {
+					is_user_agent = strcmp(value, "user_agent_string") == 0;
+				} else if (is_user_agent) {
+					char *copy = xrealloc(NULL, length + 1);
+					memcpy(copy, value, length + 1);
+					corpus->user_agents = xrealloc(corpus->user_agents, (corpus->count + 1) * sizeof(struct uap_span));
+					corpus->user_agents[corpus->count].ptr = copy;
+					corpus->user_agents[corpus->count].len = length;
+					corpus->count++;
+					is_user_agent = false;
+				}
+			} break;
+			default:
+				break;
+		}
+	} while (token.type != YAML_STREAM_END_TOKEN);
+
+	yaml_token_delete(&token);
+	yaml_parser_delete(&parser);
+	fclose(fd);
+	return ok;
+}
+
+
+static void corpus_free(struct corpus *corpus) {
+	for (size_t i = 0; i < corpus->count; i++) {
+		free((char*)corpus->user_agents[i].ptr);
+	}
+	free(corpus->user_agents);
+	corpus->user_agents = NULL;
+	corpus->count = 0;
+}
+
+
+///#### Loading
+static void report_load(const char *name, const struct uap_parser *ua_parser, uint64_t total_ns) {
+	struct uap_load_stats stats;
+	uap_parser_load_stats(ua_parser, &stats);
+	printf("%-8s %10.3f %10.3f %10.3f %10.3f %8u %8u\n",
+			name,
+			stats.read_ns / 1e6,
+			stats.compile_ns / 1e6,
+			stats.index_ns / 1e6,
+			total_ns / 1e6,
+			stats.compile_threads,
+			stats.failed_rules);
+}
+
+
+static struct uap_parser *load_yaml(const char *path, unsigned int flags) {
+	FILE *fd = fopen(path, "rb");
+	if (fd == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	const uint64_t start = bench_now_ns();
+	struct uap_parser *ua_parser = uap_parser_create_with_flags(flags);
+	if (ua_parser && !uap_parser_read_file(ua_parser, fd)) {
+		uap_parser_destroy(ua_parser);
+		ua_parser = NULL;
+	}
+	const uint64_t elapsed = bench_now_ns() - start;
+	fclose(fd);
+
+	if (ua_parser == NULL) {
+		fprintf(stderr, "uapbench: failed to load %s\n", path);
+		return NULL;
+	}
+
+	report_load("yaml", ua_parser, elapsed);
+	return ua_parser;
+}
+
+
+///#### Latency
+//
+// Every parse is timed on its own, which adds the cost of reading the clock
+// (tens of nanoseconds) to each, but is what the percentiles need.
+//
+static void bench_latency(
+		const struct uap_parser *ua_parser,
+		const struct corpus *corpus,
+		unsigned int rounds,
+		enum bench_api api,
+		unsigned int groups,
+		const char *name)
+{
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+	struct uap_useragent_spans ua_spans;
+	struct uap_useragent_ids ua_ids;
+	char scratch[BENCH_SCRATCH_SIZE];
+
+	const size_t num_samples = corpus->count * rounds;
+	uint64_t *samples = xrealloc(NULL, num_samples * sizeof(uint64_t));
+	uint64_t total_ns = 0;
+	size_t matched = 0;
+
+	// One untimed pass, so that JIT stacks and the like are in place first
+	for (unsigned int round = 0; round <= rounds; round++) {
+		const uint64_t allocations = bench_allocation_count();
+
+		for (size_t i = 0; i < corpus->count; i++) {
+			const struct uap_span *ua = &corpus->user_agents[i];
+			size_t scratch_size = sizeof(scratch);
+			int result;
+
+			const uint64_t start = bench_now_ns();
+			if (api == BENCH_SPANS) {
+				result = uap_parser_parse_spans_groups(ua_parser, &ua_spans, ua->ptr, ua->len, groups, scratch, &scratch_size);
+			} else if (api == BENCH_IDS) {
+				result = uap_parser_parse_ids(ua_parser, &ua_ids, ua->ptr, ua->len, groups);
+			} else {
+				result = uap_parser_parse_groups(ua_parser, ua_info, ua->ptr, ua->len, groups);
+			}
+			const uint64_t elapsed = bench_now_ns() - start;
+
+			if (round > 0) {
+				samples[(round - 1) * corpus->count + i] = elapsed;
+				total_ns += elapsed;
+				matched += result > 0;
+			}
+		}
+
+		if (round == rounds) {
+			const double per_parse = (double)(bench_allocation_count() - allocations) / corpus->count;
+			qsort(samples, num_samples, sizeof(uint64_t), &compare_u64);
+
+			printf("%-6s %-11s %10.0f %10lu %10lu %10lu %10lu %8.1f%% %9.2f",
+					bench_api_names[api],
+					name,
+					(double)total_ns / num_samples,
+					(unsigned long)samples[num_samples / 2],
+					(unsigned long)samples[num_samples * 99 / 100],
+					(unsigned long)samples[num_samples * 999 / 1000],
+					(unsigned long)samples[num_samples - 1],
+					100.0 * matched / num_samples,
+					BENCH_COUNTS_ALLOCATIONS ? per_parse : 0.0);
+			printf(BENCH_COUNTS_ALLOCATIONS ? "\n" : " (not counted)\n");
+		}
+	}
+
+	free(samples);
+	uap_useragent_info_destroy(ua_info);
+}
+
+
+///#### Throughput
+static void *bench_thread_run(void *arg) {
+	struct bench_thread *thread = arg;
+	struct uap_useragent_info *ua_info = uap_useragent_info_create();
+
+	for (unsigned int round = 0; round < thread->rounds; round++) {
+		for (size_t i = 0; i < thread->corpus->count; i++) {
+			const struct uap_span *ua = &thread->corpus->user_agents[i];
+			thread->matched += uap_parser_parse_string_len(thread->ua_parser, ua_info, ua->ptr, ua->len) > 0;
+		}
+	}
+
+	uap_useragent_info_destroy(ua_info);
+	return NULL;
+}
+
+
+///#### Interning
+//
+// Strings shaped like parse results, a prefix of a user agent and a number
+// which keeps them distinct, are added to a fresh pool once and then again,
+// so the second pass only finds what's there already.
+//
+static void bench_interning(const struct corpus *corpus, size_t count) {
+	char **strings = xrealloc(NULL, count * sizeof(char*));
+	for (size_t i = 0; i < count; i++) {
+		const struct uap_span *ua = &corpus->user_agents[i % corpus->count];
+		char string[64];
+		const int length = snprintf(string, sizeof(string), "%.*s %lu", ua->len < 24 ? (int)ua->len : 24, ua->ptr, (unsigned long)i);
+		strings[i] = xrealloc(NULL, length + 1);
+		memcpy(strings[i], string, length + 1);
+	}
+
+	for (size_t size = 1000;; size = size * 10 < count ? size * 10 : count) {
+		struct unique_strings_t *us = unique_strings_create();
+
+		uint64_t start = bench_now_ns();
+		for (size_t i = 0; i < size; i++) {
+			unique_strings_add(us, strings[i]);
+		}
+		const uint64_t add_ns = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (size_t i = 0; i < size; i++) {
+			unique_strings_add(us, strings[i]);
+		}
+		const uint64_t find_ns = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		unique_strings_freeze(us);
+		const uint64_t freeze_ns = bench_now_ns() - start;
+
+		size_t bytes;
+		unique_strings_data(us, &bytes);
+		printf("%-10lu %10.1f %10.1f %10.3f %10.2f\n",
+				(unsigned long)size,
+				(double)add_ns / size,
+				(double)find_ns / size,
+				freeze_ns / 1e6,
+				bytes / 1e6);
+
+		unique_strings_destroy(us);
+		if (size >= count) {
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(strings[i]);
+	}
+	free(strings);
+}
+
+
+// Every thread parses the whole corpus `rounds` times, so the total work
+// grows with the number of threads and ideal scaling keeps the time flat.
+static bool bench_threads(
+		const struct uap_parser *ua_parser,
+		const struct corpus *corpus,
+		unsigned int rounds,
+		unsigned int num_threads,
+		double *single_rate)
+{
+	pthread_t *handles = xrealloc(NULL, num_threads * sizeof(pthread_t));
+	struct bench_thread *threads = xrealloc(NULL, num_threads * sizeof(struct bench_thread));
+	unsigned int started = 0;
+
+	const uint64_t start = bench_now_ns();
+	for (; started < num_threads; started++) {
+		threads[started] = (struct bench_thread){ ua_parser, corpus, rounds, 0 };
+		if (pthread_create(&handles[started], NULL, &bench_thread_run, &threads[started]) != 0) {
+			break;
+		}
+	}
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(handles[i], NULL);
+	}
+	const uint64_t elapsed = bench_now_ns() - start;
+
+	if (started == num_threads) {
+		const double parses = (double)corpus->count * rounds * num_threads;
+		const double rate = parses / (elapsed / 1e9);
+		if (num_threads == 1) {
+			*single_rate = rate;
+		}
+		printf("%-7u %14.0f %10.0f %9.2fx\n", num_threads, rate, 1e9 / rate * num_threads, rate / *single_rate);
+	} else {
+		fprintf(stderr, "uapbench: could only start %u of %u threads\n", started, num_threads);
+	}
+
+	free(threads);
+	free(handles);
+	return started == num_threads;
+}
+
+
+int main(int argc, char **argv) {
+	unsigned int flags = 0;
+	unsigned int rounds = 10;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t num_strings = 200000;
+	const char *regexes_yaml = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jn:t:u:y:")) != -1) {
+		switch (opt) {
+			case 'j': flags |= UAP_PARSER_JIT; break;
+			case 'n': rounds = (unsigned int)strtoul(optarg, NULL, 10); break;
+			case 't': max_threads = strtol(optarg, NULL, 10); break;
+			case 'u': num_strings = strtoul(optarg, NULL, 10); break;
+			case 'y': regexes_yaml = optarg; break;
+			default: optind = argc + 1; break;
+		}
+	}
+
+	if (optind >= argc || rounds == 0 || max_threads < 1) {
+		fprintf(stderr, "usage: %s [-j] [-n rounds] [-t threads] [-u strings] [-y regexes.yaml] <cases.yaml> [...]\n", argv[0]);
+		return 1;
+	}
+
+	struct corpus corpus = { NULL, 0 };
+	for (int i = optind; i < argc; i++) {
+		if (!corpus_read_file(&corpus, argv[i])) {
+			corpus_free(&corpus);
+			return 1;
+		}
+	}
+	if (corpus.count == 0) {
+		fputs("uapbench: no user agents found\n", stderr);
+		return 1;
+	}
+
+	printf("%lu user agents, %u rounds%s\n\n", (unsigned long)corpus.count, rounds, flags & UAP_PARSER_JIT ? ", JIT" : "");
+
+	printf("%-8s %10s %10s %10s %10s %8s %8s\n", "load ms", "read", "compile", "index", "total", "threads", "failed");
+
+	const uint64_t start = bench_now_ns();
+	struct uap_parser *ua_parser = uap_parser_create_with_flags(flags);
+	if (ua_parser == NULL || !uap_parser_read_builtin(ua_parser)) {
+		fputs("uapbench: failed to load the built-in ruleset\n", stderr);
+		return 1;
+	}
+	report_load("builtin", ua_parser, bench_now_ns() - start);
+
+	if (regexes_yaml) {
+		struct uap_parser *yaml_parser = load_yaml(regexes_yaml, flags);
+		if (yaml_parser == NULL) {
+			return 1;
+		}
+		uap_parser_destroy(yaml_parser);
+	}
+
+	static const struct {
+		unsigned int groups;
+		const char *name;
+	} group_sets[] = {
+		{ UAP_GROUP_ALL,        "all" },
+		{ UAP_GROUP_USER_AGENT, "user_agent" },
+		{ UAP_GROUP_OS,         "os" },
+		{ UAP_GROUP_DEVICE,     "device" },
+	};
+
+	printf("\n%-6s %-11s %10s %10s %10s %10s %10s %9s %9s\n", "api", "groups", "ns/parse", "p50", "p99", "p99.9", "max", "matched", "allocs");
+	for (int api = 0; api < BENCH_APIS; api++) {
+		// Interning also builds the dictionary of IDs
+		if (api == BENCH_INTERN && !uap_parser_set_interning(ua_parser, 64 * 1024 * 1024)) {
+			break;
+		}
+		for (size_t i = 0; i < sizeof(group_sets) / sizeof(group_sets[0]); i++) {
+			bench_latency(ua_parser, &corpus, rounds, api, group_sets[i].groups, group_sets[i].name);
+		}
+	}
+	uap_parser_set_interning(ua_parser, 0);
+
+	// 1, 2, 4 ... up to and always including max_threads
+	printf("\n%-7s %14s %10s %10s\n", "threads", "parses/s", "ns/parse", "speedup");
+	double single_rate = 0;
+	for (long num_threads = 1;; num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads) {
+		if (!bench_threads(ua_parser, &corpus, rounds, (unsigned int)num_threads, &single_rate) || num_threads == max_threads) {
+			break;
+		}
+	}
+
+	if (num_strings > 0) {
+		printf("\n%-10s %10s %10s %10s %10s\n", "strings", "ns/add", "ns/find", "freeze ms", "MB");
+		bench_interning(&corpus, num_strings);
+	}
+
+	uap_parser_destroy(ua_parser);
+	corpus_free(&corpus);
+	return 0;
+}
@@ -0,0 +1,454 @@
+// Convert a "regexes.yaml" into the C tables described by uap/builtin_rules.h
+//
+//   usage: uapgen <regexes.yaml> > builtin_rules.c
+//          uapgen --matcher <regexes.yaml> [samples.yaml ...] > builtin_matcher.c
+//
+// The second form precomputes the DFA states each parser group's rule_dfa
+// reaches on the "user_agent_string" values found in the sample files, such
+// as the uap-core test cases.
+//
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yaml.h>
+
+#include "uap/builtin_rules.h"
+#include "uap/rule_dfa.h"
+
+
+struct string_pool {
+	char *data;
+	size_t used;
+	size_t capacity;
+	uint32_t *offsets; // open addressed table of offsets + 1, 0 when empty
+	size_t num_slots;
+	size_t num_strings;
+};
+
+
+struct sample_list {
+	char **strings;
+	size_t count;
+};
+
+
+struct rule_table {
+	struct builtin_rule *rules;
+	size_t num_rules;
+	struct builtin_replacement *replacements;
+	size_t num_replacements;
+};
+
+
+static uint32_t hash_fnv1a(const char *str) {
+	uint32_t hash = 2166136261u;
+	while (*str) {
+		hash = (hash ^ (unsigned char)*str++) * 16777619u;
+	}
+	return hash;
+}
+
+
+static void *xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		fprintf(stderr, "uapgen: out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+
+static void string_pool_grow_slots(struct string_pool *pool) {
+	const size_t num_slots = pool->num_slots ? pool->num_slots * 2 : 1024;
+	uint32_t *offsets = calloc(num_slots, sizeof(uint32_t));
+	if (offsets == NULL) {
+		fprintf(stderr, "uapgen: out of memory\n");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < pool->num_slots; i++) {
+		if (pool->offsets[i]) {
+			size_t slot = hash_fnv1a(&pool->data[pool->offsets[i] - 1]) & (num_slots - 1);
+			while (offsets[slot]) {
+				slot = (slot + 1) & (num_slots - 1);
+			}
+			offsets[slot] = pool->offsets[i];
+		}
+	}
+
+	free(pool->offsets);
+	pool->offsets = offsets;
+	pool->num_slots = num_slots;
+}
+
+
+// Add `str` to the pool unless it's already there, returning its offset.
+static uint32_t string_pool_add(struct string_pool *pool, const char *str) {
+	if ((pool->num_strings + 1) * 2 > pool->num_slots) {
+		string_pool_grow_slots(pool);
+	}
+
+	size_t slot = hash_fnv1a(str) & (pool->num_slots - 1);
+	while (pool->offsets[slot]) {
+		const uint32_t offset = pool->offsets[slot] - 1;
+		if (strcmp(&pool->data[offset], str) == 0) {
+			return offset;
+		}
+		slot = (slot + 1) & (pool->num_slots - 1);
+	}
+
+	const size_t size = strlen(str) + 1;
+	if (pool->used + size > pool->capacity) {
+		pool->capacity = (pool->used + size) * 2;
+		pool->data = xrealloc(pool->data, pool->capacity);
+	}
+
+	const uint32_t offset = pool->used;
+	memcpy(&pool->data[offset], str, size);
+	pool->used += size;
+	pool->offsets[slot] = offset + 1;
+	pool->num_strings++;
+
+	return offset;
+}
+
+
+static const char *scalar_value(yaml_node_t *node) {
+	if (node == NULL || node->type != YAML_SCALAR_NODE) {
+		return NULL;
+	}
+	return (const char*)node->data.scalar.value;
+}
+
+
+// Map a "*_replacement" key to its field within the group, following the
+// same naming as the runtime YAML loader. Returns -1 for unknown keys.
+static int replacement_field(enum builtin_rule_group group, const char *key) {
+	static const char *const user_agent_keys[] = {
+		"family_replacement", "v1_replacement", "v2_replacement", "v3_replacement", NULL,
+	};
+	static const char *const os_keys[] = {
+		"os_replacement", "os_v1_replacement", "os_v2_replacement", "os_v3_replacement", "os_v4_replacement", NULL,
+	};
+	static const char *const device_keys[] = {
+		"device_replacement", "brand_replacement", "model_replacement", NULL,
+	};
+	static const char *const *const group_keys[] = {
+		user_agent_keys, os_keys, device_keys,
+	};
+
+	const char *const *keys = group_keys[group];
+	for (int i = 0; keys[i]; i++) {
+		if (strcmp(keys[i], key) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+static bool add_rule(
+		struct rule_table *table,
+		struct string_pool *pool,
+		yaml_document_t *document,
+		yaml_node_t *mapping,
+		enum builtin_rule_group group)
+{
+	struct builtin_rule rule = {
+		.first_replacement = table->num_replacements,
+		.group = group,
+	};
+	const char *regex = NULL;
+
+	for (yaml_node_pair_t *pair = mapping->data.mapping.pairs.start; pair < mapping->data.mapping.pairs.top; pair++) {
+		const char *key = scalar_value(yaml_document_get_node(document, pair->key));
+		const char *value = scalar_value(yaml_document_get_node(document, pair->value));
+
+		if (key == NULL || value == NULL) {
+			continue;
+		}
+
+		if (strcmp(key, "regex") == 0) {
+			regex = value;
+
+		} else if (strcmp(key, "regex_flag") == 0) {
+			rule.regex_flag = value[0];
+
+		} else if (strstr(key, "_replacement") != NULL) {
+			const int field = replacement_field(group, key);
+			if (field < 0) {
+				fprintf(stderr, "uapgen: unknown replacement type %s\n", key);
+				continue;
+			}
+
+			table->replacements = xrealloc(table->replacements, (table->num_replacements + 1) * sizeof(struct builtin_replacement));
+			table->replacements[table->num_replacements].value = string_pool_add(pool, value);
+			table->replacements[table->num_replacements].field = field;
+			table->num_replacements++;
+			rule.num_replacements++;
+		}
+	}
+
+	if (regex == NULL) {
+		table->num_replacements = rule.first_replacement;
+		return false;
+	}
+
+	rule.regex = string_pool_add(pool, regex);
+	table->rules = xrealloc(table->rules, (table->num_rules + 1) * sizeof(struct builtin_rule));
+	table->rules[table->num_rules++] = rule;
+
+	return true;
+}
+
+
+static bool read_rules(FILE *fd, struct rule_table *table, struct string_pool *pool) {
+	yaml_parser_t parser;
+	yaml_document_t document;
+
+	if (!yaml_parser_initialize(&parser)) {
+		return false;
+	}
+	yaml_parser_set_input_file(&parser, fd);
+
+	if (!yaml_parser_load(&parser, &document)) {
+		fprintf(stderr, "uapgen: %s at line %lu\n", parser.problem, (unsigned long)parser.problem_mark.line + 1);
+		yaml_parser_delete(&parser);
+		return false;
+	}
+
+	yaml_node_t *root = yaml_document_get_root_node(&document);
+	bool ok = root != NULL && root->type == YAML_MAPPING_NODE;
+
+	for (yaml_node_pair_t *pair = ok ? root->data.mapping.pairs.start : NULL; ok && pair < root->data.mapping.pairs.top; pair++) {
+		const char *key = scalar_value(yaml_document_get_node(&document, pair->key));
+		yaml_node_t *rules = yaml_document_get_node(&document, pair->value);
+		enum builtin_rule_group group;
+
+		if (key == NULL || rules == NULL || rules->type != YAML_SEQUENCE_NODE) {
+			continue;
+		} else if (strcmp(key, "user_agent_parsers") == 0) {
+			group = BUILTIN_GROUP_USER_AGENT;
+		} else if (strcmp(key, "os_parsers") == 0) {
+			group = BUILTIN_GROUP_OS;
+		} else if (strcmp(key, "device_parsers") == 0) {
+			group = BUILTIN_GROUP_DEVICE;
+		} else {
+			continue;
+		}
+
+		for (yaml_node_item_t *item = rules->data.sequence.items.start; item < rules->data.sequence.items.top; item++) {
+			yaml_node_t *mapping = yaml_document_get_node(&document, *item);
+			if (mapping && mapping->type == YAML_MAPPING_NODE) {
+				add_rule(table, pool, &document, mapping, group);
+			}
+		}
+	}
+
+	yaml_document_delete(&document);
+	yaml_parser_delete(&parser);
+	return ok;
+}
+
+
+// Emit the pool as one literal per string, with every byte that isn't plain
+// printable ASCII written as a 3 digit octal escape so it can't run into the
+// characters which follow.
+static void write_strings(FILE *out, const struct string_pool *pool) {
+	fprintf(out, "static const char strings[] =\n");
+
+	size_t i = 0;
+	while (i < pool->used) {
+		fputs("\t\"", out);
+		for (; pool->data[i]; i++) {
+			const unsigned char c = pool->data[i];
+			if (c == '"' || c == '\\' || (c == '?' && pool->data[i + 1] == '?')) { // no trigraphs
+				fprintf(out, "\\%c", c);
+			} else if (c < 0x20 || c >= 0x7f) {
+				fprintf(out, "\\%03o", c);
+			} else {
+				fputc(c, out);
+			}
+		}
+		fputs("\\0\"\n", out);
+		i++;
+	}
+
+	fprintf(out, "\t;\n\n\n");
+}
+
+
+static void write_tables(FILE *out, const char *source, const struct rule_table *table, const struct string_pool *pool, uint32_t string_other) {
+	fprintf(out, "// Generated from %s by uapgen, do not edit.\n", source);
+	fprintf(out, "#include \"uap/builtin_rules.h\"\n\n\n");
+
+	write_strings(out, pool);
+
+	fprintf(out, "static const struct builtin_replacement replacements[] = {\n");
+	for (size_t i = 0; i < table->num_replacements; i++) {
+		fprintf(out, "\t{ %u, %u },\n", table->replacements[i].value, table->replacements[i].field);
+	}
+	fprintf(out, "\t{ 0, 0 },\n};\n\n\n");
+
+	fprintf(out, "static const struct builtin_rule rules[] = {\n");
+	for (size_t i = 0; i < table->num_rules; i++) {
+		const struct builtin_rule *rule = &table->rules[i];
+		fprintf(out, "\t{ %u, %u, %u, %u, %s },\n",
+				rule->regex, rule->first_replacement, rule->num_replacements, rule->group,
+				rule->regex_flag == 'i' ? "'i'" : "'\\0'");
+	}
+	fprintf(out, "\t{ 0, 0, 0, 0, '\\0' },\n};\n\n\n");
+
+	fprintf(out, "const struct builtin_ruleset builtin_ruleset = {\n");
+	fprintf(out, "\t.strings          = strings,\n");
+	fprintf(out, "\t.strings_size     = sizeof(strings) - 1,\n");
+	fprintf(out, "\t.string_other     = %u,\n", string_other);
+	fprintf(out, "\t.rules            = rules,\n");
+	fprintf(out, "\t.num_rules        = %lu,\n", (unsigned long)table->num_rules);
+	fprintf(out, "\t.replacements     = replacements,\n");
+	fprintf(out, "\t.num_replacements = %lu,\n", (unsigned long)table->num_replacements);
+	fprintf(out, "};\n");
+}
+
+
+// Collect every "user_agent_string" value in a test case file.
+static bool read_samples(const char *path, struct sample_list *samples) {
+	FILE *fd = fopen(path, "rb");
+	if (fd == NULL) {
+		perror(path);
+		return false;
+	}
+
+	yaml_parser_t parser;
+	yaml_document_t document;
+
+	if (!yaml_parser_initialize(&parser)) {
+		fclose(fd);
+		return false;
+	}
+	yaml_parser_set_input_file(&parser, fd);
+
+	const bool ok = yaml_parser_load(&parser, &document);
+	if (!ok) {
+		fprintf(stderr, "uapgen: %s: %s at line %lu\n", path, parser.problem, (unsigned long)parser.problem_mark.line + 1);
+	}
+
+	for (yaml_node_t *node = ok ? document.nodes.start : NULL; node && node < document.nodes.top; node++) {
+		if (node->type != YAML_MAPPING_NODE) {
+			continue;
+		}
+		for (yaml_node_pair_t *pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+			const char *key = scalar_value(yaml_document_get_node(&document, pair->key));
+			const char *value = scalar_value(yaml_document_get_node(&document, pair->value));
+			if (key && value && strcmp(key, "user_agent_string") == 0) {
+				samples->strings = xrealloc(samples->strings, (samples->count + 1) * sizeof(char*));
+				samples->strings[samples->count] = xrealloc(NULL, strlen(value) + 1);
+				strcpy(samples->strings[samples->count++], value);
+			}
+		}
+	}
+
+	if (ok) {
+		yaml_document_delete(&document);
+	}
+	yaml_parser_delete(&parser);
+	fclose(fd);
+	return ok;
+}
+
+
+// Build each group's rule_dfa the way the parser does, and write out its
+// states reached by the samples.
+static bool write_matchers(FILE *out, const char *source, const struct rule_table *table, const struct string_pool *pool, const struct sample_list *samples) {
+	static const char *const names[] = {
+		"user_agent_matcher", "os_matcher", "device_matcher",
+	};
+	bool ok = true;
+
+	fprintf(out, "// Generated from %s by uapgen, do not edit.\n", source);
+	fprintf(out, "#include \"uap/builtin_rules.h\"\n\n\n");
+
+	for (int group = 0; group < 3 && ok; group++) {
+		struct rule_dfa_t *dfa = rule_dfa_create();
+		if (dfa == NULL) {
+			return false;
+		}
+
+		for (size_t i = 0; i < table->num_rules; i++) {
+			const struct builtin_rule *rule = &table->rules[i];
+			if (rule->group == group) {
+				rule_dfa_add_regex(dfa, i, &pool->data[rule->regex], rule->regex_flag == 'i');
+			}
+		}
+
+		rule_dfa_compile(dfa);
+		ok = rule_dfa_write_table(dfa, out, names[group], (const char *const*)samples->strings, samples->count);
+		rule_dfa_destroy(dfa);
+	}
+
+	if (!ok) {
+		return false;
+	}
+
+	fprintf(out, "const struct rule_dfa_table *const builtin_matchers[] = {\n");
+	for (int group = 0; group < 3; group++) {
+		fprintf(out, "\t&%s,\n", names[group]);
+	}
+	fprintf(out, "};\n");
+
+	return true;
+}
+
+
+int main(int argc, char **argv) {
+	const bool matcher = argc > 1 && strcmp(argv[1], "--matcher") == 0;
+	const int first_arg = matcher ? 2 : 1;
+
+	if (argc <= first_arg) {
+		fprintf(stderr, "usage: %s [--matcher] <regexes.yaml> [samples.yaml ...]\n", argv[0]);
+		return 1;
+	}
+
+	const char *source = argv[first_arg];
+	FILE *fd = fopen(source, "rb");
+	if (fd == NULL) {
+		perror(source);
+		return 1;
+	}
+
+	struct string_pool pool = { NULL, 0, 0, NULL, 0, 0 };
+	struct rule_table table = { NULL, 0, NULL, 0 };
+
+	// "Other" is the default device family, and is always needed
+	const uint32_t string_other = string_pool_add(&pool, "Other");
+
+	struct sample_list samples = { NULL, 0 };
+
+	bool ok = read_rules(fd, &table, &pool);
+	fclose(fd);
+
+	for (int i = first_arg + 1; ok && matcher && i < argc; i++) {
+		ok = read_samples(argv[i], &samples);
+	}
+
+	if (ok && matcher) {
+		ok = write_matchers(stdout, source, &table, &pool, &samples);
+	} else if (ok) {
+		write_tables(stdout, source, &table, &pool, string_other);
+	}
+
+	for (size_t i = 0; i < samples.count; i++) {
+		free(samples.strings[i]);
+	}
+	free(samples.strings);
+
+	free(pool.data);
+	free(pool.offsets);
+	free(table.rules);
+	free(table.replacements);
+
+	return ok ? 0 : 1;
+}